@@ -0,0 +1,175 @@
+// vim: ts=2 sw=2 expandtab
+#include "BufferPool.h"
+#include <stdlib.h>
+
+TINY_MQTT_THREAD_LOCAL MqttBufferPool* MqttBufferPool::pool = nullptr;
+
+MqttBufferPool& MqttBufferPool::get()
+{
+  // Never deleted, buffers may be released by static objects at exit
+  if (pool == nullptr) pool = new MqttSlabPool;
+#ifdef TINY_MQTT_SHARDS
+  if (pool->returned.load(std::memory_order_relaxed)) pool->collect();
+#endif
+  return *pool;
+}
+
+void MqttBufferPool::set(MqttBufferPool* new_pool)
+{
+  pool = new_pool;
+}
+
+#ifdef TINY_MQTT_SHARDS
+void MqttBufferPool::releaseShared(char* block, size_t capacity)
+{
+  if (this == pool)
+  {
+    release(block, capacity);
+    return;
+  }
+  Returned* node = reinterpret_cast<Returned*>(block);
+  node->capacity = capacity;
+  node->next = returned.load(std::memory_order_relaxed);
+  while(not returned.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void MqttBufferPool::collect()
+{
+  Returned* node = returned.exchange(nullptr, std::memory_order_acquire);
+  while(node)
+  {
+    Returned* next = node->next;
+    release(reinterpret_cast<char*>(node), node->capacity);
+    node = next;
+  }
+}
+#endif
+
+MqttSlabPool::~MqttSlabPool()
+{
+  for(uint8_t shift=MinShift; shift<=MaxShift; shift++)
+  {
+    if ((size_t(1) << shift) <= SlabMax) continue;  // blocks belong to slabs
+    FreeBlock* block = classes[shift-MinShift].free;
+    while(block)
+    {
+      FreeBlock* next = block->next;
+      free(block);
+      block = next;
+    }
+  }
+  while(slabs)
+  {
+    FreeBlock* next = slabs->next;
+    free(slabs);
+    slabs = next;
+  }
+}
+
+uint8_t MqttSlabPool::classOf(size_t capacity)
+{
+  uint8_t shift = MinShift;
+  while((size_t(1) << shift) < capacity) shift++;
+  return shift;
+}
+
+void MqttSlabPool::push(uint8_t shift, char* block)
+{
+  Class& cls = classes[shift-MinShift];
+  FreeBlock* free_block = reinterpret_cast<FreeBlock*>(block);
+  free_block->next = cls.free;
+  cls.free = free_block;
+  cls.count++;
+}
+
+char* MqttSlabPool::allocate(size_t& capacity)
+{
+  uint8_t shift = classOf(capacity);
+  if (shift > MaxShift)
+  {
+    char* block = static_cast<char*>(malloc(capacity));
+    if (block) used(capacity, false);
+    return block;
+  }
+
+  capacity = size_t(1) << shift;
+  Class& cls = classes[shift-MinShift];
+  bool hit = cls.free != nullptr;
+  if (not hit and capacity <= SlabMax)
+  {
+    // The first cell of a slab links all the slabs together
+    char* slab = static_cast<char*>(malloc(sizeof(FreeBlock) + SlabBlocks*capacity));
+    if (slab == nullptr) return nullptr;
+    reinterpret_cast<FreeBlock*>(slab)->next = slabs;
+    slabs = reinterpret_cast<FreeBlock*>(slab);
+    for(uint8_t i=0; i<SlabBlocks; i++)
+      push(shift, slab + sizeof(FreeBlock) + i*capacity);
+  }
+
+  if (cls.free)
+  {
+    used(capacity, hit);
+    FreeBlock* block = cls.free;
+    cls.free = block->next;
+    cls.count--;
+    return reinterpret_cast<char*>(block);
+  }
+  char* block = static_cast<char*>(malloc(capacity));
+  if (block) used(capacity, false);
+  return block;
+}
+
+void MqttSlabPool::release(char* block, size_t capacity)
+{
+  unused(capacity);
+  uint8_t shift = classOf(capacity);
+  if (shift > MaxShift)
+    free(block);
+  else if (capacity <= SlabMax or classes[shift-MinShift].count < MaxCached)
+    push(shift, block);
+  else
+    free(block);
+}
+
+void MqttBuffer::release()
+{
+  if (ptr) MqttBufferPool::get().release(ptr, cap);
+  ptr = nullptr;
+  len = cap = 0;
+}
+
+#ifdef TINY_MQTT_SHARDS
+void MqttBuffer::release(MqttBufferPool& owner)
+{
+  if (ptr) owner.releaseShared(ptr, cap);
+  ptr = nullptr;
+  len = cap = 0;
+}
+#endif
+
+bool MqttBuffer::grow(size_t n)
+{
+  size_t capacity = n+1;
+  if (capacity < 2*cap) capacity = 2*cap;
+#ifdef TINY_MQTT_SHARDS
+  if (capacity < MqttBufferPool::MinCapacity) capacity = MqttBufferPool::MinCapacity;
+#endif
+  char* block = MqttBufferPool::get().allocate(capacity);
+  if (block == nullptr) return false;   // The old block is kept
+  if (len) memcpy(block, ptr, len);
+  block[len] = 0;
+  if (ptr) MqttBufferPool::get().release(ptr, cap);
+  ptr = block;
+  cap = capacity;
+  return true;
+}
+
+bool MqttBuffer::replace(size_t pos, size_t count, const char* src, size_t n)
+{
+  if (n > count and len+n-count >= cap and not grow(len+n-count)) return false;
+  memmove(ptr+pos+n, ptr+pos+count, len-pos-count);
+  memcpy(ptr+pos, src, n);
+  len = len+n-count;
+  ptr[len] = 0;
+  return true;
+}
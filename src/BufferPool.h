@@ -0,0 +1,213 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#ifdef TINY_MQTT_SHARDS
+#include <atomic>
+#endif
+
+// With TINY_MQTT_SHARDS, each thread of MqttShardedBroker has its own copy
+#ifndef TINY_MQTT_THREAD_LOCAL
+  #ifdef TINY_MQTT_SHARDS
+    #define TINY_MQTT_THREAD_LOCAL thread_local
+  #else
+    #define TINY_MQTT_THREAD_LOCAL
+  #endif
+#endif
+
+/***
+ * Storage of all MqttMessage / MqttFrame buffers.
+ *
+ * The default pool keeps released blocks in size classes (powers of 2),
+ * small classes are carved from slabs, so that a broker in steady state
+ * does not call malloc for each message.
+ * A custom pool can be installed with MqttBufferPool::set().
+ */
+class MqttBufferPool
+{
+  public:
+    struct Stats
+    {
+      uint32_t hits = 0;        // allocations served by the pool
+      uint32_t misses = 0;      // allocations that needed malloc
+      size_t in_use = 0;        // bytes currently allocated
+      size_t high_water = 0;    // max of in_use
+    };
+
+    virtual ~MqttBufferPool() {}
+
+    // capacity may be rounded up by the pool, nullptr when out of memory
+    virtual char* allocate(size_t& capacity) = 0;
+    virtual void release(char* block, size_t capacity) = 0;
+
+    const Stats& stats() const { return stats_; }
+    void resetStats() { stats_ = Stats(); }
+
+    static MqttBufferPool& get();
+
+    // Must be called before any buffer is allocated,
+    // and pool must outlive all the buffers it allocated.
+    // With TINY_MQTT_SHARDS, the pool is the one of the calling thread.
+    static void set(MqttBufferPool* new_pool);
+
+#ifdef TINY_MQTT_SHARDS
+    // Smallest block that can wait in the returned list
+    static const size_t MinCapacity = 2*sizeof(void*);
+
+    /** Releases a block of this pool from any thread. From another thread,
+        the block waits in a lock free list until the owner thread calls get(),
+        so that each pool gets its own blocks back (shared frames). **/
+    void releaseShared(char* block, size_t capacity);
+#endif
+
+  protected:
+    void used(size_t capacity, bool hit)
+    {
+      if (hit) stats_.hits++; else stats_.misses++;
+      stats_.in_use += capacity;
+      if (stats_.in_use > stats_.high_water) stats_.high_water = stats_.in_use;
+    }
+    void unused(size_t capacity) { stats_.in_use -= capacity; }
+
+  private:
+    Stats stats_;
+    static TINY_MQTT_THREAD_LOCAL MqttBufferPool* pool;
+
+#ifdef TINY_MQTT_SHARDS
+    struct Returned
+    {
+      Returned* next;
+      size_t capacity;
+    };
+    void collect();   // owner thread
+    std::atomic<Returned*> returned{nullptr};
+#endif
+};
+
+/***
+ * Default pool: free lists of blocks from 16 to 4096 bytes.
+ * Blocks up to SlabMax bytes are allocated by slabs of SlabBlocks blocks.
+ * At most MaxCached free blocks are kept per class, bigger blocks are not pooled.
+ */
+class MqttSlabPool : public MqttBufferPool
+{
+  public:
+    static const uint8_t MinShift = 4;       // 16 bytes
+    static const uint8_t MaxShift = 12;      // 4096 bytes
+    static const size_t SlabMax = 64;
+    static const uint8_t SlabBlocks = 16;
+    static const uint16_t MaxCached = 32;
+
+    ~MqttSlabPool();
+
+    char* allocate(size_t& capacity) override;
+    void release(char* block, size_t capacity) override;
+
+  private:
+    struct FreeBlock { FreeBlock* next; };
+    struct Class
+    {
+      FreeBlock* free = nullptr;
+      uint16_t count = 0;
+    };
+
+    static uint8_t classOf(size_t capacity);
+    void push(uint8_t cls, char* block);
+
+    Class classes[MaxShift-MinShift+1];
+    FreeBlock* slabs = nullptr;    // never freed while the pool lives
+};
+
+/***
+ * Growable byte buffer (subset of string) allocated by MqttBufferPool.
+ * The content is always followed by a '\0'
+ */
+class MqttBuffer
+{
+  public:
+    using value_type = char;
+
+    MqttBuffer() {}
+    MqttBuffer(const MqttBuffer& b) { append(b.data(), b.size()); }
+    MqttBuffer(MqttBuffer&& b) : ptr(b.ptr), len(b.len), cap(b.cap)
+    {
+      b.ptr = nullptr;
+      b.len = b.cap = 0;
+    }
+    ~MqttBuffer() { release(); }
+
+    MqttBuffer& operator=(const MqttBuffer& b)
+    {
+      if (this != &b)
+      {
+        clear();
+        append(b.data(), b.size());
+      }
+      return *this;
+    }
+
+    MqttBuffer& operator=(MqttBuffer&& b)
+    {
+      if (this != &b)
+      {
+        release();
+        ptr = b.ptr; len = b.len; cap = b.cap;
+        b.ptr = nullptr;
+        b.len = b.cap = 0;
+      }
+      return *this;
+    }
+
+    size_t size() const { return len; }
+    size_t length() const { return len; }
+    size_t capacity() const { return cap ? cap-1 : 0; }
+    const char* data() const { return ptr ? ptr : ""; }
+    const char* c_str() const { return data(); }
+    char& operator[](size_t i) { return ptr[i]; }
+    const char& operator[](size_t i) const { return ptr[i]; }
+    const char* begin() const { return data(); }
+    const char* end() const { return data()+len; }
+
+    // Keeps the storage
+    void clear() { len = 0; if (ptr) *ptr = 0; }
+
+    // Gives the storage back to the pool
+    void release();
+#ifdef TINY_MQTT_SHARDS
+    // Gives the storage back to owner, from any thread
+    void release(MqttBufferPool& owner);
+#endif
+
+    // The growing functions return false (buffer unchanged) when the pool is out of memory
+    bool reserve(size_t n) { return n < cap or grow(n); }
+
+    MqttBuffer& operator+=(char c)
+    {
+      append(&c, 1);
+      return *this;
+    }
+
+    bool append(const char* p, size_t n)
+    {
+      if (n == 0) return true;
+      if (len+n >= cap and not grow(len+n)) return false;
+      memcpy(ptr+len, p, n);
+      len += n;
+      ptr[len] = 0;
+      return true;
+    }
+
+    // Truncates the buffer at pos
+    void erase(size_t pos) { if (pos < len) { len = pos; ptr[len] = 0; } }
+
+    // Replaces count bytes at pos by the n bytes of src
+    bool replace(size_t pos, size_t count, const char* src, size_t n);
+
+  private:
+    bool grow(size_t n);
+
+    char* ptr = nullptr;
+    uint32_t len = 0;
+    uint32_t cap = 0;   // including the trailing '\0'
+};
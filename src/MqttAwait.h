@@ -0,0 +1,326 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include "TinyMqtt.h"
+
+#if __cplusplus >= 202002L and defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <map>
+#include <string>
+#include <vector>
+
+/***
+ * Return type of a coroutine using MqttAwaitClient.
+ *
+ * The coroutine starts at once and runs until its first co_await that
+ * cannot complete yet, then it is resumed by MqttAwaitClient::loop().
+ * Destroying the task destroys the coroutine where it is suspended.
+ */
+class MqttTask
+{
+  public:
+    struct promise_type
+    {
+      MqttTask get_return_object() { return MqttTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_always final_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() { std::terminate(); }
+    };
+
+    MqttTask(MqttTask&& task) : handle(task.handle) { task.handle = nullptr; }
+    MqttTask(const MqttTask&) = delete;
+    MqttTask& operator=(const MqttTask&) = delete;
+    ~MqttTask() { if (handle) handle.destroy(); }
+
+    bool done() const { return not handle or handle.done(); }
+
+  private:
+    explicit MqttTask(std::coroutine_handle<promise_type> h) : handle(h) {}
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+/***
+ * Coroutine interface of a MqttClient (C++20):
+ *
+ *   MqttAwaitClient mqtt(client);
+ *   if (co_await mqtt.connect("broker", 1883) == 0) ...    // CONNACK
+ *   uint8_t granted = co_await mqtt.subscribe("a/#", 1);   // SUBACK
+ *   co_await mqtt.publish("a/b", "on", 2, false, 1);       // PUBACK
+ *   auto msg = co_await mqtt.message();                    // next publish
+ *
+ * Each operation is sent when it is created, so that many of them can be
+ * in flight at once, and is completed by the matching ack (see
+ * MqttClient::setAckCallback). The coroutines waiting for a completed
+ * operation are resumed by loop(), which replaces the loop() of the client
+ * (never from inside the client, so a coroutine may delete it).
+ * Operations give 0x80 when they fail (ex: not connected, publish dropped),
+ * connect() gives the CONNACK return code (0 = accepted).
+ *
+ * The received publishes are queued (max_messages, oldest dropped) instead
+ * of calling a MqttClient::CallBack, and given by message().
+ * This object must outlive its operations and coroutines.
+ */
+class MqttAwaitClient
+{
+  public:
+    struct Message
+    {
+      std::string topic;
+      std::string payload;
+    };
+
+    class Operation
+    {
+      public:
+        Operation(Operation&& op) : owner(op.owner), ticket(op.ticket) { op.owner = nullptr; }
+        Operation(const Operation&) = delete;
+        Operation& operator=(const Operation&) = delete;
+        ~Operation() { if (owner) owner->forget(ticket); }
+
+        bool await_ready() const { return owner->find(ticket)->done; }
+        void await_suspend(std::coroutine_handle<> handle) { owner->find(ticket)->handle = handle; }
+        uint8_t await_resume() const { return owner->find(ticket)->code; }
+
+      private:
+        friend class MqttAwaitClient;
+        Operation(MqttAwaitClient* owner, uint32_t ticket) : owner(owner), ticket(ticket) {}
+
+        MqttAwaitClient* owner;
+        uint32_t ticket;
+    };
+
+    class NextMessage
+    {
+      public:
+        NextMessage(const NextMessage&) = delete;
+        ~NextMessage() { if (owner->reader == this) owner->reader = nullptr; }
+
+        bool await_ready() const { return owner->messages.size(); }
+        void await_suspend(std::coroutine_handle<> h) { owner->reader = this; handle = h; }
+        Message await_resume()
+        {
+          Message msg = std::move(owner->messages.front());
+          owner->messages.pop_front();
+          return msg;
+        }
+
+      private:
+        friend class MqttAwaitClient;
+        explicit NextMessage(MqttAwaitClient* owner) : owner(owner) {}
+
+        MqttAwaitClient* owner;
+        std::coroutine_handle<> handle;
+    };
+
+    explicit MqttAwaitClient(MqttClient& client, size_t max_messages=32)
+    : client(client), max_messages(max_messages)
+    {
+      client.setAckCallback(onAck, this);
+      routes()[&client] = this;
+      client.setCallback(onMessage);
+    }
+
+    ~MqttAwaitClient()
+    {
+      client.setAckCallback(nullptr, nullptr);
+      client.setCallback(nullptr);
+      routes().erase(&client);
+    }
+
+    MqttAwaitClient(const MqttAwaitClient&) = delete;
+    MqttAwaitClient& operator=(const MqttAwaitClient&) = delete;
+
+    /** Loop of the client, then resumes the coroutines whose operation is done **/
+    void loop()
+    {
+      client.loop();
+      while(ready.size())
+      {
+        std::vector<uint32_t> resume;
+        resume.swap(ready);
+        for(uint32_t ticket: resume)
+        {
+          if (ticket == 0)
+          {
+            if (reader and messages.size())
+            {
+              std::coroutine_handle<> handle = reader->handle;
+              reader = nullptr;
+              handle.resume();
+            }
+            continue;
+          }
+          Pending* pending = find(ticket);
+          if (pending and pending->handle)
+          {
+            std::coroutine_handle<> handle = pending->handle;
+            pending->handle = nullptr;
+            handle.resume();
+          }
+        }
+      }
+    }
+
+    Operation connect(MqttBroker* broker)
+    {
+      client.connect(broker);
+      return done(0);
+    }
+
+    Operation connect(const string& host, uint16_t port=1883, uint16_t keep_alive=10)
+    {
+      connecting = true;
+      client.connect(host, port, keep_alive);
+      connecting = false;
+#ifndef TINY_MQTT_ASYNC
+      if (not client.connected()) return done(0x80);
+#endif
+      return start(MqttMessage::Type::ConnAck, 0);
+    }
+
+    /** Gives the granted qos **/
+    Operation subscribe(const Topic& topic, uint8_t qos=0)
+    {
+      uint16_t id = client.packetId();
+      MqttError error = client.subscribe(topic, qos);
+      // Local broker: MqttNowhereToSend if it has no broker to forward to
+      if (client.packetId() == id) return done(error == MqttInvalidMessage ? 0x80 : qos);
+      if (not client.connected()) return done(0x80);   // sent again by the next connect()
+      return start(MqttMessage::Type::SubAck, client.packetId());
+    }
+
+    Operation unsubscribe(const Topic& topic)
+    {
+      uint16_t id = client.packetId();
+      MqttError error = client.unsubscribe(topic);
+      if (client.packetId() == id) return done(error == MqttInvalidMessage ? 0x80 : 0);
+      if (not client.connected()) return done(0x80);   // sent again by the next connect()
+      return start(MqttMessage::Type::UnSuback, client.packetId());
+    }
+
+    /** QoS 0 (or local broker) publishes are done when sent **/
+    Operation publish(const Topic& topic, const char* payload, size_t length, bool retain=false, uint8_t qos=0)
+    {
+      uint32_t sequence = client.publishSequence();
+      Operation op = start(MqttMessage::Type::Publish, sequence+1);   // may be dropped at once
+      MqttError error = client.publish(topic, payload, length, retain, qos);
+      if (client.publishSequence() == sequence) complete(op.ticket, error == MqttOk ? 0 : 0x80);
+      return op;
+    }
+    Operation publish(const Topic& topic, const string& payload, bool retain=false, uint8_t qos=0)
+    { return publish(topic, payload.c_str(), payload.length(), retain, qos); }
+
+    NextMessage message() { return NextMessage(this); }
+    size_t messagesCount() const { return messages.size(); }
+    uint32_t messagesDropped() const { return dropped; }
+
+    MqttClient& mqttClient() { return client; }
+
+  private:
+    struct Pending
+    {
+      uint32_t ticket;
+      MqttMessage::Type type;
+      uint32_t id;
+      bool done;
+      uint8_t code;
+      std::coroutine_handle<> handle;
+    };
+
+    Operation start(MqttMessage::Type type, uint32_t id)
+    {
+      if (++tickets == 0) tickets = 1;  // 0: message reader
+      pending.push_back(Pending{tickets, type, id, false, 0, nullptr});
+      return Operation(this, tickets);
+    }
+
+    Operation done(uint8_t code)
+    {
+      Operation op = start(MqttMessage::Type::Unknown, 0);
+      complete(op.ticket, code);
+      return op;
+    }
+
+    Pending* find(uint32_t ticket)
+    {
+      for(Pending& p: pending)
+        if (p.ticket == ticket) return &p;
+      return nullptr;
+    }
+
+    void forget(uint32_t ticket)
+    {
+      for(auto it = pending.begin(); it != pending.end(); ++it)
+        if (it->ticket == ticket)
+        {
+          pending.erase(it);
+          return;
+        }
+    }
+
+    void complete(uint32_t ticket, uint8_t code)
+    {
+      Pending* p = find(ticket);
+      if (p == nullptr or p->done) return;
+      p->done = true;
+      p->code = code;
+      if (p->handle) ready.push_back(ticket);   // else not awaited yet
+    }
+
+    static void onAck(void* context, MqttClient*, MqttMessage::Type type, uint32_t id, uint8_t code)
+    {
+      MqttAwaitClient* self = static_cast<MqttAwaitClient*>(context);
+      if (type == MqttMessage::Type::Disconnect)
+      {
+        if (self->connecting) return;
+        // Publishes are kept by the session, acked after the next connection
+        for(Pending& p: self->pending)
+          if (not p.done and p.type != MqttMessage::Type::Publish)
+            self->complete(p.ticket, 0x80);
+        return;
+      }
+      for(Pending& p: self->pending)
+        if (not p.done and p.type == type and p.id == id)
+        {
+          self->complete(p.ticket, code);
+          return;
+        }
+    }
+
+    static void onMessage(const MqttClient* source, const Topic& topic, const char* payload, size_t length)
+    {
+      auto it = routes().find(source);
+      if (it == routes().end()) return;
+      MqttAwaitClient* self = it->second;
+      if (self->max_messages == 0) return;
+      if (self->messages.size() >= self->max_messages)
+      {
+        self->messages.pop_front();
+        self->dropped++;
+      }
+      self->messages.push_back(Message{topic.str().c_str(), std::string(payload, length)});
+      if (self->reader) self->ready.push_back(0);
+    }
+
+    // MqttClient::CallBack has no context
+    static std::map<const MqttClient*, MqttAwaitClient*>& routes()
+    {
+      static std::map<const MqttClient*, MqttAwaitClient*> routes;
+      return routes;
+    }
+
+    MqttClient& client;
+    std::vector<Pending> pending;
+    std::vector<uint32_t> ready;    // tickets to resume (0: message reader)
+    uint32_t tickets = 0;
+    bool connecting = false;
+
+    std::deque<Message> messages;
+    size_t max_messages;
+    uint32_t dropped = 0;
+    NextMessage* reader = nullptr;
+};
+#endif
@@ -1,13 +1,31 @@
 // MqttReceiver must implement onPublish(...)
+//
+// A receiver can also be bound to topic filters, each binding calling its
+// own member function:
+//
+//   auto handle = MqttClassBinder<Light>::bind(&client, "home/light/#", &light, &Light::onLight);
+//   MqttClassBinder<Light>::unbind(handle);
+//
+// The filters of a client are matched all at once (TopicFilterSet, rebuilt
+// after a change), so a message only reaches the matching bindings.
+// The client must still subscribe to the topics.
+// Bindings are removed by their handle (O(1)), or when the receiver dies.
 template <class MqttReceiver>
 class MqttClassBinder
 {
   public:
+    using Method = void (MqttReceiver::*)(const MqttClient*, const Topic&, const char*, size_t);
+    using Handle = SlotHandle;
+
     MqttClassBinder()
     {
       unregister(this);
     }
-    ~MqttClassBinder() { unregister(this); }
+    ~MqttClassBinder()
+    {
+      unregister(this);
+      unbind(this);
+    }
 
     static void onUnpublished(MqttClient::CallBack handler)
     {
@@ -20,16 +38,61 @@ class MqttClassBinder
       client->setCallback(onRoutePublish);
     }
 
+    /** dest->*method receives the publishes of client matching filter **/
+    static Handle bind(MqttClient* client, const TopicFilter& filter, MqttReceiver* dest, Method method)
+    {
+      Index& index = indexes[client];
+      index.count++;
+      index.dirty = true;
+      client->setCallback(onRoutePublish);
+      return bindings.insert(Binding{client, filter, dest, method});
+    }
+
+    /** false if the handle is stale (already unbound) **/
+    static bool unbind(Handle handle)
+    {
+      Binding* binding = bindings.get(handle);
+      if (binding == nullptr) return false;
+      auto it = indexes.find(binding->client);
+      if (--it->second.count == 0)
+        indexes.erase(it);
+      else
+        it->second.dirty = true;
+      return bindings.erase(handle);
+    }
+
     void onPublish(const MqttClient* client, const Topic& topic, const char* payload, size_t length)
     {
       static_cast<MqttReceiver*>(this)->MqttReceiver::onPublish(client, topic, payload, length);
     }
 
     static size_t size() { return routes.size(); }
+    static size_t bindingsCount() { return bindings.size(); }
 
-    static void reset() { routes.clear(); }
+    static void reset()
+    {
+      routes.clear();
+      bindings.clear();
+      indexes.clear();
+    }
 
   private:
+    struct Binding
+    {
+      const MqttClient* client;
+      TopicFilter filter;
+      MqttClassBinder<MqttReceiver>* receiver;
+      Method method;
+    };
+
+    // bindings of one client, matched at once
+    struct Index
+    {
+      TopicFilterSet<TopicFilter> filters;
+      std::vector<Handle> handles;    // by filter id
+      size_t count = 0;
+      bool dirty = true;
+    };
 
     static void onRoutePublish(const MqttClient* client, const Topic& topic, const char* payload, size_t length)
     {
@@ -41,12 +104,49 @@ class MqttClassBinder
         unrouted = false;
       }
 
+      // matching may grow if a receiver publishes again, so use indexes
+      size_t first = matching.size();
+      match(client, topic);
+      size_t last = matching.size();
+      for(size_t i=first; i<last; i++)
+      {
+        Binding* binding = bindings.get(matching[i]);
+        if (binding == nullptr) continue;   // unbound by a previous receiver
+        MqttReceiver* receiver = static_cast<MqttReceiver*>(binding->receiver);
+        (receiver->*binding->method)(client, topic, payload, length);
+        unrouted = false;
+      }
+      matching.resize(first);
+
       if (unrouted and unrouted_handler)
       {
         unrouted_handler(client, topic, payload, length);
       }
     }
 
+    // appends the handles of the bindings of client matching topic
+    static void match(const MqttClient* client, const Topic& topic)
+    {
+      auto it = indexes.find(client);
+      if (it == indexes.end()) return;
+      Index& index = it->second;
+      if (index.dirty)
+      {
+        index.filters.clear();
+        index.handles.clear();
+        for(size_t i=0; i<bindings.size(); i++)
+          if (bindings[i].client == client)
+          {
+            index.filters.add(bindings[i].filter);
+            index.handles.push_back(bindings.handle(i));
+          }
+        index.dirty = false;
+      }
+      ids.clear();
+      index.filters.match(topic, ids);
+      for(auto id: ids) matching.push_back(index.handles[id]);
+    }
+
   private:
     void unregister(MqttClassBinder<MqttReceiver>* which)
     {
@@ -59,9 +159,22 @@ class MqttClassBinder
         }
     }
 
+    // bindings of a dying receiver
+    static void unbind(MqttClassBinder<MqttReceiver>* which)
+    {
+      size_t i = bindings.size();
+      while(i--)
+        if (bindings[i].receiver == which)
+          unbind(bindings.handle(i));
+    }
+
   static std::multimap<const MqttClient*, MqttClassBinder<MqttReceiver>*> routes;
   static MqttClient::CallBack unrouted_handler;
 
+  static SlotMap<Binding> bindings;
+  static std::map<const MqttClient*, Index> indexes;
+  static std::vector<Handle> matching;
+  static std::vector<typename TopicFilterSet<TopicFilter>::Id> ids;
 };
 
 template<class MqttReceiver>
@@ -70,3 +183,15 @@ std::multimap<const MqttClient*, MqttClassBinder<MqttReceiver>*> MqttClassBinder
 template<class MqttReceiver>
 MqttClient::CallBack MqttClassBinder<MqttReceiver>::unrouted_handler = nullptr;
 
+template<class MqttReceiver>
+SlotMap<typename MqttClassBinder<MqttReceiver>::Binding> MqttClassBinder<MqttReceiver>::bindings;
+
+template<class MqttReceiver>
+std::map<const MqttClient*, typename MqttClassBinder<MqttReceiver>::Index> MqttClassBinder<MqttReceiver>::indexes;
+
+template<class MqttReceiver>
+std::vector<SlotHandle> MqttClassBinder<MqttReceiver>::matching;
+
+template<class MqttReceiver>
+std::vector<typename TopicFilterSet<TopicFilter>::Id> MqttClassBinder<MqttReceiver>::ids;
+
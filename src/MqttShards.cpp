@@ -0,0 +1,165 @@
+// vim: ts=2 sw=2 expandtab
+#include "MqttShards.h"
+
+#ifdef TINY_MQTT_SHARDS
+MqttFrameQueue::MqttFrameQueue(size_t capacity)
+{
+  size_t size = 1;
+  while(size < capacity) size <<= 1;
+  cells.reset(new Cell[size]);
+  for(size_t pos=0; pos<size; pos++) cells[pos].sequence.store(pos, std::memory_order_relaxed);
+  mask = size-1;
+}
+
+bool MqttFrameQueue::push(const MqttFrame& frame)
+{
+  size_t pos = tail.load(std::memory_order_relaxed);
+  Cell* cell;
+  while(true)
+  {
+    cell = &cells[pos & mask];
+    size_t sequence = cell->sequence.load(std::memory_order_acquire);
+    intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+    if (diff == 0)
+    {
+      if (tail.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+    }
+    else if (diff < 0)
+      return false;   // not popped yet: full
+    else
+      pos = tail.load(std::memory_order_relaxed);   // taken by another producer
+  }
+  cell->frame = frame;
+  cell->sequence.store(pos+1, std::memory_order_release);
+  return true;
+}
+
+bool MqttFrameQueue::pop(MqttFrame& frame)
+{
+  Cell& cell = cells[head & mask];
+  if (cell.sequence.load(std::memory_order_acquire) != head+1) return false;
+  frame = std::move(cell.frame);
+  cell.sequence.store(head+mask+1, std::memory_order_release);  // free for the next round
+  head++;
+  return true;
+}
+
+MqttShardedBroker::MqttShardedBroker(uint16_t port, uint8_t shards, uint32_t retain_size)
+  : port(port), count(shards ? shards : 1), retain_size(retain_size), shards_(new Shard[count])
+{
+}
+
+void MqttShardedBroker::begin()
+{
+  if (running) return;
+  running = true;
+  started = 0;
+  stopped = 0;
+  for(uint8_t shard=0; shard<count; shard++)
+    shards_[shard].thread = std::thread(&MqttShardedBroker::run, this, shard);
+  while(started < count) std::this_thread::yield();
+}
+
+void MqttShardedBroker::end()
+{
+  if (not running) return;
+  running = false;
+  for(uint8_t shard=0; shard<count; shard++)
+  {
+    TcpServer* server = shards_[shard].server;
+    if (server) server->wake();
+  }
+  stopped++;    // the servers can be deleted now
+  for(uint8_t shard=0; shard<count; shard++) shards_[shard].thread.join();
+}
+
+void MqttShardedBroker::run(uint8_t index)
+{
+  Shard& shard = shards_[index];
+  {
+    // Created by its thread: its strings and buffers are those of this thread
+    MqttBroker broker(port, retain_size);
+    broker.shards = this;
+    broker.shard = index;
+    broker.server->reusePort(true);
+    broker.begin();
+    shard.server = broker.server;
+    started++;
+
+    while(running) broker.loop(1000);
+
+    // Other shards may still forward and wake this one, until they all stop
+    stopped++;
+    while(stopped <= count) std::this_thread::yield();
+    shard.server = nullptr;
+  }
+  MqttFrame frame;
+  while(shard.queue.pop(frame)) {}
+  shard.pending = 0;
+  shard.clients = 0;
+}
+
+void MqttShardedBroker::forward(uint8_t from, const MqttFrame& frame)
+{
+  for(uint8_t index=0; index<count; index++)
+  {
+    if (index == from) continue;
+    Shard& shard = shards_[index];
+    // pending is never lower than the frames in the queue
+    bool asleep = shard.pending.fetch_add(1) == 0;
+    if (not shard.queue.push(frame))
+    {
+      shard.pending--;
+      shards_[from].dropped.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+    shards_[from].forwarded.fetch_add(1, std::memory_order_relaxed);
+    if (asleep)
+    {
+      TcpServer* server = shard.server;
+      if (server) server->wake();
+    }
+  }
+}
+
+void MqttShardedBroker::receive(MqttBroker& broker)
+{
+  Shard& shard = shards_[broker.shard];
+  shard.clients.store(broker.clients.size(), std::memory_order_relaxed);
+
+  // At most one queue per loop, so that the clients of this shard are served too
+  uint32_t received = 0;
+  MqttFrame frame;
+  broker.from_shard = true;
+  while(received < shard.queue.capacity() and shard.queue.pop(frame))
+  {
+    received++;
+    MqttMessage msg(frame);
+    const char* topic = msg.getVHeader();
+    broker.publish(nullptr, Topic(topic+2, MqttMessage::getSize(topic)), msg);
+  }
+  broker.from_shard = false;
+  if (received) shard.pending -= received;
+}
+
+size_t MqttShardedBroker::clientsCount() const
+{
+  size_t clients = 0;
+  for(uint8_t shard=0; shard<count; shard++) clients += shards_[shard].clients.load(std::memory_order_relaxed);
+  return clients;
+}
+
+uint64_t MqttShardedBroker::forwarded() const
+{
+  uint64_t frames = 0;
+  for(uint8_t shard=0; shard<count; shard++) frames += shards_[shard].forwarded.load(std::memory_order_relaxed);
+  return frames;
+}
+
+uint64_t MqttShardedBroker::dropped() const
+{
+  uint64_t frames = 0;
+  for(uint8_t shard=0; shard<count; shard++) frames += shards_[shard].dropped.load(std::memory_order_relaxed);
+  return frames;
+}
+#endif
@@ -0,0 +1,112 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include "TinyMqtt.h"
+
+#ifdef TINY_MQTT_SHARDS
+#include <atomic>
+#include <memory>
+#include <thread>
+
+// Publishes waiting in the queue of a shard, next ones are dropped
+#ifndef TINY_MQTT_SHARD_QUEUE
+#define TINY_MQTT_SHARD_QUEUE 4096
+#endif
+
+/***
+ * Bounded lock free queue of frames: many threads push, one pops.
+ *
+ * Each cell has a sequence number telling whether it is free for the
+ * producer of position pos (pos) or ready for the consumer (pos+1).
+ * Producers reserve a position with a compare and swap, push() returns
+ * false when the queue is full.
+ */
+class MqttFrameQueue
+{
+  public:
+    explicit MqttFrameQueue(size_t capacity);   // rounded up to a power of 2
+
+    bool push(const MqttFrame& frame);  // any thread
+    bool pop(MqttFrame& frame);         // consumer thread only
+
+    size_t capacity() const { return mask+1; }
+
+  private:
+    struct Cell
+    {
+      std::atomic<size_t> sequence;
+      MqttFrame frame;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    std::atomic<size_t> tail{0};  // next position to push
+    char padding[64];             // producers and consumer use other cache lines
+    size_t head = 0;              // next position to pop
+};
+
+/***
+ * Broker running on several threads (Linux, TINY_MQTT_EPOLL).
+ *
+ * Each shard is a MqttBroker with its own thread, listener (the kernel
+ * spreads the connections, SO_REUSEPORT), epoll and timers. Strings,
+ * buffers and timers are per thread (TINY_MQTT_THREAD_LOCAL), so a shard
+ * never locks. A publish received by a shard is delivered to its clients,
+ * and its frame (shared, not copied) is pushed to the queue of each other
+ * shard, which delivers it to its own subscribers: each shard only matches
+ * its own subscriptions, and retains all the retained messages.
+ *
+ * Sessions and client ids are known by one shard only: a client that
+ * reconnects to another shard starts a new session. Streamed publishes
+ * are not forwarded to the other shards.
+ * As for the main thread, the strings and buffer pool of a shard thread
+ * are never deleted. A frame released by another shard goes back to the
+ * pool of the shard that built it (MqttBufferPool::releaseShared).
+ */
+class MqttShardedBroker
+{
+  public:
+    MqttShardedBroker(uint16_t port, uint8_t shards, uint32_t retain_size=0);
+    ~MqttShardedBroker() { end(); }
+
+    /** Starts the threads, returns when all the shards listen **/
+    void begin();
+    /** Stops and joins the threads, clients are disconnected **/
+    void end();
+
+    uint8_t shards() const { return count; }
+    size_t clientsCount() const;
+    /** Frames pushed to other shards, and dropped because a queue was full **/
+    uint64_t forwarded() const;
+    uint64_t dropped() const;
+
+  private:
+    friend class MqttBroker;
+
+    struct Shard
+    {
+      Shard() : queue(TINY_MQTT_SHARD_QUEUE) {}
+      std::thread thread;
+      MqttFrameQueue queue;
+      std::atomic<uint32_t> pending{0};     // frames in (or being pushed to) queue
+      std::atomic<TcpServer*> server{nullptr};
+      std::atomic<size_t> clients{0};
+      std::atomic<uint64_t> forwarded{0};   // by this shard
+      std::atomic<uint64_t> dropped{0};
+    };
+
+    void run(uint8_t shard);
+
+    // Called by the shards
+    void forward(uint8_t from, const MqttFrame& frame);
+    bool pending(uint8_t shard) const { return shards_[shard].pending.load(std::memory_order_relaxed) != 0; }
+    void receive(MqttBroker& broker);
+
+    uint16_t port;
+    uint8_t count;
+    uint32_t retain_size;
+    std::unique_ptr<Shard[]> shards_;
+    std::atomic<bool> running{false};
+    std::atomic<uint8_t> started{0};
+    std::atomic<uint8_t> stopped{0};  // shards out of their loop, plus end()
+};
+#endif
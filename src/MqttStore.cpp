@@ -0,0 +1,401 @@
+// vim: ts=2 sw=2 expandtab
+#include "MqttStore.h"
+
+#if TINY_MQTT_FILE_STORE
+#include <Arduino.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+
+namespace
+{
+  // File header: magic, generation
+  const size_t HeaderSize = 8;
+  const char SnapMagic[] = "TMQS";
+  const char LogMagic[] = "TMQL";
+
+  // Record: type, key_len, data_len, key, data, crc32
+  const size_t RecordHeader = 7;
+  const size_t RecordOverhead = RecordHeader+4;
+
+  uint32_t crc32(const char* data, size_t len)
+  {
+    static const uint32_t table[16] = {
+      0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+      0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C };
+    uint32_t crc = ~0u;
+    while(len--)
+    {
+      crc ^= static_cast<uint8_t>(*data++);
+      crc = (crc >> 4) ^ table[crc & 0xF];
+      crc = (crc >> 4) ^ table[crc & 0xF];
+    }
+    return ~crc;
+  }
+
+  void put(std::string& out, uint32_t value, uint8_t bytes)
+  {
+    while(bytes--)
+    {
+      out += static_cast<char>(value & 0xFF);
+      value >>= 8;
+    }
+  }
+
+  uint32_t get(const char* in, uint8_t bytes)
+  {
+    uint32_t value = 0;
+    for(uint8_t i=0; i<bytes; i++)
+      value |= static_cast<uint32_t>(static_cast<uint8_t>(in[i])) << (8*i);
+    return value;
+  }
+
+  void encode(std::string& out, const MqttStore::Record& record)
+  {
+    size_t start = out.size();
+    out += static_cast<char>(record.type);
+    put(out, record.key_len, 2);
+    put(out, record.data_len, 4);
+    out.append(record.key, record.key_len);
+    if (record.data_len) out.append(record.data, record.data_len);
+    put(out, crc32(out.data()+start, out.size()-start), 4);
+  }
+
+  std::string header(const char* magic, uint32_t generation)
+  {
+    std::string out(magic, 4);
+    put(out, generation, 4);
+    return out;
+  }
+
+  bool syncFile(int fd)
+  {
+#ifdef __APPLE__
+    return fsync(fd) == 0;
+#else
+    return fdatasync(fd) == 0;
+#endif
+  }
+}
+
+MqttFileStore::MqttFileStore(const char* path) : path(path) {}
+
+MqttFileStore::~MqttFileStore()
+{
+  sync(true);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_one();
+  if (writer.joinable()) writer.join();
+  if (log_fd >= 0) close(log_fd);
+}
+
+MqttFileStore::Stats MqttFileStore::stats() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return stats_;
+}
+
+bool MqttFileStore::writeAll(int fd, const std::string& bytes)
+{
+  const char* data = bytes.data();
+  size_t left = bytes.size();
+  while(left)
+  {
+    ssize_t written = write(fd, data, left);
+    if (written < 0)
+    {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += written;
+    left -= written;
+  }
+  return true;
+}
+
+// Calls callback for each valid record, returns the size of the valid part
+size_t MqttFileStore::replay(const char* begin, const char* end, RecordCallBack callback, void* context)
+{
+  const char* p = begin;
+  while(end-p >= (long)RecordOverhead)
+  {
+    Record record;
+    record.type = static_cast<Type>(p[0]);
+    record.key_len = get(p+1, 2);
+    record.data_len = get(p+3, 4);
+    size_t size = RecordOverhead + record.key_len + record.data_len;
+    if (size > size_t(end-p)) break;
+    if (get(p+size-4, 4) != crc32(p, size-4)) break;
+    record.key = p+RecordHeader;
+    record.data = record.key+record.key_len;
+    if (callback) callback(context, record);
+    p += size;
+  }
+  if (p != end)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stats_.dropped++;
+  }
+  return p-begin;
+}
+
+// Called by MqttBroker::begin(), before records are queued
+bool MqttFileStore::load(RecordCallBack callback, void* context)
+{
+  flush();
+  return open(callback, context);
+}
+
+bool MqttFileStore::open(RecordCallBack callback, void* context)
+{
+  generation = 0;
+  size_t snap = 0;
+
+  // Snapshot, mapped and parsed in place
+  int fd = ::open((path+".snap").c_str(), O_RDONLY);
+  if (fd >= 0)
+  {
+    struct stat st;
+    if (fstat(fd, &st) == 0 and size_t(st.st_size) >= HeaderSize)
+    {
+      size_t size = st.st_size;
+      void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED)
+      {
+        const char* data = static_cast<const char*>(map);
+#ifdef MADV_SEQUENTIAL
+        madvise(map, size, MADV_SEQUENTIAL);
+#endif
+        if (memcmp(data, SnapMagic, 4) == 0)
+        {
+          generation = get(data+4, 4);
+          snap = HeaderSize + replay(data+HeaderSize, data+size, callback, context);
+        }
+        munmap(map, size);
+      }
+    }
+    close(fd);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    snap_size = snap;
+    stats_.snapshot_bytes = snap;
+  }
+
+  // Log, used only if it follows this snapshot
+  if (log_fd >= 0) close(log_fd);
+  log_fd = ::open((path+".log").c_str(), O_RDWR | O_CREAT, 0644);
+  if (log_fd < 0) return false;
+
+  struct stat st;
+  std::string log;
+  if (fstat(log_fd, &st) == 0 and size_t(st.st_size) >= HeaderSize)
+  {
+    log.resize(st.st_size);
+    if (pread(log_fd, &log[0], log.size(), 0) != (ssize_t)log.size()) log.clear();
+  }
+  if (log.size() < HeaderSize or memcmp(log.data(), LogMagic, 4) or get(log.data()+4, 4) != generation)
+    return resetLog();
+
+  size_t valid = HeaderSize + replay(log.data()+HeaderSize, log.data()+log.size(), callback, context);
+  if (valid != log.size() and ftruncate(log_fd, valid) != 0) return false;  // drops a torn record
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stats_.log_bytes = valid;
+  }
+  return lseek(log_fd, 0, SEEK_END) >= 0;
+}
+
+bool MqttFileStore::resetLog()
+{
+  if (ftruncate(log_fd, 0) != 0 or lseek(log_fd, 0, SEEK_SET) != 0) return false;
+  if (not writeAll(log_fd, header(LogMagic, generation)) or not syncFile(log_fd)) return false;
+  std::lock_guard<std::mutex> lock(mutex);
+  stats_.log_bytes = HeaderSize;
+  return true;
+}
+
+void MqttFileStore::append(const Record& record)
+{
+  encode(pending, record);
+}
+
+void MqttFileStore::sync(bool force)
+{
+  if (pending.size() and (force or not sync_interval or millis()-last_sync >= sync_interval))
+  {
+    queue(false, pending);
+    last_sync = millis();
+  }
+  if (force) flush();
+}
+
+bool MqttFileStore::compactNeeded() const
+{
+  if (snapshotting) return false;
+  std::lock_guard<std::mutex> lock(mutex);
+  size_t log = stats_.log_bytes + queued_bytes + pending.size();
+  return not snapshot_queued and log > compact_min and log > compact_ratio*snap_size;
+}
+
+bool MqttFileStore::beginSnapshot()
+{
+  if (snapshotting) return false;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (snapshot_queued) return false;
+  }
+  snapshotting = true;
+  snap_buffer.clear();
+  return true;
+}
+
+void MqttFileStore::snapshot(const Record& record)
+{
+  if (snapshotting) encode(snap_buffer, record);
+}
+
+bool MqttFileStore::endSnapshot()
+{
+  if (not snapshotting) return false;
+  snapshotting = false;
+  // The records before the snapshot are kept in the log, in case it fails
+  if (pending.size()) queue(false, pending);
+  queue(true, snap_buffer);
+  std::string().swap(snap_buffer);
+  return true;
+}
+
+// Moves bytes to a new job, or to the last one
+void MqttFileStore::queue(bool snapshot, std::string& bytes)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (not writer.joinable()) writer = std::thread(&MqttFileStore::run, this);
+    if (snapshot)
+      snapshot_queued = true;
+    else
+      queued_bytes += bytes.size();
+    if (not snapshot and jobs.size() and not jobs.back().snapshot)
+      jobs.back().bytes += bytes;
+    else
+      jobs.push_back(Job{snapshot, std::move(bytes)});
+    bytes.clear();
+  }
+  wake.notify_one();
+}
+
+void MqttFileStore::flush()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  wake.notify_one();    // retries a failed write now
+  uint32_t start = rounds;
+  while((jobs.size() or writing) and not (failed and rounds != start))
+    done.wait(lock);
+}
+
+void MqttFileStore::run()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  while(not stopping or (jobs.size() and not failed))
+  {
+    if (jobs.empty())
+    {
+      wake.wait(lock);
+      continue;
+    }
+    if (failed)
+    {
+      // Retried after a while, or when more is queued
+      wake.wait_for(lock, std::chrono::seconds(1));
+      failed = false;
+      continue;
+    }
+
+    Job job = std::move(jobs.front());
+    jobs.pop_front();
+    writing = true;
+    lock.unlock();
+    bool ok = job.snapshot ? writeSnapshot(job.bytes) : writeLog(job.bytes);
+    lock.lock();
+    writing = false;
+
+    if (job.snapshot)
+      snapshot_queued = false;  // if it failed, the log still has everything
+    else if (ok)
+      queued_bytes -= job.bytes.size();
+    else if (jobs.size() and not jobs.front().snapshot)
+      jobs.front().bytes.insert(0, job.bytes);
+    else
+      jobs.push_front(std::move(job));
+    failed = not ok;
+    rounds++;
+    done.notify_all();
+  }
+}
+
+bool MqttFileStore::writeLog(const std::string& records)
+{
+  if (log_fd < 0 and not open(nullptr, nullptr)) return false;
+  size_t durable;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    durable = stats_.log_bytes;
+  }
+  if (writeAll(log_fd, records) and syncFile(log_fd))
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stats_.log_bytes += records.size();
+    stats_.syncs++;
+    return true;
+  }
+  if (ftruncate(log_fd, durable) != 0 or lseek(log_fd, durable, SEEK_SET) < 0)
+  {
+    // A torn write would hide the records written after it at load,
+    // else the log is cut back to its last durable record
+    close(log_fd);
+    log_fd = -1;    // repaired by open() at the next attempt
+  }
+  return false;
+}
+
+bool MqttFileStore::writeSnapshot(const std::string& records)
+{
+  if (log_fd < 0 and not open(nullptr, nullptr)) return false;
+  int fd = ::open((path+".snap.tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return false;
+  bool ok = writeAll(fd, header(SnapMagic, generation+1)) and writeAll(fd, records) and syncFile(fd);
+  close(fd);
+  if (not ok or rename((path+".snap.tmp").c_str(), (path+".snap").c_str()) != 0) return false;
+
+  // The rename must be durable before the log is reset
+  std::string dir = path.substr(0, path.rfind('/')+1);
+  int dir_fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+  if (dir_fd >= 0)
+  {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+
+  // From now, the old log is ignored (older generation)
+  generation++;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    snap_size = HeaderSize + records.size();
+    stats_.snapshot_bytes = snap_size;
+    stats_.compactions++;
+  }
+  if (not resetLog())
+  {
+    close(log_fd);
+    log_fd = -1;    // the new snapshot is used, and a new log by open()
+  }
+  return true;
+}
+#endif
@@ -0,0 +1,160 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+/***
+ * Persistence of the broker state (see MqttBroker::persist).
+ *
+ * The broker appends a record for each change, and calls sync() from
+ * its loop so that writes and fsync are batched, off the publish path.
+ * When compactNeeded(), the broker gives all its live records as a
+ * new snapshot that replaces the log.
+ * A store should not block the loop (see MqttFileStore).
+ * MqttBroker::begin() replays the snapshot, then the log.
+ */
+class MqttStore
+{
+  public:
+    enum Type : uint8_t
+    {
+      Retain = 1,     // key=topic, data=encoded publish
+      Remove = 2,     // key=topic
+      Session = 3,    // key=client id, data=subscriptions (qos, length, filter)
+      SessionEnd = 4  // key=client id
+    };
+
+    struct Record
+    {
+      Type type;
+      const char* key;
+      uint16_t key_len;
+      const char* data;
+      uint32_t data_len;
+    };
+
+    using RecordCallBack = void (*)(void* context, const Record&);
+
+    virtual ~MqttStore() {}
+
+    // Calls callback for each record of the snapshot, then of the log
+    virtual bool load(RecordCallBack callback, void* context) = 0;
+
+    // Buffered until sync()
+    virtual void append(const Record&) = 0;
+
+    // Writes the buffered records (force=false: at most once per sync interval)
+    // force=true also waits until everything given to the store is written
+    virtual void sync(bool force=false) = 0;
+
+    virtual bool compactNeeded() const = 0;
+
+    // New snapshot: beginSnapshot(), snapshot() for each live record, endSnapshot()
+    virtual bool beginSnapshot() = 0;
+    virtual void snapshot(const Record&) = 0;
+    virtual bool endSnapshot() = 0;
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+#define TINY_MQTT_FILE_STORE 1
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+/***
+ * Store in two files (POSIX):
+ *   path.snap  snapshot, memory mapped when loaded
+ *   path.log   records appended since the snapshot
+ *
+ * Records are checksummed, a torn record at the end of the log
+ * (crash while writing) is dropped at load.
+ * A snapshot is written to path.snap.tmp then renamed, and the log is
+ * only used with the snapshot of the same generation, so a crash at any
+ * time leaves either the old or the new state.
+ *
+ * The files are written by a thread of the store: sync() and endSnapshot()
+ * only queue the bytes, in order, so that the broker loop never waits for
+ * the disk. A failed write is retried after a second (or when more is
+ * queued) and the following ones wait behind it.
+ */
+class MqttFileStore : public MqttStore
+{
+  public:
+    struct Stats
+    {
+      uint32_t syncs = 0;         // fsync of the log
+      uint32_t compactions = 0;
+      uint32_t dropped = 0;       // torn or corrupted records found at load
+      size_t log_bytes = 0;
+      size_t snapshot_bytes = 0;
+    };
+
+    MqttFileStore(const char* path);
+    ~MqttFileStore();
+
+    bool load(RecordCallBack callback, void* context) override;
+    void append(const Record&) override;
+    void sync(bool force=false) override;
+    bool compactNeeded() const override;
+    bool beginSnapshot() override;
+    void snapshot(const Record&) override;
+    bool endSnapshot() override;
+
+    // Max delay before buffered records are written (0 = each sync())
+    void syncInterval(uint32_t ms) { sync_interval = ms; }
+
+    // Compacts when the log is bigger than ratio * snapshot and than min_log bytes
+    void compactRatio(uint8_t ratio, size_t min_log) { compact_ratio = ratio; compact_min = min_log; }
+
+    Stats stats() const;
+
+  private:
+    struct Job
+    {
+      bool snapshot;        // else records appended to the log
+      std::string bytes;
+    };
+
+    void queue(bool snapshot, std::string& bytes);
+    void flush();           // waits for the writer
+    void run();             // writer thread
+
+    // Writer thread (or while it is idle)
+    bool open(RecordCallBack, void* context);
+    bool resetLog();
+    bool writeLog(const std::string& records);
+    bool writeSnapshot(const std::string& records);
+    size_t replay(const char* begin, const char* end, RecordCallBack, void* context);
+    static bool writeAll(int fd, const std::string& bytes);
+
+    std::string path;
+    int log_fd = -1;
+    uint32_t generation = 0;    // of the snapshot the log applies to
+
+    // Loop thread
+    std::string pending;        // records not queued yet
+    std::string snap_buffer;    // records of the snapshot being built
+    bool snapshotting = false;
+    uint32_t last_sync = 0;
+    uint32_t sync_interval = 1000;
+    uint8_t compact_ratio = 2;
+    size_t compact_min = 65536;
+
+    // Shared, protected by mutex
+    mutable std::mutex mutex;
+    std::condition_variable wake;   // jobs queued, or stopping
+    std::condition_variable done;   // a job is done
+    std::deque<Job> jobs;
+    std::thread writer;
+    size_t queued_bytes = 0;        // log records in jobs
+    bool snapshot_queued = false;
+    bool writing = false;
+    bool failed = false;            // the last write failed, retried later
+    uint32_t rounds = 0;            // jobs done or failed
+    bool stopping = false;
+    size_t snap_size = 0;
+    Stats stats_;
+};
+#endif
@@ -0,0 +1,218 @@
+// vim: ts=2 sw=2 expandtab
+#include "PosixTcp.h"
+
+#if defined(TINY_MQTT_EPOLL) && defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+namespace
+{
+  const size_t ReadBlock = 4096;
+  const int MaxEvents = 256;
+
+  void setOptions(int fd)
+  {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));   // TinyMqtt coalesces itself
+  }
+}
+
+PosixClient::Socket::~Socket()
+{
+  if (fd >= 0) close(fd);   // also removed from the epoll
+}
+
+bool PosixClient::connect(const char* host, uint16_t port)
+{
+  stop();
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* addresses;
+  if (getaddrinfo(host, std::to_string(port).c_str(), &hints, &addresses) != 0) return false;
+
+  int fd = -1;
+  for(struct addrinfo* address = addresses; address and fd < 0; address = address->ai_next)
+  {
+    fd = ::socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+    if (fd >= 0 and ::connect(fd, address->ai_addr, address->ai_addrlen) != 0)
+    {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  if (fd < 0) return false;
+  setOptions(fd);
+  socket = std::make_shared<Socket>(fd, false);
+  return true;
+}
+
+bool PosixClient::connected() const
+{
+  if (not socket or socket->fd < 0) return false;
+  return not socket->closed or socket->head < socket->in.size();
+}
+
+int PosixClient::available()
+{
+  if (not socket or socket->fd < 0) return 0;
+  Socket& s = *socket;
+  if (s.head < s.in.size()) return s.in.size() - s.head;
+  s.in.clear();
+  s.head = 0;
+  if (s.closed or (s.polled and not s.readable)) return 0;
+
+  s.in.resize(ReadBlock);
+  ssize_t len;
+  do { len = recv(s.fd, &s.in[0], ReadBlock, 0); } while(len < 0 and errno == EINTR);
+  if (len > 0)
+  {
+    s.in.resize(len);
+    return len;
+  }
+  s.in.clear();
+  if (len == 0 or (errno != EAGAIN and errno != EWOULDBLOCK))
+    s.closed = true;
+  else
+    s.readable = false;   // until the next EPOLLIN
+  return 0;
+}
+
+int PosixClient::read(uint8_t* buf, size_t size)
+{
+  int len = available();
+  if (len <= 0) return -1;
+  if (size > size_t(len)) size = len;
+  memcpy(buf, socket->in.data()+socket->head, size);
+  socket->head += size;
+  return size;
+}
+
+size_t PosixClient::write(const uint8_t* buf, size_t size)
+{
+  if (not socket or socket->fd < 0 or socket->closed) return 0;
+  ssize_t sent;
+  do { sent = send(socket->fd, buf, size, MSG_NOSIGNAL); } while(sent < 0 and errno == EINTR);
+  if (sent >= 0) return sent;
+  if (errno != EAGAIN and errno != EWOULDBLOCK) socket->closed = true;
+  return 0;   // EPOLLOUT will tell when it can be sent
+}
+
+void PosixClient::stop()
+{
+  if (not socket or socket->fd < 0) return;
+  close(socket->fd);
+  socket->fd = -1;
+  socket->in.clear();
+  socket->head = 0;
+}
+
+PosixServer::~PosixServer()
+{
+  if (listen_fd >= 0) close(listen_fd);
+  if (epoll_fd >= 0) close(epoll_fd);
+  if (wake_fd >= 0) close(wake_fd);
+}
+
+bool PosixServer::add(int fd, void* ptr)
+{
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = ptr;
+  return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+void PosixServer::begin()
+{
+  if (listen_fd >= 0) return;
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  listen_fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  int zero = 0, one = 1;
+  setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));   // also IPv4
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (reuse_port) setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+  struct sockaddr_in6 address;
+  memset(&address, 0, sizeof(address));
+  address.sin6_family = AF_INET6;
+  address.sin6_addr = in6addr_any;
+  address.sin6_port = htons(port);
+  if (bind(listen_fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0
+      or listen(listen_fd, SOMAXCONN) != 0
+      or not add(listen_fd, nullptr))   // nullptr: new connections
+  {
+    close(listen_fd);
+    listen_fd = -1;
+    return;
+  }
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  add(wake_fd, &wake_fd);
+  accept_pending = true;
+}
+
+void PosixServer::wake()
+{
+  uint64_t one = 1;
+  if (wake_fd >= 0 and ::write(wake_fd, &one, sizeof(one)) < 0) {}   // already awake if full
+}
+
+PosixClient PosixServer::accept()
+{
+  if (listen_fd < 0 or not accept_pending) return PosixClient();
+  int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0)
+  {
+    if (errno == EAGAIN or errno == EWOULDBLOCK) accept_pending = false;   // until the next event
+    return PosixClient();
+  }
+  setOptions(fd);
+  PosixClient client(fd, true);
+  if (not add(fd, client.socket.get())) client.socket->polled = false;
+  return client;
+}
+
+bool PosixServer::watch(PosixClient& client, void* owner)
+{
+  if (epoll_fd < 0 or not client) return false;
+  client.owner(owner);
+  client.socket->polled = add(client.socket->fd, client.socket.get());
+  return client.socket->polled;
+}
+
+void PosixServer::wait(uint32_t timeout_ms)
+{
+  ready_.clear();
+  if (epoll_fd < 0) return;
+  struct epoll_event events[MaxEvents];
+  int timeout = accept_pending ? 0 : static_cast<int>(timeout_ms);
+  int count = epoll_wait(epoll_fd, events, MaxEvents, timeout);
+  for(int i=0; i<count; i++)
+  {
+    if (events[i].data.ptr == nullptr)
+    {
+      accept_pending = true;
+      continue;
+    }
+    if (events[i].data.ptr == &wake_fd)
+    {
+      uint64_t count;
+      if (::read(wake_fd, &count, sizeof(count)) < 0) {}
+      continue;
+    }
+    PosixClient::Socket* socket = static_cast<PosixClient::Socket*>(events[i].data.ptr);
+    if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) socket->readable = true;
+    if (socket->owner) ready_.push_back(socket->owner);
+  }
+}
+#endif
@@ -0,0 +1,107 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#if defined(TINY_MQTT_EPOLL) && defined(__linux__)
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <vector>
+#include <string>
+
+// Connections accepted by one MqttBroker::loop (next ones at the next loop)
+#ifndef TINY_MQTT_ACCEPT_BATCH
+#define TINY_MQTT_ACCEPT_BATCH 64
+#endif
+
+/***
+ * Non blocking POSIX socket, with the part of the WiFiClient interface
+ * used by TinyMqtt (TcpClient when TINY_MQTT_EPOLL is defined).
+ *
+ * Copies share the same connection (as WiFiClient does), which is closed
+ * by stop() or when the last copy is destroyed.
+ * Received bytes are read by blocks into a buffer, until EAGAIN, as
+ * needed by the edge triggered events of PosixServer.
+ */
+class PosixClient
+{
+  public:
+    PosixClient() {}
+
+    // Blocking connect, then the socket is non blocking
+    bool connect(const char* host, uint16_t port);
+    bool connected() const;
+    int available();
+    int read(uint8_t* buf, size_t size);
+    size_t write(const uint8_t* buf, size_t size);
+    size_t write(const char* buf, size_t size) { return write(reinterpret_cast<const uint8_t*>(buf), size); }
+    void stop();
+
+    explicit operator bool() const { return socket and socket->fd >= 0; }
+
+    // Given back by PosixServer::ready() when the connection has events
+    void owner(void* owner) { if (socket) socket->owner = owner; }
+
+  private:
+    friend class PosixServer;
+
+    struct Socket
+    {
+      Socket(int fd, bool polled) : fd(fd), polled(polled) {}
+      ~Socket();
+      int fd;
+      bool polled;            // edge triggered events: read only after EPOLLIN
+      bool readable = true;
+      bool closed = false;    // by the peer
+      void* owner = nullptr;
+      std::string in;         // received, in[head..] not read yet
+      size_t head = 0;
+    };
+
+    PosixClient(int fd, bool polled) : socket(std::make_shared<Socket>(fd, polled)) {}
+
+    std::shared_ptr<Socket> socket;
+};
+
+/***
+ * Listening socket and one epoll (edge triggered) for the accepted
+ * connections (TcpServer when TINY_MQTT_EPOLL is defined).
+ *
+ * wait() blocks until a connection has an event (data, writable again,
+ * closed) or the timeout. Then accept() gives the new connections (until
+ * it returns an invalid client), and ready() the owners of the
+ * connections with events, so that a loop only touches them.
+ */
+class PosixServer
+{
+  public:
+    PosixServer(uint16_t port) : port(port) {}
+    ~PosixServer();
+
+    void begin();
+    PosixClient accept();
+
+    // Waits at most timeout_ms for events (0 = does not wait)
+    void wait(uint32_t timeout_ms);
+    const std::vector<void*>& ready() const { return ready_; }
+    bool acceptPending() const { return accept_pending; }
+
+    // Events of a connection not accepted by this server (ex: broker link)
+    bool watch(PosixClient& client, void* owner);
+
+    // Before begin(): servers of the same port share the connections (SO_REUSEPORT)
+    void reusePort(bool reuse) { reuse_port = reuse; }
+
+    // Wakes up wait() (from any thread)
+    void wake();
+
+  private:
+    bool add(int fd, void* ptr);
+
+    uint16_t port;
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    bool reuse_port = false;
+    bool accept_pending = false;
+    std::vector<void*> ready_;
+};
+#endif
@@ -0,0 +1,117 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include <vector>
+#include <utility>
+#include <stdint.h>
+
+/***
+ * Values reached either by position (dense, for loops) or by a handle.
+ *
+ * A handle stays valid until its value is erased, then it is detected
+ * as stale (generation), even if its slot is reused.
+ * insert() and erase() are O(1): the last value is moved to the place of
+ * the erased one, so erase() changes the order of the values.
+ */
+struct SlotHandle
+{
+  static const uint32_t None = UINT32_MAX;
+
+  uint32_t slot = None;
+  uint32_t generation = 0;
+
+  bool operator==(const SlotHandle& h) const { return slot == h.slot and generation == h.generation; }
+  bool operator!=(const SlotHandle& h) const { return not (*this == h); }
+};
+
+template<class T>
+class SlotMap
+{
+  public:
+    using Handle = SlotHandle;
+
+    Handle insert(const T& value)
+    {
+      Handle handle;
+      if (free_head == Handle::None)
+      {
+        handle.slot = slots.size();
+        slots.push_back(Slot());
+      }
+      else
+      {
+        handle.slot = free_head;
+        free_head = slots[free_head].dense;
+      }
+      Slot& slot = slots[handle.slot];
+      slot.dense = values.size();
+      handle.generation = slot.generation;
+      values.push_back(value);
+      owners.push_back(handle.slot);
+      return handle;
+    }
+
+    // false if handle is stale
+    bool erase(Handle handle)
+    {
+      if (get(handle) == nullptr) return false;
+      Slot& slot = slots[handle.slot];
+      uint32_t last = values.size()-1;
+      if (slot.dense != last)
+      {
+        values[slot.dense] = std::move(values[last]);
+        owners[slot.dense] = owners[last];
+        slots[owners[last]].dense = slot.dense;
+      }
+      values.pop_back();
+      owners.pop_back();
+      slot.generation++;
+      slot.dense = free_head;
+      free_head = handle.slot;
+      return true;
+    }
+
+    // nullptr if handle is stale
+    T* get(Handle handle)
+    {
+      if (handle.slot >= slots.size()) return nullptr;
+      const Slot& slot = slots[handle.slot];
+      return slot.generation == handle.generation ? &values[slot.dense] : nullptr;
+    }
+    const T* get(Handle handle) const { return const_cast<SlotMap*>(this)->get(handle); }
+
+    void clear()
+    {
+      while(values.size()) erase(handle(values.size()-1));
+    }
+
+    // Handle of the value at position i
+    Handle handle(size_t i) const
+    {
+      Handle h;
+      h.slot = owners[i];
+      h.generation = slots[h.slot].generation;
+      return h;
+    }
+
+    size_t size() const { return values.size(); }
+    bool empty() const { return values.empty(); }
+    T& operator[](size_t i) { return values[i]; }
+    const T& operator[](size_t i) const { return values[i]; }
+    typename std::vector<T>::iterator begin() { return values.begin(); }
+    typename std::vector<T>::iterator end() { return values.end(); }
+    typename std::vector<T>::const_iterator begin() const { return values.begin(); }
+    typename std::vector<T>::const_iterator end() const { return values.end(); }
+    const std::vector<T>& dense() const { return values; }
+
+  private:
+    struct Slot
+    {
+      uint32_t dense = 0;       // position of the value, or next free slot
+      uint32_t generation = 0;  // incremented by erase()
+    };
+
+    std::vector<T> values;
+    std::vector<uint32_t> owners;   // slot of values[i]
+    std::vector<Slot> slots;
+    uint32_t free_head = Handle::None;
+};
@@ -1,4 +1,158 @@
 #include "StringIndexer.h"
 
-StringIndexer::Strings StringIndexer::strings;
+uint32_t StringIndexer::hash(const char* str, uint16_t len)
+{
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  while(len--)
+  {
+    h ^= static_cast<uint8_t>(*str++);
+    h *= 16777619u;
+  }
+  return h;
+}
 
+// Slot of str in the table, or the empty slot where it should be
+size_t StringIndexer::slot(const Storage& s, const char* str, uint16_t len, uint32_t h)
+{
+  size_t mask = s.table.size()-1;
+  size_t i = h & mask;
+  while(index_t index = s.table[i])
+  {
+    const StringCounter& counter = s.strings[index];
+    if (counter.hash == h and counter.str.length() == len and memcmp(counter.str.data(), str, len)==0)
+      break;
+    i = (i+1) & mask;
+  }
+  return i;
+}
+
+void StringIndexer::rehash(Storage& s, size_t size)
+{
+  s.table.assign(size, 0);
+  for(index_t index=1; index<s.strings.size(); index++)
+  {
+    const StringCounter& counter = s.strings[index];
+    if (counter.used)
+      s.table[slot(s, counter.str.data(), counter.str.length(), counter.hash)] = index;
+  }
+}
+
+StringIndexer::index_t StringIndexer::strToIndex(const char* str, uint16_t len)
+{
+  Storage& s = storage();
+  if (s.table.empty()) rehash(s, 16);
+
+  uint32_t h = hash(str, len);
+  size_t i = slot(s, str, len, h);
+  if (index_t found = s.table[i])
+  {
+    s.strings[found].used++;
+    return found;
+  }
+
+  index_t index;
+  if (s.free_indexes.size())
+  {
+    index = s.free_indexes.back();
+    s.free_indexes.pop_back();
+  }
+  else if (s.strings.size() <= MaxIndex)
+  {
+    if (s.strings.empty()) s.strings.resize(1);   // index 0 is never used
+    index = s.strings.size();
+    s.strings.resize(index+1);
+  }
+  else
+  {
+    s.overflows++;
+    if (s.overflow_callback) s.overflow_callback(str, len);
+    return 0;
+  }
+
+  StringCounter& counter = s.strings[index];
+  counter.str.assign(str, len);
+  counter.hash = h;
+  counter.used = 1;
+  s.count++;
+
+  if (2*s.count > s.table.size())   // keeps the load factor under 1/2
+    rehash(s, 2*s.table.size());
+  else
+    s.table[i] = index;
+  return index;
+}
+
+void StringIndexer::release(const index_t& index)
+{
+  Storage& s = storage();
+  if (index == 0 or index >= s.strings.size()) return;
+  StringCounter& counter = s.strings[index];
+  if (counter.used == 0 or --counter.used) return;
+
+  // Backward shift deletion, keeps the probe sequences without holes
+  size_t mask = s.table.size()-1;
+  size_t i = slot(s, counter.str.data(), counter.str.length(), counter.hash);
+  size_t j = i;
+  while(true)
+  {
+    j = (j+1) & mask;
+    index_t next = s.table[j];
+    if (next == 0) break;
+    size_t home = s.strings[next].hash & mask;
+    // next may move to i only if its home slot is not in ]i, j]
+    if ((j > i and (home <= i or home > j)) or (j < i and home <= i and home > j))
+    {
+      s.table[i] = next;
+      i = j;
+    }
+  }
+  s.table[i] = 0;
+
+  string().swap(counter.str);
+  s.free_indexes.push_back(index);
+  s.count--;
+
+  if (Levels* levels = counter.levels)
+  {
+    counter.levels = nullptr;
+    for(index_t level: *levels)
+      if (level != index) release(level);
+    delete levels;
+  }
+}
+
+const StringIndexer::Levels& StringIndexer::levels(const index_t& index)
+{
+  static const Levels none;
+  Storage& s = storage();
+  if (index == 0 or index >= s.strings.size() or s.strings[index].used == 0) return none;
+  if (s.strings[index].levels) return *s.strings[index].levels;
+
+  Levels* levels = new Levels;
+  const string str = s.strings[index].str;  // Copy, strings may grow below
+  const char* begin = str.c_str();
+  while(true)
+  {
+    const char* end = begin;
+    while(*end and *end!='/') end++;
+    if (end-begin == (long)str.length())
+    {
+      levels->push_back(index);   // One level, do not count a reference to itself
+      break;
+    }
+    index_t level = strToIndex(begin, end-begin);
+    if (level == 0)
+    {
+      // Indexer full: not cached, split again by the next call
+      for(index_t l: *levels) release(l);
+      delete levels;
+      return none;
+    }
+    levels->push_back(level);
+    if (*end == 0) break;
+    begin = end+1;
+  }
+  s.strings[index].levels = levels;
+  return *levels;
+}
@@ -2,100 +2,118 @@
 #pragma once
 #include <assert.h>
 #include <map>
-#include <unordered_map>
+#include <vector>
 #include "TinyConsole.h"
 #include <string>
 #include <string.h>
+#include <stdint.h>
 
 using string = TinyConsole::string;
 
+// With TINY_MQTT_SHARDS, each thread of MqttShardedBroker has its own copy
+#ifndef TINY_MQTT_THREAD_LOCAL
+  #ifdef TINY_MQTT_SHARDS
+    #define TINY_MQTT_THREAD_LOCAL thread_local
+  #else
+    #define TINY_MQTT_THREAD_LOCAL
+  #endif
+#endif
+
+// Width of the indexes, 8 bits allows 255 different strings,
+// 16 bits 65535 and 32 bits more than you will ever need.
+#ifndef TINY_MQTT_INDEX_BITS
+#define TINY_MQTT_INDEX_BITS 8
+#endif
+
 /***
- * Allows to store up to 255 different strings with one byte class
- * very memory efficient when one string is used many times.
+ * Stores each different string once, a string is then known by its index
+ * (one byte by default) which is very memory efficient when one string
+ * is used many times.
+ *
+ * Strings are found back by an open addressing hash table of indexes,
+ * released indexes are reused (free list), so intern and release are O(1).
+ * Index 0 is never used: this is what a string gets when all indexes
+ * are used (see overflows() and onOverflow()).
  */
 class StringIndexer
 {
-  private:
-
-  class StringCounter
-  {
-    string str;
-    uint8_t used=0;
-    friend class StringIndexer;
-
-    #if EPOXY_DUINO
-    public:
-    // Workaround to avoid coredump in Indexer::release
-    // when destroying a Topic after the deletion of
-    // StringIndexer::strings map (which can occurs only with AUnit,
-    // never in the ESP itself, because ESP never ends)
-    // (I hate static vars)
-    ~StringCounter() { used=255; }
-    #endif
-  };
   public:
+#if TINY_MQTT_INDEX_BITS == 32
+    using index_t = uint32_t;
+#elif TINY_MQTT_INDEX_BITS == 16
+    using index_t = uint16_t;
+#else
     using index_t = uint8_t;
+#endif
+    static const index_t MaxIndex = static_cast<index_t>(~0);
 
-   static const string& str(const index_t& index)
-   {
-     static string dummy;
-     const auto& it=strings.find(index);
-     if (it == strings.end()) return dummy;
-     return it->second.str;
-   }
+    // Indexes of the '/' separated levels of a string
+    using Levels = std::vector<index_t>;
 
-    static void use(const index_t& index)
+    using OverflowCallBack = void (*)(const char* str, size_t len);
+
+    static const string& str(const index_t& index)
     {
-      auto it=strings.find(index);
-      if (it != strings.end()) it->second.used++;
+      static string dummy;
+      Storage& s = storage();
+      if (index == 0 or index >= s.strings.size()) return dummy;
+      return s.strings[index].str;
     }
 
-    static void release(const index_t& index)
+    static void use(const index_t& index)
     {
-      auto it=strings.find(index);
-      if (it != strings.end())
-      {
-        it->second.used--;
-        if (it->second.used == 0)
-        {
-          strings.erase(it);
-          // Serial << "Removing string(" << it->second.str.c_str() << ") size=" << strings.size() << endl;
-        }
-      }
+      Storage& s = storage();
+      if (index and index < s.strings.size()) s.strings[index].used++;
     }
 
-    static uint16_t count() { return strings.size(); }
+    static void release(const index_t& index);
+
+    /** Levels of the string at index, split and indexed on the first call.
+        Each level is stored once whatever the number of strings using it.
+        Empty if a level could not be indexed. **/
+    static const Levels& levels(const index_t& index);
+
+    static size_t count() { return storage().count; }
+
+    // Number of strings that could not be indexed (index 0 given)
+    static uint32_t overflows() { return storage().overflows; }
+    static void onOverflow(OverflowCallBack callback) { storage().overflow_callback = callback; }
 
   private:
     friend class IndexedString;
 
     // increment use of str or create a new index
-    static index_t strToIndex(const char* str, uint8_t len)
+    static index_t strToIndex(const char* str, uint16_t len);
+
+    struct StringCounter
     {
-      for(auto it=strings.begin(); it!=strings.end(); it++)
-      {
-        if (it->second.str.length() == len && strcmp(it->second.str.c_str(), str)==0)
-        {
-          it->second.used++;
-          return it->first;
-        }
-      }
-      for(index_t index=1; index; index++)
-      {
-        if (strings.find(index)==strings.end())
-        {
-          strings[index].str = string(str, len);
-          strings[index].used++;
-          // Serial << "Creating index " << index << " for (" << strings[index].str.c_str() << ") len=" << len << endl;
-          return index;
-        }
-      }
-      return 0;  // TODO out of indexes
-    }
+      string str;
+      uint32_t hash = 0;
+      uint32_t used = 0;   // 0 when the index is free
+      Levels* levels = nullptr;
+    };
 
-    using Strings = std::unordered_map<index_t, StringCounter>;
+    struct Storage
+    {
+      std::vector<StringCounter> strings;   // by index, strings[0] unused
+      std::vector<index_t> free_indexes;
+      std::vector<index_t> table;   // hash table of indexes, 0 = empty slot
+      size_t count = 0;
+      uint32_t overflows = 0;
+      OverflowCallBack overflow_callback = nullptr;
+    };
+
+    // Never deleted, so that static Topics can be destroyed at any time
+    // (one per thread with TINY_MQTT_SHARDS)
+    static Storage& storage()
+    {
+      static TINY_MQTT_THREAD_LOCAL Storage* s = new Storage;
+      return *s;
+    }
 
-    static Strings strings;
+    static uint32_t hash(const char* str, uint16_t len);
+    static size_t slot(const Storage&, const char* str, uint16_t len, uint32_t h);
+    static void rehash(Storage&, size_t size);
 };
 
 class IndexedString
@@ -107,9 +125,9 @@ class IndexedString
       index = source.index;
     }
 
-    IndexedString(IndexedString&& i) : index(i.index) {}
+    IndexedString(IndexedString&& i) : index(i.index) { i.index = 0; }
 
-    IndexedString(const char* str, uint8_t len)
+    IndexedString(const char* str, uint16_t len)
     {
       index=StringIndexer::strToIndex(str, len);
     }
@@ -121,6 +139,7 @@ class IndexedString
     IndexedString& operator=(const IndexedString& source)
     {
       StringIndexer::use(source.index);
+      StringIndexer::release(index);
       index = source.index;
       return *this;
     }
@@ -139,6 +158,14 @@ class IndexedString
 
     const StringIndexer::index_t& getIndex() const { return index; }
 
+    // false if the indexer was full
+    bool valid() const { return index != 0; }
+
+  protected:
+    // One more reference to a string already indexed, no lookup
+    struct Indexed { StringIndexer::index_t index; };
+    explicit IndexedString(Indexed i) : index(i.index) { StringIndexer::use(index); }
+
   private:
     StringIndexer::index_t index;
 };
@@ -0,0 +1,199 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/***
+ * Timers of many objects (keep alive, connect timeout, retransmission...).
+ *
+ * Hierarchical wheel of 4 levels of 64 slots, one tick is one ms of millis():
+ * level 0 holds the timers due in less than 64ms, level 1 in less than 4s,
+ * level 2 in less than 4min, level 3 in less than 4h30 (longer delays wait
+ * in level 3 and are placed again). When level 0 wraps, the next slot of
+ * level 1 is spread over level 0, and so on.
+ * So schedule() and cancel() are O(1), and advance() only visits the
+ * timers that expire or move down (idle ticks are skipped).
+ *
+ * Times are compared with differences of ticks, millis() may wrap.
+ * Timers are intrusive (a Timer is a member of its owner), and a Timer
+ * can be scheduled or cancelled from any callback.
+ */
+class TimingWheel
+{
+  public:
+    using CallBack = void (*)(void* context);
+
+    class Timer
+    {
+      public:
+        Timer(CallBack callback, void* context) : callback(callback), context(context) {}
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+        ~Timer() { cancel(); }
+
+        bool scheduled() const { return wheel != nullptr; }
+        void cancel() { if (wheel) wheel->unlink(*this); }
+
+      private:
+        friend class TimingWheel;
+        CallBack callback;
+        void* context;
+        Timer* next = nullptr;
+        Timer** pprev = nullptr;    // next of the previous timer, or slot
+        TimingWheel* wheel = nullptr;
+        uint32_t expires = 0;       // tick
+        uint8_t level = 0;
+    };
+
+    // Longest delay (about 24 days), ticks are compared as int32 differences
+    static const uint32_t MaxDelay = 0x7FFFFFFF;
+
+    constexpr TimingWheel() {}
+
+    // (re)schedules timer, due delay_ms (at most MaxDelay) after now
+    void schedule(Timer& timer, uint32_t delay_ms, uint32_t now)
+    {
+      if (timer.wheel) unlink(timer);
+      if (delay_ms > MaxDelay) delay_ms = MaxDelay;
+      if (count == 0 and not running) current = now;
+      timer.expires = now + delay_ms;
+      if (int32_t(timer.expires - current) <= 0) timer.expires = current+1;
+      timer.wheel = this;
+      insert(timer);
+    }
+
+    // Calls the callbacks of the timers due at now
+    void advance(uint32_t now)
+    {
+      if (running) return;    // called by a callback
+      if (count == 0)
+      {
+        current = now;
+        return;
+      }
+      uint32_t ticks = now - current;
+      if (int32_t(ticks) <= 0) return;
+      running = true;
+      while(ticks)
+      {
+        if (count == 0)
+        {
+          current += ticks;
+          break;
+        }
+        if (counts[0] == 0)
+        {
+          // Nothing before the next cascade of the first level used
+          uint8_t level = 1;
+          while(level < Levels-1 and counts[level] == 0) level++;
+          uint32_t span = 1u << (Bits*level);
+          uint32_t skip = span - 1 - (current & (span-1));
+          if (skip > ticks-1) skip = ticks-1;
+          current += skip;
+          ticks -= skip;
+        }
+        current++;
+        ticks--;
+        if ((current & Mask) == 0) cascade(1);
+        expire(slots[0][current & Mask]);
+      }
+      running = false;
+    }
+
+    // ms before a timer may expire (at least), at most max_ms
+    uint32_t idle(uint32_t now, uint32_t max_ms) const
+    {
+      if (count == 0) return max_ms;
+      uint32_t wait = Slots - (current & Mask);   // next cascade of level 1
+      if (counts[0])
+      {
+        for(uint32_t tick=1; tick < wait; tick++)
+          if (slots[0][(current+tick) & Mask]) { wait = tick; break; }
+      }
+      else
+      {
+        uint8_t level = 1;
+        while(level < Levels-1 and counts[level] == 0) level++;
+        uint32_t span = 1u << (Bits*level);
+        wait = span - (current & (span-1));
+      }
+      uint32_t elapsed = now - current;
+      if (int32_t(elapsed) < 0) elapsed = 0;
+      wait = wait > elapsed ? wait - elapsed : 0;
+      return wait < max_ms ? wait : max_ms;
+    }
+
+    size_t size() const { return count; }
+
+  private:
+    static const uint8_t Bits = 6;
+    static const uint8_t Levels = 4;
+    static const uint32_t Slots = 1 << Bits;
+    static const uint32_t Mask = Slots-1;
+
+    void insert(Timer& timer)
+    {
+      uint32_t delta = timer.expires - current;
+      if (int32_t(delta) < 0) delta = 0;
+      uint8_t level = 0;
+      while(level < Levels-1 and delta >= (1u << (Bits*(level+1)))) level++;
+      uint32_t at = timer.expires;
+      if (level == Levels-1 and delta >= (1u << (Bits*Levels)) - (1u << (Bits*level)))
+        at = current + (Mask << (Bits*level));   // too far, placed again later
+      if (delta == 0) at = current;
+
+      Timer*& slot = slots[level][(at >> (Bits*level)) & Mask];
+      timer.level = level;
+      timer.next = slot;
+      timer.pprev = &slot;
+      if (slot) slot->pprev = &timer.next;
+      slot = &timer;
+      counts[level]++;
+      count++;
+    }
+
+    void unlink(Timer& timer)
+    {
+      *timer.pprev = timer.next;
+      if (timer.next) timer.next->pprev = timer.pprev;
+      timer.next = nullptr;
+      timer.pprev = nullptr;
+      timer.wheel = nullptr;
+      counts[timer.level]--;
+      count--;
+    }
+
+    // Spreads the current slot of level over the lower levels
+    void cascade(uint8_t level)
+    {
+      if (level >= Levels) return;
+      uint32_t index = (current >> (Bits*level)) & Mask;
+      if (index == 0) cascade(level+1);   // higher level first
+      Timer* timer = slots[level][index];
+      while(timer)
+      {
+        Timer* next = timer->next;
+        unlink(*timer);
+        timer->wheel = this;
+        insert(*timer);
+        timer = next;
+      }
+    }
+
+    void expire(Timer*& slot)
+    {
+      // Callbacks may cancel or schedule any timer, even one of this slot
+      while(slot)
+      {
+        Timer* timer = slot;
+        unlink(*timer);
+        timer->callback(timer->context);
+      }
+    }
+
+    Timer* slots[Levels][Slots] = {};
+    uint32_t counts[Levels] = {};
+    uint32_t count = 0;
+    uint32_t current = 0;     // millis() of the last tick processed
+    bool running = false;
+};
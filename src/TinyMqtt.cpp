@@ -1,6 +1,10 @@
 // vim: ts=2 sw=2 expandtab
 #include "TinyMqtt.h"
 #include <sstream>
+#include <algorithm>
+#ifdef TINY_MQTT_SHARDS
+#include "MqttShards.h"
+#endif
 
 #if TINY_MQTT_DEBUG
 static auto cyan = TinyConsole::cyan;
@@ -12,17 +16,20 @@ int TinyMqtt::debug=2;
 
 #endif
 
+TINY_MQTT_THREAD_LOCAL uint8_t MqttClient::coalesce = 0;
+TINY_MQTT_THREAD_LOCAL TimingWheel MqttClient::timers;
+
 #ifdef EPOXY_DUINO
-  std::map<MqttMessage::Type, int> MqttClient::counters;
-  int MqttBroker::instances = 0;
-  int MqttClient::instances = 0;
+  TINY_MQTT_THREAD_LOCAL std::map<MqttMessage::Type, int> MqttClient::counters;
+  TINY_MQTT_THREAD_LOCAL int MqttBroker::instances = 0;
+  TINY_MQTT_THREAD_LOCAL int MqttClient::instances = 0;
 
 #endif
 
-MqttBroker::MqttBroker(uint16_t port, uint8_t max_retain_size)
+MqttBroker::MqttBroker(uint16_t port, uint32_t max_retain_size)
+  : retained(max_retain_size)
 {
   debug("New broker" << port);
-  retain_size = max_retain_size;
   server = new TcpServer(port);
 #ifdef TINY_MQTT_ASYNC
   server->onClient(onClient, this);
@@ -37,18 +44,17 @@ MqttBroker::~MqttBroker()
 #ifdef EPOXY_DUINO
   instances--;
 #endif
+  if (persistence) persistence->sync(true);
   closeRemoteBroker();
-  while(clients.size())
+  for(auto client: clients)
   {
-    auto client = clients[0];
     client->local_broker = nullptr;
     if (client->cltFlags & MqttClient::CltFlags::CltFlagToDelete)
-    {
-      // std::cout << "Deleting client" << std::endl;
-      delete client;
-    }
-    clients.erase(clients.begin());
+      reaped.push_back(client);
   }
+  clients.clear();
+  for(auto client: reaped) delete client;
+  while(offline_sessions.size()) eraseSession(offline_sessions.begin(), false);
   delete server;
 }
 
@@ -65,18 +71,20 @@ MqttClient::MqttClient(MqttBroker* local_broker, TcpClient* new_client)
 #else
   tcp_client = new TcpClient(*new_client);
 #endif
+#ifdef TINY_MQTT_EPOLL
+  tcp_client->owner(this);  // MqttBroker::loop only loops clients with events
+#endif
 #ifdef EPOXY_DUINO
-  alive = millis()+500000;
+  timers.schedule(alive_timer, 500000, millis());
   instances++;
 #else
-  alive = millis()+5000;  // TODO MAGIC client expires after 5s if no CONNECT msg
+  timers.schedule(alive_timer, 5000, millis());  // TODO MAGIC client expires after 5s if no CONNECT msg
 #endif
 }
 
 MqttClient::MqttClient(MqttBroker* local_broker, const string& id)
   : local_broker(local_broker), clientId(id)
 {
-  alive = 0;
   keep_alive = 0;
 
   if (local_broker) local_broker->addClient(this);
@@ -103,11 +111,13 @@ void MqttClient::close(bool bSendDisconnect)
   {
     if (bSendDisconnect and tcp_client->connected())
     {
-      message.create(MqttMessage::Type::Disconnect);
-      message.hexdump("close");
-      message.sendTo(this);
+      MqttMessage disconnect(MqttMessage::Type::Disconnect);
+      disconnect.hexdump("close");
+      disconnect.sendTo(this);
     }
+    flush();
     tcp_client->stop();
+    message.reset();  // A new connection starts with a new message
   }
 
   if (local_broker)
@@ -115,6 +125,7 @@ void MqttClient::close(bool bSendDisconnect)
     local_broker->removeClient(this);
     local_broker = nullptr;
   }
+  acked(MqttMessage::Type::Disconnect, 0, 0);
 }
 
 void MqttClient::connect(MqttBroker* local)
@@ -153,13 +164,37 @@ void MqttClient::connect(string broker, uint16_t port, uint16_t ka)
 void MqttBroker::addClient(MqttClient* client)
 {
   debug("MqttBroker::addClient");
-  clients.push_back(client);
+  client->handle = clients.insert(client);
+}
+
+void MqttBroker::takeOver(MqttClient* client)
+{
+  // Devices that kept the default id would take each other over
+  if (client->id() == TINY_MQTT_DEFAULT_CLIENT_ID) return;
+  SlotHandle& handle = by_id[client->id()];
+  MqttClient** previous = clients.get(handle);
+  if (previous and *previous != client)
+  {
+    debug("Client id " << client->id().c_str() << " taken over");
+    (*previous)->close(false);  // Its session is kept and given to client
+  }
+  by_id[client->id()] = client->handle;
+}
+
+const MqttClient* MqttBroker::client(const string& id) const
+{
+  auto it = by_id.find(id);
+  if (it == by_id.end()) return nullptr;
+  MqttClient* const* client = clients.get(it->second);
+  return client ? *client : nullptr;
 }
 
 void MqttBroker::closeRemoteBroker()
 {
   if (remote_broker)
   {
+    auto it = std::find(flushing.begin(), flushing.end(), remote_broker);
+    if (it != flushing.end()) flushing.erase(it);
     delete remote_broker;
     remote_broker = nullptr;
   }
@@ -170,31 +205,48 @@ void MqttBroker::connect(const string& host, uint16_t port)
   debug("MqttBroker::connect");
   closeRemoteBroker();
   if (remote_broker == nullptr) remote_broker = new MqttClient;
+  remote_broker->cleanSession(true);  // subscribed again to the current set by each CONNACK
+  uplink.update(*remote_broker);
   remote_broker->connect(host, port);
   remote_broker->local_broker = this;  // Because connect removed the link
-  // TODO shouldn't we resubscribe to all client subscriptions ?
+  remote_broker->message.stream(stream_chunk);
+#ifdef TINY_MQTT_EPOLL
+  if (remote_broker->tcp_client) server->watch(*remote_broker->tcp_client, remote_broker);   // wakes up loop()
+#endif
 }
 
 void MqttBroker::removeClient(MqttClient* remove)
 {
   debug("removeClient");
-  for(auto it=clients.begin(); it!=clients.end(); it++)
+  if (not clients.erase(remove->handle))
   {
-    auto client=*it;
-    if (client==remove)
-    {
-      // TODO if this broker is connected to an external broker
-      // we have to unsubscribe remove's topics.
-      // (but doing this, check that other clients are not subscribed...)
-      // Unless -> we could receive useless messages
-      //        -> we are using (memory) one IndexedString plus its string for nothing.
-      debug("Remove " << clients.size());
-      clients.erase(it);
-      debug("Client removed " << clients.size());
-      return;
-    }
+    debug(red << "Error cannot remove client");  // TODO should not occur
+    return;
+  }
+  auto id = by_id.find(remove->id());
+  if (id != by_id.end() and id->second == remove->handle) by_id.erase(id);
+  remove->handle = SlotHandle();
+  for(const auto& topic: remove->subscriptions)
+    if (subscriptions.remove(topic.levels(), remove)) uplink.remove(topic);   // unless its session keeps it
+  keepSession(remove);
+  debug("Client removed " << clients.size());
+  abortStreams(remove);
+  if (remove->cltFlags & MqttClient::CltFlags::CltFlagToDelete) reaped.push_back(remove);
+}
+
+void MqttBroker::abortStreams(const MqttClient* source)
+{
+  for(auto client: clients)
+  {
+    // The streamed publish will never end
+    if (client->streaming_from == source) client->abortStream();
   }
-  debug(red << "Error cannot remove client");  // TODO should not occur
+}
+
+void MqttBroker::streaming(uint16_t chunk_size)
+{
+  stream_chunk = chunk_size;
+  if (remote_broker) remote_broker->message.stream(chunk_size);
 }
 
 void MqttBroker::onClient(void* broker_ptr, TcpClient* client)
@@ -204,28 +256,65 @@ void MqttBroker::onClient(void* broker_ptr, TcpClient* client)
 
   MqttClient* mqtt = new MqttClient(broker, client);
   mqtt->setFlag(MqttClient::CltFlags::CltFlagToDelete);
+  mqtt->message.stream(broker->stream_chunk);
   broker->addClient(mqtt);
   debug("New client");
 }
 
-void MqttBroker::loop()
+void MqttBroker::loop(uint32_t wait_ms)
 {
-#ifndef TINY_MQTT_ASYNC
+#if defined(TINY_MQTT_EPOLL)
+  // Sleeps until a socket has events or a timer is due, unless work is pending
+  if (flushing.size() or reaped.size() or (remote_broker and uplink.changed())) wait_ms = 0;
+#ifdef TINY_MQTT_SHARDS
+  if (shards and shards->pending(shard)) wait_ms = 0;
+#endif
+  server->wait(MqttClient::timers.idle(millis(), wait_ms));
+  for(uint16_t accepted=0; accepted < TINY_MQTT_ACCEPT_BATCH; accepted++)
+  {
+    TcpClient client = server->accept();
+    if (not client) break;
+    onClient(this, &client);
+  }
+#elif !defined(TINY_MQTT_ASYNC)
+  (void)wait_ms;
   TcpClient client = server->accept();
 
   if (client)
   {
     onClient(this, &client);
   }
+#else
+  (void)wait_ms;
+#endif
+  // Messages produced during this loop are sent with as few writes as possible
+  MqttClient::coalesce++;
+  MqttClient::timers.advance(millis());   // keep alive, retransmissions, sessions
+#ifdef TINY_MQTT_SHARDS
+  if (shards) shards->receive(*this);     // publishes of the other shards
 #endif
   if (remote_broker)
   {
     // TODO should monitor broker's activity.
-    // 1 When broker disconnect and reconnect we have to re-subscribe
     remote_broker->loop();
   }
 
-  for(size_t i=0; i<clients.size(); i++)
+#ifdef TINY_MQTT_EPOLL
+  // Only the clients with events (data, closed, writable again)
+  for(void* owner: server->ready())
+  {
+    MqttClient* client = static_cast<MqttClient*>(owner);
+    if (client == remote_broker or client->local_broker != this) continue;  // closed by this loop
+    if (client->connected()) client->loop();
+    if (client->local_broker == this and not client->connected())
+    {
+      debug("Client " << client->id().c_str() << "  Disconnected");
+      client->close(false);   // Removed, deleted below
+    }
+  }
+#else
+  size_t i = 0;
+  while(i < clients.size())
   {
     MqttClient* client = clients[i];
     if (client->connected())
@@ -235,73 +324,390 @@ void MqttBroker::loop()
     else
     {
       debug("Client " << client->id().c_str() << "  Disconnected, local_broker=" << (dbg_ptr)client->local_broker);
-      // Note: deleting a client not added by the broker itself will probably crash later.
-      delete client;
-      break;
+      client->close(false);   // Removed, deleted below
     }
+    // A removed client is replaced by the last one
+    if (i < clients.size() and clients[i] == client) i++;
   }
+#endif
+  if (remote_broker and uplink.changed()) uplink.update(*remote_broker);
+  MqttClient::coalesce--;
+  if (remote_broker) remote_broker->flush();
+  for(auto client: flushing)
+  {
+    client->flush_queued = false;
+    client->flush();
+  }
+  flushing.clear();
+
+  // Clients removed by this loop (or since the last one)
+  for(auto client: reaped) delete client;
+  reaped.clear();
+
+  if (persistence)
+  {
+    persistence->sync();
+    if (persistence->compactNeeded()) compact();
+  }
+}
+
+void MqttBroker::begin()
+{
+  if (persistence) persistence->load(onRecord, this);
+  server->begin();
 }
 
 // Obvioulsy called when the broker is connected to another broker.
 MqttError MqttBroker::subscribe(MqttClient* client, const Topic& topic, uint8_t qos)
 {
   debug("MqttBroker::subscribe to " << topic.str() << ", retained=" << retained.size() );
-  for(auto& retainItem: retained)
-  {
-    auto &retained_topic = retainItem.first;
-    auto &retain = retainItem.second;
-    debug("  retained: " << retained_topic.str());
-    if (topic.matches(retained_topic))
-    {
-      debug("  -> sending");
-      client->publishIfSubscribed(retained_topic, retain.msg);
-    }
-  }
-  if (remote_broker && remote_broker->connected())
+  // Not indexed, or its levels are not (see StringIndexer::overflows())
+  if (not topic.valid() or topic.levels().empty()) return MqttInvalidMessage;
+  TopicFilter filter(topic);
+  if (client != remote_broker) uplink.add(topic, qos, subscriptions.add(topic.levels(), client));
+  retained.match(filter, [client](const Topic& retained_topic, const MqttFrame& frame)
   {
-    return remote_broker->subscribe(topic, qos);
-  }
-  return MqttNowhereToSend;
+    debug("  retained: " << retained_topic.str() << " -> sending");
+    MqttMessage msg(frame);
+    client->publishIfSubscribed(retained_topic, msg);
+  });
+  // The parent broker is subscribed by the next loop() (uplink)
+  return remote_broker and remote_broker->connected() ? MqttOk : MqttNowhereToSend;
+}
+
+void MqttBroker::unsubscribe(MqttClient* client, const Topic& topic)
+{
+  debug("MqttBroker::unsubscribe from " << topic.str());
+  if (subscriptions.remove(topic.levels(), client)) uplink.remove(topic);
 }
 
 MqttError MqttBroker::publish(const MqttClient* source, const Topic& topic, MqttMessage& msg)
 {
   MqttError retval = MqttOk;
+  if (not topic.valid()) return MqttInvalidMessage;   // See StringIndexer::overflows()
 
+  // Encoded (once, see MqttMessage::frame) only if a network client,
+  // a retained message, a session or another shard needs it
   retain(topic, msg);
+#ifdef TINY_MQTT_SHARDS
+  if (shards and not from_shard and msg.frame()) shards->forward(shard, msg.frame());
+#endif
 
   debug("MqttBroker::publish");
-  int i=0;
-  for(auto client: clients)
+  if (remote_broker and source != remote_broker and remote_broker->mqtt_connected()
+      and remote_broker->isSubscribedTo(topic))
+  {
+    // Forwarded once, the parent broker sends it back to the local subscribers
+    return remote_broker->deliver(topic, msg);
+  }
+
+  // Clients subscribed more than once are kept once
+  size_t first = matching.size();
+  subscriptions.match(topic.levels(), matching);
+  uint32_t mark = ++publish_mark;
+  size_t last = first;
+  for(size_t i=first; i<matching.size(); i++)
+  {
+    MqttClient* client = matching[i];
+    if (client->publish_mark == mark) continue;
+    client->publish_mark = mark;
+    matching[last++] = client;
+  }
+  matching.resize(last);
+
+  // matching may grow if a callback publishes again, so use indexes
+  for(size_t i=first; i<last; i++)
   {
-    i++;
+    MqttClient* client = matching[i];
 #if TINY_MQTT_DEBUG
     Console << __LINE__ << " broker:" << (remote_broker && remote_broker->connected() ? "linked" : "alone") <<
-       "  srce=" << (source->isLocal() ? "loc" : "rem") << " clt#" << i << ", local=" << client->isLocal() << ", con=" << client->connected() << endl;
+       "  srce=" << (source == nullptr ? "shard" : source->isLocal() ? "loc" : "rem") << " clt " << client->id().c_str() << ", local=" << client->isLocal() << ", con=" << client->connected() << endl;
 #endif
-    bool doit = false;
-    if (remote_broker && remote_broker->connected())  // this (MqttBroker) is connected (to a external broker)
+    MqttError ret = client->deliver(topic, msg);
+    if (ret != MqttOk) retval = ret;
+  }
+  matching.resize(first);
+
+  if (not offline.empty() and (msg.flags() & 6))   // QoS>0 publishes are kept for offline sessions
+  {
+    offline.match(topic.levels(), offline_matching);
+    for(MqttSession* session: offline_matching)
     {
-      // ext_broker -> clients or clients -> ext_broker
-      if (source == remote_broker)  // external broker -> internal clients
-        doit = true;
-      else                  // external clients -> this broker
-      {
-        // As this broker is connected to another broker, simply forward the msg
-        MqttError ret = remote_broker->publishIfSubscribed(topic, msg);
-        if (ret != MqttOk) retval = ret;
-      }
+      if (session->publish_mark == mark) continue;
+      session->publish_mark = mark;
+      session->queue(msg.frame(), session_messages, session_bytes);
     }
-    else // Disconnected
+    offline_matching.clear();
+  }
+  return retval;
+}
+
+void MqttBroker::sessions(uint32_t expiry, uint16_t max_messages, size_t max_bytes, uint16_t max)
+{
+  session_expiry = expiry;
+  session_messages = max_messages;
+  session_bytes = max_bytes;
+  max_sessions = max;
+  if (expiry == 0)
+  {
+    while(offline_sessions.size()) eraseSession(offline_sessions.begin());
+  }
+}
+
+const MqttSession* MqttBroker::session(const string& id) const
+{
+  auto it = offline_sessions.find(id);
+  return it == offline_sessions.end() ? nullptr : it->second;
+}
+
+// Called when client connects: its session if it must be resumed
+MqttSession* MqttBroker::takeSession(MqttClient* client)
+{
+  auto it = offline_sessions.find(client->id());
+  if (it == offline_sessions.end()) return nullptr;
+  MqttSession* session = it->second;
+  offline_sessions.erase(it);
+  for(const auto& filter: session->subscriptions)
+    if (offline.remove(filter.levels(), session)) uplink.remove(filter);
+  if (client->mqtt_flags & MqttClient::FlagCleanSession)
+  {
+    endSession(session->id);
+    delete session;
+    return nullptr;
+  }
+  return session;
+}
+
+void MqttBroker::resumeSession(MqttClient* client, MqttSession* session)
+{
+  debug("MqttBroker::resumeSession " << session->id << ", queued=" << session->count);
+  for(const auto& filter: session->subscriptions)
+  {
+    client->subscriptions.insert(filter);
+    if (subscriptions.add(filter.levels(), client)) uplink.add(filter, filter.qos());
+  }
+  client->filters_dirty = true;
+
+  // Missed publishes, sent with one write
+  MqttClient::coalesce++;
+  client->received = session->received;
+  for(uint16_t id: session->released)
+  {
+    MqttInflight::Entry* entry = client->inflight_.restore(id);
+    if (entry == nullptr) continue;
+    entry->sent = millis();
+    client->retryLater();
+    client->sendAck(MqttMessage::Type::PubRel, id);
+  }
+  for(uint16_t i=0; i<session->count; i++)
+  {
+    MqttMessage msg(session->ring[(session->head+i) % session->ring.size()]);
+    const char* topic = msg.getVHeader();
+    client->deliver(Topic(topic+2, MqttMessage::getSize(topic)), msg);
+  }
+  MqttClient::coalesce--;
+  client->flush();
+  delete session;
+}
+
+// Called when client is removed: keeps its session if it asked for it
+void MqttBroker::keepSession(MqttClient* client)
+{
+  if (session_expiry == 0 or client->tcp_client == nullptr) return;
+  if (client->mqtt_flags & MqttClient::FlagCleanSession) return;
+
+  debug("MqttBroker::keepSession " << client->id());
+  MqttSession* session = new MqttSession(this, client->id());
+  session->subscriptions = client->subscriptions;
+  session->received = client->received;
+
+  // Not acknowledged publishes are sent again on resume, in order
+  std::vector<MqttInflight::Entry*> inflight;
+  client->inflight_.each([&inflight](MqttInflight::Entry& entry) { inflight.push_back(&entry); });
+  std::stable_sort(inflight.begin(), inflight.end(),
+    [](const MqttInflight::Entry* a, const MqttInflight::Entry* b) { return (int32_t)(a->sent - b->sent) < 0; });
+  for(auto entry: inflight)
+  {
+    if (entry->released)
+      session->released.push_back(entry->id);   // Received by the client
+    else
+      session->queue(entry->frame, session_messages, session_bytes);
+  }
+  for(const auto& waiting: client->inflight_.waiting())
+    session->queue(waiting.frame, session_messages, session_bytes);
+  addSession(session);
+}
+
+// Offline session (kept or restored), replaces the one with the same id
+void MqttBroker::addSession(MqttSession* session)
+{
+  auto old = offline_sessions.find(session->id);
+  if (old != offline_sessions.end()) eraseSession(old, false);
+  while(offline_sessions.size() and offline_sessions.size() >= max_sessions)
+  {
+    auto oldest = offline_sessions.begin();
+    for(auto it=offline_sessions.begin(); it!=offline_sessions.end(); it++)
+      if ((int32_t)(it->second->expires - oldest->second->expires) < 0) oldest = it;
+    eraseSession(oldest);
+  }
+  if (max_sessions == 0)
+  {
+    endSession(session->id);
+    delete session;
+    return;
+  }
+
+  uint64_t delay = uint64_t(session_expiry)*1000;
+  if (delay > TimingWheel::MaxDelay) delay = TimingWheel::MaxDelay;
+  session->expires = millis() + uint32_t(delay);
+  MqttClient::timers.schedule(session->expiry, uint32_t(delay), millis());
+  for(const auto& filter: session->subscriptions)
+    if (offline.add(filter.levels(), session)) uplink.add(filter, filter.qos());
+  offline_sessions[session->id] = session;
+}
+
+void MqttBroker::eraseSession(std::map<string, MqttSession*>::iterator it, bool ended)
+{
+  MqttSession* session = it->second;
+  for(const auto& filter: session->subscriptions)
+    if (offline.remove(filter.levels(), session)) uplink.remove(filter);
+  offline_sessions.erase(it);
+  if (ended) endSession(session->id);
+  delete session;
+}
+
+void MqttUplink::add(const Topic& filter, uint8_t qos, bool subscriber)
+{
+  auto it = filters.find(filter);
+  if (it == filters.end())
+  {
+    if (not subscriber) return;
+    filters[filter] = Interest{1, qos};
+    changed_ = true;
+    return;
+  }
+  if (subscriber) it->second.subscribers++;
+  if (qos > it->second.qos)
+  {
+    it->second.qos = qos;
+    changed_ = true;
+  }
+}
+
+void MqttUplink::remove(const Topic& filter)
+{
+  auto it = filters.find(filter);
+  if (it == filters.end()) return;
+  if (--it->second.subscribers) return;
+  filters.erase(it);
+  changed_ = true;
+}
+
+void MqttUplink::update(MqttClient& parent)
+{
+  changed_ = false;
+
+  // Filters not covered by another one (the first of equivalent ones is kept),
+  // with the max qos of the filters they cover
+  std::vector<TopicFilter> all;
+  all.reserve(filters.size());
+  for(const auto& it: filters) all.push_back(TopicFilter(it.first, it.second.qos));
+  std::set<TopicFilter> wanted;
+  for(size_t i=0; i<all.size(); i++)
+  {
+    bool covered = false;
+    uint8_t qos = all[i].qos();
+    for(size_t j=0; j<all.size() and not covered; j++)
     {
-      doit = true;
+      if (i == j) continue;
+      if (all[j].covers(all[i]))
+        covered = j < i or not all[i].covers(all[j]);
+      else if (all[i].covers(all[j]) and all[j].qos() > qos)
+        qos = all[j].qos();
     }
-#if TINY_MQTT_DEBUG
-    Console << ", doit=" << doit << ' ';
-#endif
+    if (not covered) wanted.insert(TopicFilter(all[i], qos));
+  }
+
+  // Differences with the subscriptions of the parent
+  bool send = parent.mqtt_connected();  // else subscribed by the CONNACK
+  for(auto it = parent.subscriptions.begin(); it != parent.subscriptions.end();)
+  {
+    auto want = wanted.find(*it);
+    if (want != wanted.end() and want->qos() == it->qos())
+    {
+      wanted.erase(want);   // already subscribed
+      ++it;
+      continue;
+    }
+    if (want == wanted.end() and send) parent.sendTopic(*it, MqttMessage::Type::UnSubscribe, 0);
+    it = parent.subscriptions.erase(it);
+  }
+  for(const auto& filter: wanted)
+  {
+    parent.subscriptions.insert(filter);
+    if (send) parent.sendTopic(filter, MqttMessage::Type::Subscribe, filter.qos());
+  }
+  parent.filters_dirty = true;
+}
+
+void MqttSession::onExpired(void* session_ptr)
+{
+  MqttSession* session = static_cast<MqttSession*>(session_ptr);
+  debug("Session expired " << session->id);
+  MqttBroker* broker = session->broker;
+  broker->eraseSession(broker->offline_sessions.find(session->id));
+}
+
+void MqttSession::queue(const MqttFrame& frame, uint16_t max_messages, size_t max_bytes)
+{
+  if (not frame or max_messages == 0 or frame.size() > max_bytes)
+  {
+    dropped_count++;
+    return;
+  }
+  if (ring.size() != max_messages and count == 0)
+  {
+    ring.clear();
+    ring.resize(max_messages);
+    head = 0;
+  }
+  while(count and (count == ring.size() or queued_bytes+frame.size() > max_bytes))
+  {
+    queued_bytes -= ring[head].size();
+    ring[head] = MqttFrame();
+    head = (head+1) % ring.size();
+    count--;
+    dropped_count++;
+  }
+  ring[(head+count) % ring.size()] = frame;
+  count++;
+  queued_bytes += frame.size();
+}
+
+MqttError MqttBroker::publishChunk(const MqttClient* source, const Topic& topic, const MqttMessage& msg)
+{
+  debug("MqttBroker::publishChunk " << msg.chunkOffset());
+  if (remote_broker && remote_broker->connected() && source != remote_broker)
+  {
+    // As this broker is connected to another broker, simply forward the chunk
+    return remote_broker->publishChunk(source, topic, msg);
+  }
+  MqttError retval = MqttOk;
+  for(auto client: clients)
+    if (client->publishChunk(source, topic, msg) != MqttOk) retval = MqttWouldBlock;
 
-    if (doit) retval = client->publishIfSubscribed(topic, msg);
-    debug("");
+  if (msg.chunkOffset() == 0 and not offline.empty() and (msg.flags() & 6))
+  {
+    // The payload is not held, offline sessions cannot keep it
+    uint32_t mark = ++publish_mark;
+    offline.match(topic.levels(), offline_matching);
+    for(MqttSession* session: offline_matching)
+    {
+      if (session->publish_mark == mark) continue;
+      session->publish_mark = mark;
+      session->dropped_count++;
+    }
+    offline_matching.clear();
   }
   return retval;
 }
@@ -328,48 +734,77 @@ void MqttClient::clientAlive(uint32_t more_seconds)
   if (keep_alive)
   {
 #ifdef EPOXY_DUINO
-    alive=millis()+500000+0*more_seconds;
+    timers.schedule(alive_timer, 500000+0*more_seconds, millis());
 #else
-    alive=millis()+1000*(keep_alive+more_seconds);
+    timers.schedule(alive_timer, 1000*(keep_alive+more_seconds), millis());
 #endif
   }
   else
-    alive=0;
+    alive_timer.cancel();
 }
 
-void MqttClient::loop()
+void MqttClient::onAlive(void* client_ptr)
 {
-  if (keep_alive && (millis() >= alive))
+  MqttClient* client = static_cast<MqttClient*>(client_ptr);
+  if (client->cltFlags & CltFlagToDelete)  // broker side of a tcp client
   {
-    if (tcp_client && tcp_client->connected())
-    {
-      debug("pingreq");
-      static MqttMessage pingreq(MqttMessage::Type::PingReq);
-      pingreq.sendTo(this);
-      clientAlive(0);
+    debug(red << "timeout client " << client->id().c_str());
+    client->close(false);   // deleted by the next MqttBroker::loop
+  }
+  else if (client->tcp_client && client->tcp_client->connected())
+  {
+    debug("pingreq");
+    static TINY_MQTT_THREAD_LOCAL MqttMessage pingreq(MqttMessage::Type::PingReq);
+    pingreq.sendTo(client);
+    client->clientAlive(0);
 
-      // TODO when many MqttClient passes through a local broker
-      // there is no need to send one PingReq per instance.
-    }
-    else if (local_broker)
-    {
-      debug(red << "timeout client");
-      close();
-      debug(red << "closed");
-    }
+    // TODO when many MqttClient passes through a local broker
+    // there is no need to send one PingReq per instance.
   }
+}
+
+void MqttClient::onRetry(void* client)
+{
+  static_cast<MqttClient*>(client)->retransmit();
+}
+
+void MqttClient::loop()
+{
+  flush();  // What a slow link could not take yet
+  if (local_broker == nullptr) timers.advance(millis());  // else advanced by the broker
 
 #ifndef TINY_MQTT_ASYNC
   while(tcp_client && tcp_client->available()>0)
   {
-    message.incoming(tcp_client->read());
+    char data[TINY_MQTT_READ_BUFFER];
+    int len = tcp_client->read(reinterpret_cast<uint8_t*>(data), sizeof(data));
+    if (len <= 0) break;
+    incoming(data, len);
+  }
+#endif
+}
+
+void MqttClient::incoming(const char* data, size_t len)
+{
+  while(len>0)
+  {
+    size_t used = message.incoming(data, len);
+    data += used;
+    len -= used;
     if (message.type())
     {
       processMessage(&message);
       message.reset();
     }
+    else if (message.isChunk())
+    {
+      processChunk(&message);
+      message.nextChunk();
+    }
+    else
+      continue;
+    if (tcp_client and not tcp_client->connected()) break;
   }
-#endif
 }
 
 void MqttClient::onConnect(void *mqttclient_ptr, TcpClient*)
@@ -379,7 +814,7 @@ void MqttClient::onConnect(void *mqttclient_ptr, TcpClient*)
   MqttMessage msg(MqttMessage::Type::Connect);
   msg.add("MQTT",4);
   msg.add(0x4);  // Mqtt protocol version 3.1.1
-  msg.add(0x0);  // Connect flags         TODO user / name
+  msg.add(mqtt->clean_session ? FlagCleanSession : 0);  // Connect flags         TODO user / name
 
   msg.add((char)(mqtt->keep_alive >> 8));   // keep_alive
   msg.add((char)(mqtt->keep_alive & 0xFF));
@@ -395,18 +830,8 @@ void MqttClient::onConnect(void *mqttclient_ptr, TcpClient*)
 #ifdef TINY_MQTT_ASYNC
 void MqttClient::onData(void* client_ptr, TcpClient*, void* data, size_t len)
 {
-  char* char_ptr = static_cast<char*>(data);
   MqttClient* client=static_cast<MqttClient*>(client_ptr);
-  while(len>0)
-  {
-    client->message.incoming(*char_ptr++);
-    if (client->message.type())
-    {
-      client->processMessage(&client->message);
-      client->message.reset();
-    }
-    len--;
-  }
+  client->incoming(static_cast<const char*>(data), len);
 }
 #endif
 
@@ -417,14 +842,14 @@ void MqttClient::resubscribe()
   {
     MqttMessage msg(MqttMessage::Type::Subscribe, 2);
 
-    // TODO manage packet identifier
-    msg.add(0);
-    msg.add(0);
+    uint16_t id = nextPacketId();
+    msg.add(id >> 8);
+    msg.add(id & 0xFF);
 
     for(auto topic: subscriptions)
     {
       msg.add(topic);
-      msg.add(0);    // TODO qos
+      msg.add(topic.qos());
     }
     msg.sendTo(this);  // TODO return value
   }
@@ -435,7 +860,10 @@ MqttError MqttClient::subscribe(Topic topic, uint8_t qos)
   debug("MqttClient::subsribe(" << topic.c_str() << ")");
   MqttError ret = MqttOk;
 
-  subscriptions.insert(topic);
+  auto old = subscriptions.find(topic);
+  if (old != subscriptions.end()) subscriptions.erase(old);   // qos may change
+  subscriptions.insert(TopicFilter(topic, qos));
+  filters_dirty = true;
 
   if (local_broker==nullptr) // connected to a remote broker
   {
@@ -443,7 +871,11 @@ MqttError MqttClient::subscribe(Topic topic, uint8_t qos)
   }
   else
   {
-    return local_broker->subscribe(this, topic, qos);
+    ret = local_broker->subscribe(this, topic, qos);
+    if (ret == MqttInvalidMessage)
+    {
+      subscriptions.erase(subscriptions.find(topic));   // would never match
+    }
   }
   return ret;
 }
@@ -455,10 +887,12 @@ MqttError MqttClient::unsubscribe(Topic topic)
   if (it != subscriptions.end())
   {
     subscriptions.erase(it);
+    filters_dirty = true;
     if (local_broker==nullptr) // remote broker
     {
       return sendTopic(topic, MqttMessage::Type::UnSubscribe, 0);
     }
+    local_broker->unsubscribe(this, topic);
   }
   return MqttOk;
 }
@@ -468,15 +902,14 @@ MqttError MqttClient::sendTopic(const Topic& topic, MqttMessage::Type type, uint
   debug("MqttClient::sendTopic");
   MqttMessage msg(type, 2);
 
-  // TODO manage packet identifier
-  msg.add(0);
-  msg.add(0);
+  uint16_t id = nextPacketId();
+  msg.add(id >> 8);
+  msg.add(id & 0xFF);
 
   msg.add(topic);
-  msg.add(qos);
+  if (type == MqttMessage::Type::Subscribe) msg.add(qos);
 
-  // TODO instead we should wait (state machine) for SUBACK / UNSUBACK ?
-  return msg.sendTo(this);
+  return msg.sendTo(this);   // SUBACK / UNSUBACK: see setAckCallback()
 }
 
 void MqttClient::processMessage(MqttMessage* mesg)
@@ -547,24 +980,48 @@ void MqttClient::processMessage(MqttMessage* mesg)
       #endif
       bclose = false;
       setFlag(CltFlagConnected);
+      local_broker->takeOver(this);
       {
+        MqttSession* session = local_broker->takeSession(this);
         MqttMessage msg(MqttMessage::Type::ConnAck);
-        msg.add(0);  // Session present (not implemented)
+        msg.add(session ? 1 : 0);  // Session present
         msg.add(0);  // Connection accepted
         msg.sendTo(this);
+        if (session) local_broker->resumeSession(this, session);
+        if (not (mqtt_flags & FlagCleanSession)) local_broker->saveSession(id(), subscriptions);
       }
       break;
 
     case MqttMessage::Type::ConnAck:
       setFlag(CltFlagConnected);
+      session_present = header[0] & 1;
       bclose = false;
-      resubscribe();
+      if (not session_present)  // else the broker kept them
+      {
+        received.clear();
+        resubscribe();
+      }
+      acked(MqttMessage::Type::ConnAck, 0, header[1]);
       break;
 
     case MqttMessage::Type::SubAck:
+      if (not mqtt_connected()) break;
+      bclose = false;
+      acked(MqttMessage::Type::SubAck, MqttMessage::getSize(header), header+2 < mesg->end() ? header[2] : 0x80);
+      break;
+
     case MqttMessage::Type::PubAck:
+    case MqttMessage::Type::PubRec:
+    case MqttMessage::Type::PubComp:
       if (not mqtt_connected()) break;
-      // Ignore acks
+      acknowledged(MqttMessage::getSize(header), mesg->type());
+      bclose = false;
+      break;
+
+    case MqttMessage::Type::PubRel:
+      if (not mqtt_connected() or mesg->flags() != 2) break;
+      received.release(MqttMessage::getSize(header));
+      sendAck(MqttMessage::Type::PubComp, MqttMessage::getSize(header));  // Even if unknown
       bclose = false;
       break;
 
@@ -579,7 +1036,7 @@ void MqttClient::processMessage(MqttMessage* mesg)
       {
         uint16_t pingreq = MqttMessage::Type::PingResp;
         debug(cyan << "Ping response to client ");
-        tcp_client->write((const char*)(&pingreq), 2);
+        write((const char*)(&pingreq), 2);
         bclose = false;
       }
       else
@@ -607,24 +1064,20 @@ void MqttClient::processMessage(MqttMessage* mesg)
           if (mesg->type() == MqttMessage::Type::Subscribe)
           {
             uint8_t qos = *payload++;
-            if (qos != 0)
+            if (qos > 2)
             {
-              debug("Unsupported QOS" << qos << endl);
+              debug("Invalid QOS" << qos << endl);
               qoss.push_back(0x80);
+              continue;
             }
-            else
-              qoss.push_back(qos);
-            subscribe(topic);
+            qoss.push_back(subscribe(topic, qos) == MqttInvalidMessage ? 0x80 : qos);
           }
           else
-          {
-            auto it=subscriptions.find(topic);
-            if (it != subscriptions.end())
-              subscriptions.erase(it);
-          }
+            unsubscribe(topic);
         }
         debug("end loop");
         bclose = false;
+        if (local_broker and not (mqtt_flags & FlagCleanSession)) local_broker->saveSession(id(), subscriptions);
 
         MqttMessage ack(mesg->type() == MqttMessage::Type::Subscribe ? MqttMessage::Type::SubAck : MqttMessage::Type::UnSuback);
         ack.add(header[0]);
@@ -637,6 +1090,7 @@ void MqttClient::processMessage(MqttMessage* mesg)
     case MqttMessage::Type::UnSuback:
       if (not mqtt_connected()) break;
       bclose = false;
+      acked(MqttMessage::Type::UnSuback, MqttMessage::getSize(header), 0);
       break;
 
     case MqttMessage::Type::Publish:
@@ -655,23 +1109,25 @@ void MqttClient::processMessage(MqttMessage* mesg)
           Console << "Received Publish (" << published.str().c_str() << ") size=" << (int)len << endl;
         #endif
 
-        const char* ID;     // remove PublishID() to avoid misuse
+        uint16_t id = 0;
         if (qos) {
-          ID = payload;
-          payload+=2;  // ignore packet identifier if any
+          id = MqttMessage::getSize(payload);
+          payload+=2;
         }
-        len=mesg->end()-payload;
+        size_t payload_length = mesg->end()-payload;
+        bool fresh = true;
         if (qos == 1)
-        {
-          MqttMessage msg(MqttMessage::Type::PubAck);
-          msg.add(ID[0]);  // MessageID high
-          msg.add(ID[1]);  // MessageID low
-          msg.sendTo(this);
-        }
+          sendAck(MqttMessage::Type::PubAck, id);
+        else if (qos == 2 and tcp_client)
+          fresh = receivedQos2(id);
         // TODO reset DUP
         // TODO reset RETAIN
 
-        if (local_broker==nullptr or tcp_client==nullptr)  // internal MqttClient receives publish
+        if (not fresh)
+        {
+          debug("qos 2 publish " << id << " already received");
+        }
+        else if (local_broker==nullptr or tcp_client==nullptr)  // internal MqttClient receives publish
         {
           #if TINY_MQTT_DEBUG
             if (TinyMqtt::debug >= 2)
@@ -682,7 +1138,7 @@ void MqttClient::processMessage(MqttMessage* mesg)
           #endif
           if (callback and isSubscribedTo(published))
           {
-            callback(this, published, payload, len);
+            callback(this, published, payload, payload_length);
           }
         }
         else if (local_broker) // from outside to inside
@@ -722,112 +1178,661 @@ void MqttClient::processMessage(MqttMessage* mesg)
   }
 }
 
-bool Topic::matches(const Topic& topic) const
+void MqttClient::processChunk(MqttMessage* mesg)
 {
-  if (getIndex() == topic.getIndex()) return true;
-  const char* p1 = c_str();
-  const char* p2 = topic.c_str();
+  if (not mqtt_connected() and tcp_client)
+  {
+    close();
+    return;
+  }
+#ifdef EPOXY_DUINO
+  if (mesg->lastChunk()) counters[MqttMessage::Type::Publish]++;
+#endif
+  const char* header = mesg->getVHeader();
+  uint16_t len;
+  mesg->getString(header, len);
+  Topic published(header, len);
+
+  uint8_t qos = (mesg->flags() >> 1) & 3;
+  uint16_t id = qos ? MqttMessage::getSize(header+len) : 0;
+  // A stream is skipped as a whole, never stopped in the middle: when it was
+  // already delivered (sent again), or when its id could not be recorded at
+  // the end (not acknowledged, it will be sent again)
+  if (mesg->chunkOffset() == 0)
+  {
+    stream_skip = qos == 2 and (received.has(id) or not received.canMark(id));
+    stream_dropped = false;
+  }
 
-  if (p1 == p2) return true;
-  if (*p2 == '$' and *p1 != '$') return false;
+  if (stream_skip)
+  {
+    debug("qos 2 streamed publish " << id << " skipped");
+  }
+  else if (local_broker==nullptr)
+  {
+    if (stream_callback and isSubscribedTo(published))
+      stream_callback(this, published, mesg->chunk(), mesg->chunkLength(), mesg->chunkOffset(), mesg->payloadLength());
+  }
+  else if (local_broker->publishChunk(this, published, *mesg) != MqttOk)
+    stream_dropped = true;
 
-  while(*p1 and *p2)
+  if (mesg->lastChunk())
   {
-    if (*p1 == '+')
-    {
-      ++p1;
-      if (*p1 and *p1!='/') return false;
-      if (*p1) ++p1;
-      while(*p2 and *p2++!='/');
-    }
-    else if (*p1 == '#')
-    {
-      if (*++p1==0) return true;
-      return false;
-    }
-    else if (*p1 == '*')
-    {
-      const char c=*(p1+1);
-      if (c==0) return true;
-      if (c!='/') return false;
-      const char*p = p1+2;
-      while(*p and *p2)
-      {
-        if (*p == *p2)
-        {
-          if (*p==0) return true;
-          if (*p=='/')
-          {
-            p1=p;
-            break;
-          }
-        }
-        else
-        {
-          while(*p2 and *p2++!='/');
-          break;
-        }
-        ++p;
-        ++p2;
-      }
-      if (*p==0) return true;
-    }
-    else if (*p1 == *p2)
-    {
-      ++p1;
-      ++p2;
-    }
-    else
-      return false;
+    // A qos 1 publish that some subscribers skipped is not acknowledged, so it is sent again.
+    // (qos 2 is acknowledged, sending it again would duplicate it for the other subscribers)
+    if (qos == 1 and not stream_dropped)
+      sendAck(MqttMessage::Type::PubAck, id);
+    else if (qos == 2 and (not stream_skip or received.has(id)))
+      receivedQos2(id);
   }
-  if (*p1=='/' and p1[1]=='#' and p1[2]==0) return true;
-  return *p1==0 and *p2==0;
+  clientAlive(local_broker ? 5 : 0);
 }
 
-
-// publish from local client
-MqttError MqttClient::publish(const Topic& topic, const char* payload, size_t pay_length, bool retain)
+TopicFilter::TopicFilter(const Topic& topic, uint8_t qos) : Topic(topic), qos_(qos)
 {
-  MqttMessage msg(MqttMessage::Publish, retain ? 1 : 0);
-  msg.add(topic);
-  msg.add(payload, pay_length, false);
-  msg.complete();
+  filter = &levels();
+  if (filter->empty()) return;   // Not valid, never matches
 
-  if (local_broker)
+  size_t wildcards = 0;
+  for(auto level: *filter)
+    if (TopicWildcards::isWildcard(level)) wildcards++;
+
+  dollar = TopicWildcards::isWildcard(filter->front());
+  if (wildcards == 0)
+    kind_ = Exact;
+  else if (wildcards == 1 and filter->back() == TopicWildcards::hash() and filter->size() <= 256)
   {
-    return local_broker->publish(this, topic, msg);
+    kind_ = Prefix;
+    prefix = filter->size()-1;
   }
-  else if (tcp_client and connected())
-    return msg.sendTo(this);
   else
-    return MqttNowhereToSend;
+    kind_ = Generic;
 }
 
-// republish a received publish if it matches any in subscriptions
-MqttError MqttClient::publishIfSubscribed(const Topic& topic, MqttMessage& msg)
+bool TopicFilter::matches(const Topic& topic) const
 {
-  MqttError retval=MqttOk;
+  if (not valid() or not topic.valid()) return false;
+  if (getIndex() == topic.getIndex()) return true;
 
-  debug("mqttclient publishIfSubscribed " << topic.c_str() << ' ' << subscriptions.size());
+  if (kind_ == Exact) return false;
+
+  const auto& levels = topic.levels();
+  if (levels.empty()) return false;
+  if (dollar and TopicWildcards::isDollar(levels[0])) return false;
+
+  if (kind_ == Prefix)
+  {
+    if (levels.size() < prefix) return false;
+    return std::equal(filter->begin(), filter->begin()+prefix, levels.begin());
+  }
+  return TopicWildcards::matches(*filter, 0, levels, 0);
+}
+
+bool TopicFilter::covers(const TopicFilter& other) const
+{
+  if (not valid() or not other.valid()) return false;
+  if (getIndex() == other.getIndex()) return true;
+  if (kind_ == Exact) return false;
+  if (dollar and not other.dollar and TopicWildcards::isDollar(other.filter->front())) return false;
+  return TopicWildcards::covers(*filter, 0, *other.filter, 0);
+}
+
+bool Topic::matches(const Topic& topic) const
+{
+  // Same as TopicFilter::matches, without compiling this filter at each call
+  if (not valid() or not topic.valid()) return false;
+  if (getIndex() == topic.getIndex()) return true;
+
+  const auto& filter = levels();
+  const auto& topic_levels = topic.levels();
+  if (filter.empty() or topic_levels.empty()) return false;
+  if (TopicWildcards::isWildcard(filter.front()) and TopicWildcards::isDollar(topic_levels.front())) return false;
+  return TopicWildcards::matches(filter, 0, topic_levels, 0);
+}
+
+
+// publish from local client
+MqttError MqttClient::publish(const Topic& topic, const char* payload, size_t pay_length, bool retain, uint8_t qos, bool terminated)
+{
+  qos &= 3;
+  if (pay_length > MqttMessage::MaxRemainingLength-topic.str().length()-2-(qos ? 2 : 0))
+    return MqttInvalidMessage;
+  uint8_t flags = (retain ? 1 : 0) | (qos << 1);
+
+  if (local_broker)
+  {
+    // Given as is to the local subscribers, encoded only for the network ones
+    MqttMessage msg(topic, payload, pay_length, flags, terminated);
+    return local_broker->publish(this, topic, msg);
+  }
+
+  // Not copied when too big, so it could not be sent again: only QoS 0
+  if (qos and pay_length > MqttMessage::MaxBufferLength) return MqttInvalidMessage;
+
+  MqttMessage msg(MqttMessage::Publish, flags);
+  msg.add(topic);
+  if (qos)
+  {
+    msg.add(0);   // packet identifier, given when sent (see sendPublish)
+    msg.add(0);
+  }
+  if (pay_length > MqttMessage::MaxBufferLength)
+  {
+    // Do not copy the payload, it is written just after the message
+    if (not (tcp_client and connected())) return MqttNowhereToSend;
+    msg.complete(pay_length);
+    MqttError ret = msg.sendTo(this);
+    if (ret == MqttOk) send(payload, pay_length, true);
+    return ret;
+  }
+  msg.add(payload, pay_length, false);
+  msg.complete();
+
+  if (tcp_client and connected())
+    return qos ? publishQos(msg.frame(), qos) : msg.sendTo(this);
+  else
+    return MqttNowhereToSend;
+}
+
+// republish a received publish if it matches any in subscriptions
+MqttError MqttClient::publishIfSubscribed(const Topic& topic, MqttMessage& msg)
+{
+  MqttError retval=MqttOk;
+
+  debug("mqttclient publishIfSubscribed " << topic.c_str() << ' ' << subscriptions.size());
   if (isSubscribedTo(topic))
+    retval = deliver(topic, msg);
+  return retval;
+}
+
+MqttError MqttClient::deliver(const Topic& topic, MqttMessage& msg)
+{
+  if (tcp_client == nullptr)
+  {
+    // In process: no parsing, the topic is the one of the publisher
+#ifdef EPOXY_DUINO
+    counters[MqttMessage::Type::Publish]++;
+#endif
+    if (callback)
+    {
+      const char* payload = msg.terminatedPayload();
+      callback(this, topic, payload ? payload : "", msg.payloadLength());
+    }
+    return MqttOk;
+  }
+
+  uint8_t qos = (msg.flags() >> 1) & 3;
+  if (qos == 0) return msg.sendTo(this);   // As received
+
+  uint8_t granted = subscribedQos(topic);
+  if (granted < qos) qos = granted;
+  if (qos == 0) return sendPublish(msg.frame(), 0, 0, false);
+  return publishQos(msg.frame(), qos);
+}
+
+uint8_t MqttClient::subscribedQos(const Topic& topic) const
+{
+  uint8_t qos = 0;
+  for(const auto& filter: subscriptions)
+    if (filter.qos() > qos and filter.matches(topic)) qos = filter.qos();
+  return qos;
+}
+
+uint16_t MqttClient::nextPacketId()
+{
+  do { packet_id++; } while(packet_id == 0 or inflight_.find(packet_id));
+  return packet_id;
+}
+
+MqttError MqttClient::publishQos(const MqttFrame& frame, uint8_t qos)
+{
+  if (not frame) return MqttInvalidMessage;   // Out of memory
+  if (inflight_.full() or inflight_.waiting().size())
+  {
+    // No place to wait: refused, the publisher decides what to do
+    if (not inflight_.wait(frame, qos, publish_sequence+1))
+    {
+      output_dropped++;
+      return MqttWouldBlock;
+    }
+    publish_sequence++;
+    return MqttOk;
+  }
+  publish_sequence++;
+  MqttInflight::Entry* entry = inflight_.add(frame, qos, publish_sequence);
+  entry->sent = millis();
+  retryLater();
+  return sendPublish(frame, qos, entry->id, false);
+}
+
+MqttError MqttClient::sendPublish(const MqttFrame& frame, uint8_t qos, uint16_t id, bool dup)
+{
+  if (not frame) return MqttInvalidMessage;   // Out of memory
+  // Fixed header, topic and id of frame are rewritten, the payload is shared
+  MqttMessage parsed(frame);
+  const char* bytes = frame.bytes();
+  const char* topic = parsed.getVHeader();
+  size_t topic_size = 2 + MqttMessage::getSize(topic);
+  const char* payload = topic + topic_size + ((bytes[0] & 6) ? 2 : 0);
+  size_t payload_size = bytes + frame.size() - payload;
+
+  char header[7];
+  header[0] = MqttMessage::Publish | (bytes[0] & 1) | (qos << 1) | (dup ? 8 : 0);
+  uint8_t header_size = 1 + MqttMessage::encodeLength(topic_size + (qos ? 2 : 0) + payload_size, header+1);
+  if (qos)
+  {
+    header[header_size+0] = id >> 8;  // after the topic
+    header[header_size+1] = id & 0xFF;
+  }
+  size_t total = header_size + topic_size + (qos ? 2 : 0) + payload_size;
+
+  if (streaming_from)
+  {
+    if (streamPendingFull(total)) return MqttWouldBlock;
+    stream_pending.append(header, header_size);
+    stream_pending.append(topic, topic_size);
+    if (qos) stream_pending.append(header+header_size, 2);
+    stream_pending.append(payload, payload_size);
+    return MqttOk;
+  }
+  size_t pending = outputPending();
+  if (pending and pending+total > output_max and flush() != MqttOk and outputPending()+total > output_max)
+  {
+    output_dropped++;
+    return MqttWouldBlock;
+  }
+
+  // One message, written at once
+  coalesce++;
+  send(header, header_size, true);
+  send(topic, topic_size, true);
+  if (qos) send(header+header_size, 2, true);
+  send(payload, payload_size, true);
+  coalesce--;
+  return coalesce ? MqttOk : flush();
+}
+
+MqttError MqttClient::sendAck(MqttMessage::Type type, uint16_t id)
+{
+  MqttMessage ack(type, type == MqttMessage::Type::PubRel ? 2 : 0);
+  ack.add(static_cast<char>(id >> 8));
+  ack.add(static_cast<char>(id & 0xFF));
+  return ack.sendTo(this);
+}
+
+bool MqttClient::receivedQos2(uint16_t id)
+{
+  switch(received.mark(id))
+  {
+    case MqttReceived::Full:
+      debug(red << "qos 2 publish " << id << " not acknowledged, too many ids not released");
+      return false;   // Will be sent again
+    case MqttReceived::Duplicate:
+      sendAck(MqttMessage::Type::PubRec, id);
+      return false;
+    default:
+      sendAck(MqttMessage::Type::PubRec, id);
+      return true;
+  }
+}
+
+void MqttClient::acknowledged(uint16_t id, MqttMessage::Type type)
+{
+  MqttInflight::Entry* entry = inflight_.find(id);
+  if (type == MqttMessage::Type::PubRec)
+  {
+    // Received: the payload is not needed anymore, the id is released
+    if (entry and entry->qos == 2 and not entry->released)
+    {
+      entry->released = true;
+      entry->frame = MqttFrame();
+      entry->sent = millis();
+    }
+    sendAck(MqttMessage::Type::PubRel, id);
+    return;
+  }
+  if (entry == nullptr) return;
+  if (entry->qos == 2 ? not (entry->released and type == MqttMessage::Type::PubComp) : type != MqttMessage::Type::PubAck)
+    return;
+
+  uint32_t sequence = entry->sequence;
+  inflight_.ack(id);
+  if (inflight_.size() == 0) retry_timer.cancel();
+  auto& waiting = inflight_.waiting();
+  while(waiting.size() and not inflight_.full())
+  {
+    MqttInflight::Waiting next = waiting.front();
+    waiting.pop_front();
+    MqttInflight::Entry* entry = inflight_.add(next.frame, next.qos, next.sequence);
+    entry->sent = millis();
+    retryLater();
+    sendPublish(next.frame, next.qos, entry->id, false);
+  }
+  if (sequence) acked(MqttMessage::Type::Publish, sequence, 0);
+}
+
+void MqttClient::retransmit()
+{
+  uint32_t now = millis();
+  uint32_t next = retry_delay;   // delay before the next one is due
+  inflight_.each([this, now, &next](MqttInflight::Entry& entry)
   {
-    if (tcp_client)
-      retval = msg.sendTo(this);
+    uint32_t age = now - entry.sent;
+    if (age < retry_delay)
+    {
+      if (retry_delay - age < next) next = retry_delay - age;
+      return;
+    }
+    debug("retransmit " << entry.id << " to " << clientId.c_str());
+    entry.sent = now;
+    entry.retries++;
+    retransmitted++;
+    if (entry.released)
+      sendAck(MqttMessage::Type::PubRel, entry.id);
     else
+      sendPublish(entry.frame, entry.qos, entry.id, true);
+  });
+  if (inflight_.size()) timers.schedule(retry_timer, next, now);
+}
+
+void MqttInflight::allocate()
+{
+  if (slots.size()) return;
+  slots.resize(window_);
+  free_slots.clear();
+  for(uint16_t k=window_; k>0; k--) free_slots.push_back(k-1);
+}
+
+MqttInflight::Entry* MqttInflight::add(const MqttFrame& frame, uint8_t qos, uint32_t sequence)
+{
+  if (full()) return nullptr;
+  allocate();
+  uint16_t k = free_slots.back();
+  free_slots.pop_back();
+  Entry& entry = slots[k];
+
+  // Next id of the slot k
+  uint32_t id = entry.previous ? entry.previous + window_ : k+1;
+  if (id > 0xFFFF) id = k+1;
+
+  entry.frame = frame;
+  entry.id = entry.previous = id;
+  entry.qos = qos;
+  entry.released = false;
+  entry.retries = 0;
+  entry.sequence = sequence;
+  used++;
+  return &entry;
+}
+
+MqttInflight::Entry* MqttInflight::restore(uint16_t id)
+{
+  if (id == 0 or full()) return nullptr;
+  allocate();
+  uint16_t k = (id-1) % window_;
+  auto it = std::find(free_slots.begin(), free_slots.end(), k);
+  if (it == free_slots.end()) return nullptr;
+  free_slots.erase(it);
+
+  Entry& entry = slots[k];
+  entry.frame = MqttFrame();
+  entry.id = entry.previous = id;
+  entry.qos = 2;
+  entry.released = true;
+  entry.retries = 0;
+  used++;
+  return &entry;
+}
+
+MqttInflight::Entry* MqttInflight::find(uint16_t id)
+{
+  if (id == 0 or used == 0) return nullptr;
+  Entry& entry = slots[(id-1) % window_];
+  return entry.id == id ? &entry : nullptr;
+}
+
+bool MqttInflight::ack(uint16_t id)
+{
+  Entry* entry = find(id);
+  if (entry == nullptr) return false;
+  entry->id = 0;
+  entry->released = false;
+  entry->frame = MqttFrame();
+  free_slots.push_back(entry - slots.data());
+  used--;
+  return true;
+}
+
+bool MqttInflight::wait(const MqttFrame& frame, uint8_t qos, uint32_t sequence)
+{
+  if (waiting_.size() >= max_waiting) return false;
+  waiting_.push_back(Waiting{frame, qos, sequence});
+  return true;
+}
+
+void MqttInflight::clear()
+{
+  slots.clear();
+  free_slots.clear();
+  waiting_.clear();
+  used = 0;
+}
+
+int MqttReceived::find(uint16_t id) const
+{
+  if (count == 0) return -1;
+  for(int i=0; i<TINY_MQTT_QOS2_PAGES; i++)
+    if (pages[i].used and pages[i].high == (id >> 8)) return i;
+  return -1;
+}
+
+MqttReceived::Result MqttReceived::mark(uint16_t id)
+{
+  int i = find(id);
+  if (i < 0)
+  {
+    for(i=0; i<TINY_MQTT_QOS2_PAGES and pages[i].used; i++);
+    if (i == TINY_MQTT_QOS2_PAGES) return Full;
+    memset(pages[i].bits, 0, sizeof(pages[i].bits));
+    pages[i].high = id >> 8;
+  }
+  Page& page = pages[i];
+  uint32_t& word = page.bits[(id & 0xFF) >> 5];
+  uint32_t bit = 1u << (id & 31);
+  if (word & bit) return Duplicate;
+  word |= bit;
+  page.used++;
+  count++;
+  return New;
+}
+
+bool MqttReceived::release(uint16_t id)
+{
+  int i = find(id);
+  if (i < 0) return false;
+  Page& page = pages[i];
+  uint32_t& word = page.bits[(id & 0xFF) >> 5];
+  uint32_t bit = 1u << (id & 31);
+  if (not (word & bit)) return false;
+  word &= ~bit;
+  page.used--;
+  count--;
+  return true;
+}
+
+bool MqttReceived::has(uint16_t id) const
+{
+  int i = find(id);
+  return i >= 0 and (pages[i].bits[(id & 0xFF) >> 5] & (1u << (id & 31)));
+}
+
+bool MqttReceived::canMark(uint16_t id) const
+{
+  if (find(id) >= 0) return true;
+  for(const Page& page: pages)
+    if (page.used == 0) return true;
+  return false;
+}
+
+void MqttReceived::clear()
+{
+  for(Page& page: pages) page.used = 0;
+  count = 0;
+}
+
+
+MqttError MqttClient::publishChunk(const MqttClient* source, const Topic& topic, const MqttMessage& msg)
+{
+  if (msg.chunkOffset()==0 and streaming_from!=source and isSubscribedTo(topic))
+  {
+    // Already streaming another publish or too slow, skip the whole publish
+    if (streaming_from or (outputPending() and outputPending()+msg.headerLength() > output_max))
     {
-      processMessage(&msg);
+      output_dropped++;
+      return MqttWouldBlock;
+    }
+    streaming_from = source;
+    if (tcp_client) sendStreamHeader(msg);
+  }
+  if (streaming_from != source) return MqttOk;
 
-      #if TINY_MQTT_DEBUG
-        Console << "Should call the callback ?\n";
-      #endif
-      // callback(this, topic, nullptr, 0);  // TODO Payload
+  if (tcp_client)
+  {
+    // A started publish cannot be dropped, a subscriber that does not take it is dropped
+    if (outputPending() > output_max and flush() != MqttOk and outputPending() > output_max)
+    {
+      abortStream();
+      return MqttOk;
     }
+    send(msg.chunk(), msg.chunkLength(), true);
   }
-  return retval;
+  else if (stream_callback)
+    stream_callback(this, topic, msg.chunk(), msg.chunkLength(), msg.chunkOffset(), msg.payloadLength());
+
+  if (msg.lastChunk()) endStream();
+  return MqttOk;
+}
+
+void MqttClient::sendStreamHeader(const MqttMessage& msg)
+{
+  // The payload is not kept, it could not be sent again: the subscriber receives
+  // the publish with QoS 0, no packet id and no retain flag whatever the publisher sent
+  const char* topic = msg.getVHeader();
+  size_t topic_size = 2 + MqttMessage::getSize(topic);
+  char header[5];
+  header[0] = MqttMessage::Publish;
+  uint8_t header_size = 1 + MqttMessage::encodeLength(topic_size + msg.payloadLength(), header+1);
+  send(header, header_size, true);
+  send(topic, topic_size, true);
+}
+
+bool MqttClient::streamPendingFull(size_t length)
+{
+  if (stream_pending.length()+length <= output_max) return false;
+  debug(red << "stream pending full, dropping " << length << " bytes for " << clientId.c_str());
+  output_dropped++;
+  return true;
+}
+
+void MqttClient::abortStream()
+{
+  // The tcp stream is out of sync
+  debug(red << "aborting the stream to " << clientId.c_str());
+  streaming_from = nullptr;
+  stream_pending.clear();
+  output_dropped++;
+  if (tcp_client) tcp_client->stop();
+}
+
+void MqttClient::endStream()
+{
+  streaming_from = nullptr;
+  if (stream_pending.length())
+  {
+    string pending;
+    pending.swap(stream_pending);
+    write(pending.data(), pending.length());
+  }
+}
+
+MqttError MqttClient::send(const char* buf, size_t length, bool force)
+{
+  if (tcp_client == nullptr) return MqttOk;
+
+  size_t pending = outputPending();
+  if (pending and not force and pending+length > output_max)
+  {
+    flush();    // Coalesced bytes may still be accepted
+    pending = outputPending();
+  }
+  if (pending and not force and pending+length > output_max)
+  {
+    debug(red << "output queue full, dropping " << length << " bytes for " << clientId.c_str());
+    output_dropped++;
+    return MqttWouldBlock;
+  }
+
+  size_t sent = 0;
+  if (pending == 0 and coalesce == 0)
+  {
+    sent = tcp_client->write(buf, length);
+    if (sent >= length) return MqttOk;
+    buf += sent;
+    length -= sent;
+  }
+
+  if (output_head and output_head >= output.size()/2)
+  {
+    output.replace(0, output_head, "", 0);
+    output_head = 0;
+  }
+  if (not output.append(buf, length))
+  {
+    debug(red << "out of memory, dropping " << length << " bytes for " << clientId.c_str());
+    output_dropped++;
+    if (sent) close(false);  // The rest of a started message is lost
+    return MqttWouldBlock;
+  }
+  if (coalesce == 0)
+    flush();
+  else if (local_broker and not flush_queued)
+  {
+    flush_queued = true;    // Flushed at the end of MqttBroker::loop
+    local_broker->flushing.push_back(this);
+  }
+  return MqttOk;
+}
+
+MqttError MqttClient::flush()
+{
+  size_t pending = outputPending();
+  if (pending == 0) return MqttOk;
+
+  if (tcp_client)
+    output_head += tcp_client->write(output.data()+output_head, pending);
+  if (tcp_client and output_head < output.size()) return MqttWouldBlock;
+
+  if (output.capacity() > output_max)
+    output.release();   // Was a big message
+  else
+    output.clear();
+  output_head = 0;
+  return MqttOk;
 }
 
 bool MqttClient::isSubscribedTo(const Topic& topic) const
 {
+  if (subscriptions.size() >= TINY_MQTT_FILTER_SET)
+  {
+    if (filters_dirty)
+    {
+      filters.clear();
+      for(const auto& subscription: subscriptions) filters.add(subscription);
+      filters_dirty = false;
+    }
+    return filters.any(topic);
+  }
+
   for(const auto& subscription: subscriptions)
     if (subscription.matches(topic))
       return true;
@@ -835,8 +1840,58 @@ bool MqttClient::isSubscribedTo(const Topic& topic) const
   return false;
 }
 
+MqttMessage::MqttMessage(const MqttFrame& frame)
+  : shared(frame), vheader(1), size(0), state(Complete)
+{
+  const char* bytes = frame.bytes();
+  while(bytes[vheader++] & 0x80);
+}
+
+MqttMessage::MqttMessage(const Topic& topic, const char* payload, size_t length, uint8_t flags, bool terminated)
+  : vheader(0), size(0), state(Complete), local_topic(&topic), local_payload(payload), local_length(length),
+    local_flags(flags & 0xF), local_terminated(terminated)
+{
+}
+
+const char* MqttMessage::terminatedPayload()
+{
+  if (local_topic == nullptr or local_payload == nullptr or local_terminated) return payload();
+  // Copied once for all the subscribers, like for the network ones
+  if (not frame()) return payload();   // Out of memory
+  return bytes().data()+payloadStart();
+}
+
+const MqttFrame& MqttMessage::frame()
+{
+  if (local_topic and not shared)
+  {
+    // Local subscribers keep the payload of the publisher (payload())
+    const Topic* topic = local_topic;
+    create(Publish);
+    if (state == Create) buffer[0] |= local_flags;
+    add(*topic);
+    if (local_flags & 6)
+    {
+      add(0);   // packet identifier, given when sent (see sendPublish)
+      add(0);
+    }
+    add(local_payload, local_length, false);
+    encodeLength();
+    local_topic = topic;
+  }
+  if (not shared and state != Error)
+  {
+    encodeLength();
+    if (state != Error) shared = MqttFrame(std::move(buffer));
+    if (shared) buffer.clear();   // else out of memory, the frame is empty
+  }
+  return shared;
+}
+
 void MqttMessage::reset()
 {
+  local_topic = nullptr;
+  shared = MqttFrame();
   buffer.clear();
   state=FixedHeader;
   size=0;
@@ -844,31 +1899,59 @@ void MqttMessage::reset()
 
 void MqttMessage::incoming(char in_byte)
 {
-  buffer += in_byte;
+  if (state != Error and not buffer.append(&in_byte, 1))
+  {
+    debug("Out of memory");
+    if (state == VariableHeader or state == PayLoad or state == StreamHeader or state == StreamPayLoad)
+    {
+      // The rest of the message is skipped
+      if (--size) state = Error; else reset();
+    }
+    else
+    {
+      size = 0;   // Length not known yet (or message being created)
+      state = Error;
+    }
+    return;
+  }
   switch(state)
   {
     case FixedHeader:
-      size=MaxBufferLength;
+      size=0;
       state = Length;
       break;
     case Length:
-
-      if (size==MaxBufferLength)
-        size = in_byte & 0x7F;
-      else
-        size += static_cast<uint16_t>(in_byte & 0x7F)<<7;
-
-      if (size > MaxBufferLength)
-        state = Error;
-      else if ((in_byte & 0x80) == 0)
       {
-        vheader = buffer.length();
-        if (size==0)
-          state = Complete;
+        const uint8_t rank = buffer.length()-2;  // rank of this length byte
+        size |= static_cast<uint32_t>(in_byte & 0x7F) << (7*rank);
+        if (in_byte & 0x80)
+        {
+          if (rank == 3)
+          {
+            debug("Malformed length");
+            size = 0;
+            state = Error;
+          }
+        }
         else
         {
-          buffer.reserve(size);
-          state = VariableHeader;
+          vheader = buffer.length();
+          if (size==0)
+            state = Complete;
+          else if (chunk_size and size > chunk_size and (buffer[0] & 0xF0) == Publish)
+            state = StreamHeader;
+          else if (size > MaxBufferLength)
+          {
+            debug("Too long " << size);
+            state = Error;  // The message is skipped
+          }
+          else if (not buffer.reserve(vheader+size))
+          {
+            debug("Out of memory " << size);
+            state = Error;  // The message is skipped
+          }
+          else
+            state = VariableHeader;
         }
       }
       break;
@@ -881,9 +1964,43 @@ void MqttMessage::incoming(char in_byte)
         // hexdump("rec");
       }
       break;
+    case StreamHeader:
+      --size;
+      if (buffer.length() >= vheader+2u)
+      {
+        size_t start = payloadStart();
+        if (start > buffer.length()+size)
+        {
+          debug("Malformed streamed publish");
+          state = Error;
+        }
+        else if (buffer.length() == start)
+        {
+          if (size == 0)
+            state = Chunk;
+          else if (buffer.reserve(start+chunk_size))  // chunks never grow the buffer
+            state = StreamPayLoad;
+          else
+          {
+            debug("Out of memory for the chunks");
+            state = Error;
+          }
+        }
+      }
+      break;
+    case StreamPayLoad:
+      --size;
+      if (size==0 or chunkLength()==chunk_size)
+        state = Chunk;
+      break;
     case Create:
       size++;
       break;
+    case Error:
+      buffer.clear();
+      if (size) --size;
+      if (size==0) reset();
+      break;
     case Complete:
     default:
       #if TINY_MQTT_DEBUG
@@ -893,97 +2010,332 @@ void MqttMessage::incoming(char in_byte)
       reset();
       break;
   }
-  if (buffer.length() > MaxBufferLength)
+}
+
+size_t MqttMessage::incoming(const char* data, size_t len)
+{
+  size_t used = 0;
+  while(used < len)
   {
-    debug("Too long " << state);
+    size_t chunk = len-used;
+    if (chunk > size) chunk = size;
+    if (state == VariableHeader or state == PayLoad)
+    {
+      buffer.append(data+used, chunk);
+      size -= chunk;
+      if (size==0) state = Complete;
+    }
+    else if (state == StreamPayLoad)
+    {
+      if (chunk > chunk_size-chunkLength()) chunk = chunk_size-chunkLength();
+      buffer.append(data+used, chunk);
+      size -= chunk;
+      if (size==0 or chunkLength()==chunk_size) state = Chunk;
+    }
+    else if (state == Error and size)
+    {
+      size -= chunk;  // skipping a message
+      if (size==0) reset();
+    }
+    else
+    {
+      chunk = 1;
+      incoming(data[used]);
+    }
+    used += chunk;
+
+    if (state == Complete or state == Chunk) break;
+  }
+  return used;
+}
+
+void MqttMessage::nextChunk()
+{
+  if (size==0)
     reset();
+  else
+  {
+    buffer.erase(payloadStart());
+    state = StreamPayLoad;
   }
 }
 
+size_t MqttMessage::payloadStart() const
+{
+  size_t start = vheader + 2 + getSize(&bytes()[vheader]);  // topic
+  if (flags() & 6) start += 2;  // packet identifier (qos>0)
+  return start;
+}
+
+uint32_t MqttMessage::remainingLength() const
+{
+  uint32_t length = 0;
+  for(uint8_t i=1; i<vheader; i++)
+    length |= static_cast<uint32_t>(bytes()[i] & 0x7F) << (7*(i-1));
+  return length;
+}
+
 void MqttMessage::add(const char* p, size_t len, bool addLength)
 {
+  if (state == Error) return;   // out of memory, see sendTo()
   if (addLength)
   {
-    buffer.reserve(buffer.length()+2);
+    if (not buffer.reserve(buffer.length()+2+len))
+    {
+      state = Error;
+      return;
+    }
     incoming(len>>8);
     incoming(len & 0xFF);
   }
-  while(len--) incoming(*p++);
+  if (state == Create)
+  {
+    if (not buffer.append(p, len))
+      state = Error;
+    else
+      size += len;
+  }
+  else
+    while(len--) incoming(*p++);
 }
 
-void MqttMessage::encodeLength()
+void MqttMessage::encodeLength(uint32_t pending)
 {
   debug("encodingLength");
-  if (state != Complete)
+  if (state != Complete and state != Error)
   {
-    int length = buffer.size()-3;  // 3 = 1 byte for header + 2 bytes for pre-reserved length field.
-    if (length <= 0x7F)
+    char length[4];
+    // 3 = 1 byte for header + 2 bytes for pre-reserved length field.
+    uint8_t count = encodeLength(buffer.size()-3+pending, length);
+    if (not buffer.replace(1, 2, length, count))
     {
-      buffer.erase(1,1);
-      buffer[1] = length;
-      vheader = 2;
-    }
-    else
-    {
-      buffer[1] = 0x80 | (length & 0x7F);
-      buffer[2] = (length >> 7);
-      vheader = 3;
+      state = Error;
+      return;
     }
-
-    // We could check that buffer[2] < 128 (end of length encoding)
+    vheader = 1+count;
     state = Complete;
   }
-};
+}
+
+uint8_t MqttMessage::encodeLength(uint32_t length, char* dest)
+{
+  uint8_t bytes = 0;
+  do
+  {
+    char byte = length & 0x7F;
+    length >>= 7;
+    if (length) byte |= 0x80;
+    dest[bytes++] = byte;
+  } while(length and bytes<4);
+  return bytes;
+}
 
 MqttError MqttMessage::sendTo(MqttClient* client)
 {
-  if (buffer.size())
+  if (local_topic) frame();
+  if (bytes().size())
   {
-    debug(cyan << "sending " << buffer.size() << " bytes to " << client->id());
+    debug(cyan << "sending " << bytes().size() << " bytes to " << client->id());
     encodeLength();
+    if (state == Error) return MqttInvalidMessage;  // Out of memory
     hexdump("Sending ");
-    client->write(&buffer[0], buffer.size());
+    return client->write(bytes().data(), bytes().size());
   }
   else
   {
     debug(red << "??? Invalid send");
     return MqttInvalidMessage;
   }
-  return MqttOk;
 }
 
-void MqttBroker::retainDrop()
+void MqttBroker::retain(const Topic& topic, MqttMessage& msg)
 {
-  if (retained.size() >= retain_size)
+  debug("MqttBroker::retain msg_type=" << _HEX(msg.type()) << ", retain_size=" << retained.maxCount());
+  if (retained.maxCount()==0 or msg.type() != MqttMessage::Publish) return;
+  if (msg.flags() & 1)  // flag RETAIN
   {
-    std::map<Topic, Retain>::iterator oldest = retained.begin();
-    auto it = oldest;
-    while(++it != retained.end())
+    if (not msg.frame()) return;  // Out of memory
+    debug("  retaining " << topic.str());
+    size_t length = msg.payloadLength();
+    retained.store(topic, msg.frame(), length);
+    if (persistence)
     {
-      if (oldest->second.timestamp > it->second.timestamp)
-        oldest = it;
+      const string& name = topic.str();
+      if (length)
+        persistence->append({MqttStore::Retain, name.c_str(), (uint16_t)name.length(), msg.frame().bytes(), (uint32_t)msg.frame().size()});
+      else
+        persistence->append({MqttStore::Remove, name.c_str(), (uint16_t)name.length(), nullptr, 0});
     }
-    retained.erase(oldest);
   }
 }
 
-void MqttBroker::retain(const Topic& topic, const MqttMessage& msg)
+// Session record data: qos, length (2 bytes), filter for each subscription
+static std::string encodeSubscriptions(const std::set<TopicFilter>& subscriptions)
 {
-  debug("MqttBroker::retain msg_type=" << _HEX(msg.type()) << ", retain_size=" << retain_size);
-  if (retain_size==0 or msg.type() != MqttMessage::Publish) return;
-  if (msg.flags() & 1)  // flag RETAIN
+  std::string data;
+  for(const auto& filter: subscriptions)
   {
-    debug("  retaining " << topic.str());
-    auto old = retained.find(topic);
-    if (old == retained.end())
-      retainDrop();
-    else
-      retained.erase(old);
-    // FIXME if payload size == 0 remove message from retained
-    Retain r(micros(), msg);
-    r.msg.retained();
-    retained.insert({ topic, std::move(r)});
+    const string& name = filter.str();
+    data += static_cast<char>(filter.qos());
+    data += static_cast<char>(name.length() & 0xFF);
+    data += static_cast<char>(name.length() >> 8);
+    data.append(name.c_str(), name.length());
   }
+  return data;
+}
+
+void MqttBroker::saveSession(const string& id, const std::set<TopicFilter>& subscriptions)
+{
+  if (persistence == nullptr or session_expiry == 0) return;
+  std::string data = encodeSubscriptions(subscriptions);
+  persistence->append({MqttStore::Session, id.c_str(), (uint16_t)id.length(), data.data(), (uint32_t)data.size()});
+}
+
+void MqttBroker::endSession(const string& id)
+{
+  if (persistence == nullptr) return;
+  persistence->append({MqttStore::SessionEnd, id.c_str(), (uint16_t)id.length(), nullptr, 0});
+}
+
+void MqttBroker::onRecord(void* context, const MqttStore::Record& record)
+{
+  MqttBroker* broker = static_cast<MqttBroker*>(context);
+  if (record.type == MqttStore::Session)
+  {
+    if (broker->session_expiry == 0) return;
+    MqttSession* session = new MqttSession(broker, string(record.key, record.key_len));
+    const char* data = record.data;
+    const char* end = data + record.data_len;
+    while(end-data >= 3)
+    {
+      uint8_t qos = data[0];
+      uint16_t len = static_cast<uint8_t>(data[1]) | static_cast<uint8_t>(data[2]) << 8;
+      data += 3;
+      if (len > end-data) break;
+      session->subscriptions.insert(TopicFilter(Topic(data, len), qos));
+      data += len;
+    }
+    broker->addSession(session);
+    return;
+  }
+  if (record.type == MqttStore::SessionEnd)
+  {
+    auto it = broker->offline_sessions.find(string(record.key, record.key_len));
+    if (it != broker->offline_sessions.end()) broker->eraseSession(it, false);
+    return;
+  }
+  Topic topic(record.key, record.key_len);
+  if (record.type == MqttStore::Remove)
+    broker->retained.remove(topic);
+  else if (record.type == MqttStore::Retain and record.data_len >= 2)
+  {
+    MqttBuffer bytes;
+    bytes.append(record.data, record.data_len);
+    MqttFrame frame(std::move(bytes));
+    MqttMessage msg(frame);
+    if (frame and msg.type() == MqttMessage::Publish)
+      broker->retained.store(topic, frame, msg.payloadLength());
+  }
+}
+
+bool MqttBroker::compact()
+{
+  if (persistence == nullptr or not persistence->beginSnapshot()) return false;
+  retained.each([this](const Topic& topic, const MqttFrame& frame)
+  {
+    const string& name = topic.str();
+    persistence->snapshot({MqttStore::Retain, name.c_str(), (uint16_t)name.length(), frame.bytes(), (uint32_t)frame.size()});
+  });
+  if (session_expiry)
+  {
+    // Sessions of the connected clients, then of the offline ones
+    for(auto client: clients)
+      if (client->tcp_client and client->mqtt_connected() and not (client->mqtt_flags & MqttClient::FlagCleanSession))
+      {
+        std::string data = encodeSubscriptions(client->subscriptions);
+        persistence->snapshot({MqttStore::Session, client->id().c_str(), (uint16_t)client->id().length(), data.data(), (uint32_t)data.size()});
+      }
+    for(const auto& it: offline_sessions)
+    {
+      std::string data = encodeSubscriptions(it.second->subscriptions);
+      persistence->snapshot({MqttStore::Session, it.first.c_str(), (uint16_t)it.first.length(), data.data(), (uint32_t)data.size()});
+    }
+  }
+  return persistence->endSnapshot();
+}
+
+void MqttRetained::store(const Topic& topic, const MqttFrame& frame, size_t payload_length)
+{
+  if (payload_length == 0 or max_count == 0 or (max_bytes and frame.size() > max_bytes))
+  {
+    remove(topic);
+    return;
+  }
+  auto old = by_topic.find(topic.getIndex());
+  if (old != by_topic.end())
+  {
+    Entries::iterator it = old->second;
+    total_bytes += frame.size() - it->frame.size();
+    it->frame = frame;
+    entries.splice(entries.end(), entries, it);   // now the most recent
+  }
+  else
+  {
+    const StringIndexer::Levels& levels = topic.levels();
+    if (levels.empty()) return;
+    for(auto level: levels)
+      if (TopicWildcards::isWildcard(level)) return;   // not a valid publish topic
+
+    entries.emplace_back(topic, frame);
+    Entries::iterator it = std::prev(entries.end());
+    by_topic[topic.getIndex()] = it;
+    tree.add(levels, &*it);
+    total_bytes += frame.size();
+  }
+  evict();
+}
+
+bool MqttRetained::remove(const Topic& topic)
+{
+  auto it = by_topic.find(topic.getIndex());
+  if (it == by_topic.end()) return false;
+  erase(it->second);
+  return true;
+}
+
+void MqttRetained::erase(Entries::iterator it)
+{
+  tree.remove(it->topic.levels(), &*it);
+  by_topic.erase(it->topic.getIndex());
+  total_bytes -= it->frame.size();
+  entries.erase(it);
+}
+
+void MqttRetained::evict()
+{
+  while(entries.size() > max_count or (max_bytes and total_bytes > max_bytes))
+  {
+    debug("  evicting retained " << entries.front().topic.str());
+    erase(entries.begin());
+    evicted++;
+  }
+}
+
+void MqttRetained::clear()
+{
+  while(entries.size()) erase(entries.begin());
+}
+
+void MqttRetained::maxCount(uint32_t count)
+{
+  max_count = count;
+  evict();
+}
+
+void MqttRetained::maxBytes(size_t bytes)
+{
+  max_bytes = bytes;
+  evict();
 }
 
 void MqttMessage::hexdump(const char* prefix) const
@@ -1005,7 +2357,7 @@ void MqttMessage::hexdump(const char* prefix) const
     { Disconnect, "Disconnect" }
   };
   string t("Unknown");
-  Type typ=static_cast<Type>(buffer[0] & 0xF0);
+  Type typ=static_cast<Type>(bytes()[0] & 0xF0);
   if (tts.find(typ) != tts.end())
     t=tts[typ];
   Console.fg(cyan);
@@ -1023,9 +2375,9 @@ void MqttMessage::hexdump(const char* prefix) const
   const char* half_sep = " - ";
   string ascii;
 
-  Console << prefix << " size(" << buffer.size() << "), state=" << state << endl;
+  Console << prefix << " size(" << bytes().size() << "), state=" << state << endl;
 
-  for(const char chr: buffer)
+  for(const char chr: bytes())
   {
     if ((addr % bytes_per_row) == 0)
     {
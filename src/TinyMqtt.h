@@ -9,9 +9,22 @@
 
 // TODO Should add a AUnit with both TINY_MQTT_ASYNC and not TINY_MQTT_ASYNC
 // #define TINY_MQTT_ASYNC  // Uncomment this to use ESPAsyncTCP instead of normal cnx
+// #define TINY_MQTT_EPOLL  // Linux only, uses epoll and POSIX sockets (see PosixTcp.h)
+// #define TINY_MQTT_SHARDS // With TINY_MQTT_EPOLL, allows MqttShardedBroker (see MqttShards.h)
 
+#if defined(TINY_MQTT_EPOLL) && !defined(__linux__)
+  #error "TINY_MQTT_EPOLL is Linux only"
+#endif
+
+#if defined(TINY_MQTT_SHARDS) && !defined(TINY_MQTT_EPOLL)
+  #error "TINY_MQTT_SHARDS needs TINY_MQTT_EPOLL"
+#endif
 
-#if defined(TINY_MQTT_ETHERNET)
+
+#if defined(TINY_MQTT_EPOLL)
+  #include <Arduino.h>
+  #include "PosixTcp.h"
+#elif defined(TINY_MQTT_ETHERNET)
   #include <Ethernet.h>
 #elif defined(ESP8266) || defined(EPOXY_DUINO)
   #ifdef TINY_MQTT_ASYNC
@@ -42,11 +55,62 @@
 
 #include <vector>
 #include <set>
+#include <list>
+#include <deque>
+#include <unordered_map>
 #include <string>
 #include "StringIndexer.h"
+#include "BufferPool.h"
+#include "TopicTree.h"
+#include "TopicFilterSet.h"
+#include "TimingWheel.h"
+#include "SlotMap.h"
+#include "MqttStore.h"
+#include <new>
+#ifdef TINY_MQTT_SHARDS
+#include <atomic>
+#endif
 
 #define TINY_MQTT_DEFAULT_CLIENT_ID "Tiny"
 
+// Size of the stack buffer used to read incoming bytes in bulk
+#ifndef TINY_MQTT_READ_BUFFER
+#define TINY_MQTT_READ_BUFFER 256
+#endif
+
+// Biggest message held in ram, bigger publishes are either
+// streamed by chunks (see MqttClient::setStreamCallback) or dropped.
+#ifndef TINY_MQTT_MAX_BUFFER
+#define TINY_MQTT_MAX_BUFFER 4096
+#endif
+
+// Clients with at least this number of subscriptions match them
+// all at once with a TopicFilterSet instead of one by one.
+#ifndef TINY_MQTT_FILTER_SET
+#define TINY_MQTT_FILTER_SET 8
+#endif
+
+// Max bytes queued for a client that cannot take more (slow link),
+// further messages are dropped with MqttWouldBlock.
+#ifndef TINY_MQTT_OUTPUT_QUEUE
+#define TINY_MQTT_OUTPUT_QUEUE 2048
+#endif
+
+// QoS>0 publishes sent to a client without waiting for their ack,
+// and delay before an unacknowledged one is sent again (DUP).
+#ifndef TINY_MQTT_INFLIGHT_WINDOW
+#define TINY_MQTT_INFLIGHT_WINDOW 16
+#endif
+#ifndef TINY_MQTT_RETRY_MS
+#define TINY_MQTT_RETRY_MS 10000
+#endif
+
+// Pages of 256 packet identifiers used to remember the QoS 2 publishes
+// received by a client and not released yet (see MqttReceived).
+#ifndef TINY_MQTT_QOS2_PAGES
+#define TINY_MQTT_QOS2_PAGES 2
+#endif
+
 #include <TinyStreaming.h>
 #if TINY_MQTT_DEBUG
   #include <TinyConsole.h>    // https://github.com/hsaturn/TinyConsole
@@ -60,7 +124,10 @@
   #define debug(what) {}
 #endif
 
-#if defined(TINY_MQTT_ETHERNET)
+#if defined(TINY_MQTT_EPOLL)
+  using TcpClient = PosixClient;
+  using TcpServer = PosixServer;
+#elif defined(TINY_MQTT_ETHERNET)
   using TcpClient = EthernetClient;
   using TcpServer = EthernetServer;
 #else
@@ -78,6 +145,7 @@ enum __attribute__((packed)) MqttError
   MqttOk = 0,
   MqttNowhereToSend=1,
   MqttInvalidMessage=2,
+  MqttWouldBlock=3,     // output queue of a client is full, message dropped
 };
 
 using string = TinyConsole::string;
@@ -86,20 +154,140 @@ class Topic : public IndexedString
 {
   public:
     Topic(const string& m) : IndexedString(m){}
-    Topic(const char* s, uint8_t len) : IndexedString(s,len){}
+    Topic(const char* s, uint16_t len) : IndexedString(s,len){}
     Topic(const char* s) : Topic(s, strlen(s)) {}
     // Topic(const string s) : Topic(s.c_str(), s.length()){};
 
     const char* c_str() const { return str().c_str(); }
 
+    // Indexes of the levels (split once, then cached by the StringIndexer)
+    const StringIndexer::Levels& levels() const { return StringIndexer::levels(getIndex()); }
+
     bool matches(const Topic&) const;
+
+  private:
+    template<size_t> friend class TopicDictionary;
+    explicit Topic(Indexed i) : IndexedString(i) {}
+};
+
+/***
+ * Subscription filter, compiled once into the cheapest way to match it:
+ *   Exact   no wildcard, same topic index
+ *   Prefix  literal levels then a trailing #, compares the first levels
+ *   Generic any other filter, level by level matcher
+ */
+class TopicFilter : public Topic
+{
+  public:
+    enum Kind : uint8_t { Exact, Prefix, Generic };
+
+    TopicFilter(const Topic& filter, uint8_t qos=0);
+    TopicFilter(const char* filter) : TopicFilter(Topic(filter)) {}
+
+    bool matches(const Topic& topic) const;
+    // true if every topic matched by other is matched by this filter
+    bool covers(const TopicFilter& other) const;
+    Kind kind() const { return kind_; }
+    uint8_t prefixLength() const { return prefix; }
+
+    // QoS granted when the filter is a subscription
+    uint8_t qos() const { return qos_; }
+
+  private:
+    Kind kind_ = Exact;
+    uint8_t qos_ = 0;
+    uint8_t prefix = 0;     // Prefix: number of literal levels before #
+    bool dollar = false;    // first level is a wildcard, do not match $ topics
+    const StringIndexer::Levels* filter = nullptr;  // owned by the StringIndexer
+};
+
+/***
+ * Immutable encoded message, built once and shared (reference counted)
+ * by all the subscribers it is sent to and by the retained messages.
+ */
+class MqttFrame
+{
+  public:
+    MqttFrame() {}
+    // Empty frame (bytes left in place) when the pool is out of memory
+    explicit MqttFrame(MqttBuffer&& bytes)
+    {
+      size_t capacity = sizeof(Data);
+      char* block = MqttBufferPool::get().allocate(capacity);
+      if (block) data = new (block) Data(std::move(bytes), capacity);
+    }
+    MqttFrame(const MqttFrame& f) : data(f.data) { if (data) data->refs++; }
+    MqttFrame(MqttFrame&& f) : data(f.data) { f.data = nullptr; }
+    ~MqttFrame() { release(); }
+
+    MqttFrame& operator=(const MqttFrame& f)
+    {
+      if (f.data) f.data->refs++;
+      release();
+      data = f.data;
+      return *this;
+    }
+
+    MqttFrame& operator=(MqttFrame&& f)
+    {
+      if (this != &f)
+      {
+        release();
+        data = f.data;
+        f.data = nullptr;
+      }
+      return *this;
+    }
+
+    explicit operator bool() const { return data != nullptr; }
+    const MqttBuffer& str() const { return data->bytes; }
+    const char* bytes() const { return data ? data->bytes.data() : ""; }
+    size_t size() const { return data ? data->bytes.size() : 0; }
+    uint32_t refs() const { return data ? uint32_t(data->refs) : 0; }
+
+  private:
+    void release()
+    {
+      if (data and --data->refs == 0)
+      {
+        size_t capacity = data->capacity;
+#ifdef TINY_MQTT_SHARDS
+        // The last reference may be dropped by another shard
+        MqttBufferPool& owner = *data->owner;
+        data->bytes.release(owner);
+        data->~Data();
+        owner.releaseShared(reinterpret_cast<char*>(data), capacity);
+#else
+        data->~Data();
+        MqttBufferPool::get().release(reinterpret_cast<char*>(data), capacity);
+#endif
+      }
+      data = nullptr;
+    }
+
+    struct Data
+    {
+      Data(MqttBuffer&& b, size_t c) : bytes(std::move(b)), capacity(c) {}
+#ifdef TINY_MQTT_SHARDS
+      MqttBuffer bytes;   // only modified by release()
+      MqttBufferPool* owner = &MqttBufferPool::get();
+      std::atomic<uint32_t> refs{1};    // frames are shared by the threads
+#else
+      const MqttBuffer bytes;
+      uint32_t refs = 1;
+#endif
+      uint16_t capacity;
+    };
+    Data* data = nullptr;
 };
 
 class MqttClient;
 class MqttMessage
 {
-  const uint16_t MaxBufferLength = 4096;  //hard limit: 16k due to size decoding
   public:
+    static const uint32_t MaxBufferLength = TINY_MQTT_MAX_BUFFER;
+    static const uint32_t MaxRemainingLength = 268435455;  // 256MB (4 bytes varint)
+
     enum __attribute__((packed)) Type
     {
       Unknown     =    0,
@@ -107,6 +295,9 @@ class MqttMessage
       ConnAck     = 0x20,
       Publish     = 0x30,
       PubAck      = 0x40,
+      PubRec      = 0x50,
+      PubRel      = 0x60,
+      PubComp     = 0x70,
       Subscribe   = 0x80,
       SubAck      = 0x90,
       UnSubscribe = 0xA0,
@@ -124,7 +315,10 @@ class MqttMessage
       PayLoad=3,
       Complete=4,
       Error=5,
-      Create=6
+      Create=6,
+      StreamHeader=7,     // topic / id of a streamed publish
+      StreamPayLoad=8,
+      Chunk=9             // a payload chunk of a streamed publish is available
     };
 
     static inline uint32_t getSize(const char* buffer)
@@ -133,41 +327,86 @@ class MqttMessage
       return (*bun << 8) | bun[1]; }
 
     MqttMessage() { reset(); }
-    MqttMessage(Type t, uint8_t bits_d3_d0=0) { create(t); buffer[0] |= (bits_d3_d0 & 0xF); }
+    MqttMessage(Type t, uint8_t bits_d3_d0=0) { create(t); if (state == Create) buffer[0] |= (bits_d3_d0 & 0xF); }
     MqttMessage(const MqttMessage& m)
-      : buffer(m.buffer), vheader(m.vheader), size(m.size), state(m.state) {}
+      : buffer(m.buffer), shared(m.shared), vheader(m.vheader), size(m.size), state(m.state), chunk_size(m.chunk_size),
+        local_topic(m.local_topic), local_payload(m.local_payload), local_length(m.local_length), local_flags(m.local_flags),
+        local_terminated(m.local_terminated) {}
+
+    // Publish of a local client: topic and payload are not copied (they must
+    // outlive the message) and it is encoded only if frame() is called.
+    // terminated: payload[length] is 0
+    MqttMessage(const Topic& topic, const char* payload, size_t length, uint8_t flags, bool terminated=false);
+
+    // A complete message that reads the frame (no copy)
+    MqttMessage(const MqttFrame& frame);
 
     void incoming(char byte);
-    void add(char byte) { incoming(byte); }
+    // Parses as many bytes as possible from data, stopping after
+    // a complete message. Returns the number of bytes consumed.
+    size_t incoming(const char* data, size_t len);
+    void add(char byte) { if (state != Error) incoming(byte); }
     void add(const char* p, size_t len, bool addLength=true );
     void add(const string& s) { add(s.c_str(), s.length()); }
     void add(const Topic& t) { add(t.str()); }
-    const char* end() const { return &buffer[0]+buffer.size(); }
-    const char* getVHeader() const { return &buffer[vheader]; }
-    void complete() { encodeLength(); }
+    const char* end() const { return bytes().data()+bytes().size(); }
+    const char* getVHeader() const { return &bytes()[vheader]; }
+    // pending: payload bytes that will be written after the message
+    void complete(uint32_t pending=0) { encodeLength(pending); }
     void retained() { if ((buffer[0] & 0xF)==Publish) buffer[0] |= 1; }
 
     void reset();
 
+    // Publishes bigger than chunk_size are received by chunks
+    // (0=disabled, then publishes bigger than MaxBufferLength are dropped)
+    void stream(uint16_t size) { chunk_size = size; }
+    uint16_t stream() const { return chunk_size; }
+
+    // Streamed publish only (state==Chunk)
+    bool isChunk() const { return state == Chunk; }
+    const char* chunk() const { return &buffer[0]+payloadStart(); }
+    size_t chunkLength() const { return buffer.size()-payloadStart(); }
+    uint32_t chunkOffset() const { return payloadLength()-size-chunkLength(); }
+    uint32_t payloadLength() const { return local_topic ? local_length : remainingLength()-(payloadStart()-vheader); }
+    // Payload of a complete publish (not copied)
+    const char* payload() const { return local_topic ? local_payload : bytes().data()+payloadStart(); }
+    // Same, followed by a 0 (encodes a local publish whose payload is not)
+    const char* terminatedPayload();
+    bool lastChunk() const { return size == 0; }
+    const char* header() const { return buffer.data(); }
+    size_t headerLength() const { return payloadStart(); }
+    void nextChunk();
+
+    uint32_t remainingLength() const;
+
+    // Encodes length into dest (4 bytes max), returns the number of bytes used
+    static uint8_t encodeLength(uint32_t length, char* dest);
+
     // buff is MSB/LSB/STRING
     // output buff+=2, len=length(str)
     static void getString(const char* &buff, uint16_t& len);
 
     Type type() const
     {
-      return state == Complete ? static_cast<Type>(buffer[0] & 0xF0) : Unknown;
+      if (local_topic) return Publish;
+      return state == Complete ? static_cast<Type>(bytes()[0] & 0xF0) : Unknown;
     }
 
-    uint8_t flags() const { return static_cast<uint8_t>(buffer[0] & 0x0F); }
+    uint8_t flags() const { return local_topic ? local_flags : static_cast<uint8_t>(bytes()[0] & 0x0F); }
+
+    // Encodes the message (once) and moves it to a shared frame
+    const MqttFrame& frame();
 
     void create(Type type)
     {
-      buffer=(decltype(buffer)::value_type)type;
-      buffer+='\0';    // reserved for msg length byte 1/2
-      buffer+='\0';    // reserved for msg length byte 2/2 (fixed)
+      local_topic = nullptr;
+      shared = MqttFrame();
+      buffer.clear();
+      // type, then 2 bytes reserved for msg length (fixed)
+      const char header[3] = { static_cast<char>(type), '\0', '\0' };
       vheader=3;      // Should never change
       size=0;
-      state=Create;
+      state = buffer.append(header, 3) ? Create : Error;   // Error: out of memory
     }
     MqttError sendTo(MqttClient*);
     void hexdump(const char* prefix=nullptr) const;
@@ -175,19 +414,249 @@ class MqttMessage
     MqttMessage& operator = (MqttMessage&& m)
     {
       buffer = std::move(m.buffer);
+      shared = std::move(m.shared);
       vheader = m.vheader;
       size = m.size;
       state = m.state;
+      chunk_size = m.chunk_size;
+      local_topic = m.local_topic;
+      local_payload = m.local_payload;
+      local_length = m.local_length;
+      local_flags = m.local_flags;
+      local_terminated = m.local_terminated;
       return *this;
     }
 
   private:
-    void encodeLength();
+    void encodeLength(uint32_t pending=0);
+    size_t payloadStart() const;   // streamed publish only
 
-    string buffer;
+    // buffer is moved to shared once frame() has been called
+    const MqttBuffer& bytes() const { return shared ? shared.str() : buffer; }
+
+    MqttBuffer buffer;   // allocated by MqttBufferPool
+    MqttFrame shared;
     uint8_t vheader;
-    uint16_t size;  // bytes left to receive
+    uint32_t size;  // bytes left to receive
     State state;
+    uint16_t chunk_size = 0;
+
+    // Local publish not encoded yet (nothing allocated)
+    const Topic* local_topic = nullptr;
+    const char* local_payload = nullptr;
+    size_t local_length = 0;
+    uint8_t local_flags = 0;
+    bool local_terminated = false;
+};
+
+/***
+ * Retained messages of a broker.
+ *
+ * Messages are kept in the order of their last update, so the oldest one
+ * is evicted in O(1) when the count or bytes limit is reached.
+ * A retained message is found by its topic index (exact subscriptions)
+ * or through a tree of topic levels, so that a wildcard subscription only
+ * visits the retained messages it matches.
+ */
+class MqttRetained
+{
+  public:
+    MqttRetained(uint32_t max_count=0) : max_count(max_count) {}
+    MqttRetained(const MqttRetained&) = delete;
+    MqttRetained& operator=(const MqttRetained&) = delete;
+
+    /** Stores frame as the retained message of topic (replaces the previous one).
+        An empty payload removes the retained message of topic. **/
+    void store(const Topic& topic, const MqttFrame& frame, size_t payload_length);
+    bool remove(const Topic& topic);
+    void clear();
+
+    // Calls visit(const Topic&, const MqttFrame&) for each retained message matching filter
+    template<class Visit>
+    void match(const TopicFilter& filter, Visit visit) const;
+
+    // Calls visit(const Topic&, const MqttFrame&) for each retained message, oldest first
+    template<class Visit>
+    void each(Visit visit) const
+    {
+      for(const Entry& entry: entries) visit(entry.topic, entry.frame);
+    }
+
+    // Max number of retained messages (0 = retain nothing)
+    void maxCount(uint32_t count);
+    uint32_t maxCount() const { return max_count; }
+
+    // Max bytes of the retained frames (0 = no limit)
+    void maxBytes(size_t bytes);
+    size_t maxBytes() const { return max_bytes; }
+
+    size_t size() const { return entries.size(); }
+    size_t bytes() const { return total_bytes; }
+    uint32_t evictions() const { return evicted; }
+
+  private:
+    struct Entry
+    {
+      Entry(const Topic& t, const MqttFrame& f) : topic(t), frame(f) {}
+      Topic topic;
+      MqttFrame frame;
+      mutable uint32_t mark = 0;   // already visited by the match() in progress
+    };
+    using Entries = std::list<Entry>;   // oldest first
+
+    void erase(Entries::iterator);
+    void evict();
+
+    Entries entries;
+    std::unordered_map<StringIndexer::index_t, Entries::iterator> by_topic;
+    TopicTree<Entry> tree;    // topic levels of the entries
+    mutable uint32_t match_mark = 0;
+    uint32_t max_count;
+    size_t max_bytes = 0;
+    size_t total_bytes = 0;
+    uint32_t evicted = 0;
+};
+
+template<class Visit>
+void MqttRetained::match(const TopicFilter& filter, Visit visit) const
+{
+  // Copies, visit may change the retained messages (local clients)
+  std::vector<Entry> found;
+  if (filter.kind() == TopicFilter::Exact)
+  {
+    auto it = by_topic.find(filter.getIndex());
+    if (it != by_topic.end()) found.push_back(*it->second);
+  }
+  else
+  {
+    std::vector<Entry*> entries;
+    tree.collect(filter.levels(), entries);
+    match_mark++;
+    for(Entry* entry: entries)
+    {
+      if (entry->mark == match_mark) continue;   // * may reach a topic more than once
+      entry->mark = match_mark;
+      found.push_back(*entry);
+    }
+  }
+  for(const Entry& entry: found)
+    visit(entry.topic, entry.frame);
+}
+
+/***
+ * QoS>0 publishes sent to a client and not acknowledged yet, at most window().
+ *
+ * The packet identifier of a publish tells its slot (slot k uses the ids
+ * k+1, k+1+window, k+1+2*window...) so that an ack is found in O(1).
+ * Publishes beyond the window wait (bounded, the next ones are refused),
+ * so that a client receives its messages in order.
+ */
+class MqttInflight
+{
+  public:
+    struct Entry
+    {
+      MqttFrame frame;
+      uint16_t id = 0;      // 0 = free slot
+      uint16_t previous = 0;  // last id given by the slot
+      uint8_t qos = 0;
+      bool released = false;  // QoS 2: PUBREC received, PUBREL sent (frame not needed anymore)
+      uint8_t retries = 0;
+      uint32_t sent = 0;    // millis() of the last send
+      uint32_t sequence = 0;  // MqttClient::publishSequence() of the publish
+    };
+
+    struct Waiting
+    {
+      MqttFrame frame;
+      uint8_t qos;
+      uint32_t sequence;
+    };
+
+    // Only changed while nothing is inflight
+    void window(uint16_t size) { if (used == 0) { window_ = size ? size : 1; slots.clear(); } }
+    uint16_t window() const { return window_; }
+    void maxWaiting(uint16_t max) { max_waiting = max; }
+
+    bool full() const { return used >= window_; }
+    size_t size() const { return used; }
+
+    // A new entry with a free packet identifier, nullptr if full()
+    Entry* add(const MqttFrame& frame, uint8_t qos, uint32_t sequence=0);
+    // A released QoS 2 entry with this id (resumed session), nullptr if its slot is used
+    Entry* restore(uint16_t id);
+    Entry* find(uint16_t id);
+    // false if id is not inflight
+    bool ack(uint16_t id);
+
+    // Returns false (not kept) if max_waiting publishes already wait
+    bool wait(const MqttFrame& frame, uint8_t qos, uint32_t sequence=0);
+    std::deque<Waiting>& waiting() { return waiting_; }
+
+    // Calls visit(Entry&) for each inflight publish
+    template<class Visit>
+    void each(Visit visit)
+    {
+      if (used == 0) return;
+      for(Entry& entry: slots)
+        if (entry.id) visit(entry);
+    }
+
+    void clear();
+
+  private:
+    void allocate();
+
+    std::vector<Entry> slots;       // allocated by the first add()
+    std::vector<uint16_t> free_slots;
+    std::deque<Waiting> waiting_;
+    uint16_t window_ = TINY_MQTT_INFLIGHT_WINDOW;
+    uint16_t used = 0;
+    uint16_t max_waiting = 64;
+};
+
+/***
+ * Packet identifiers of the QoS 2 publishes received and not released
+ * yet (PUBREL), so that a publish sent again (DUP) is delivered once.
+ *
+ * A bitmap of all the ids would take 8KB per client, so the bitmap is cut
+ * in pages of 256 ids, and only TINY_MQTT_QOS2_PAGES pages are kept, one
+ * for each high byte in use (senders give ids in sequence, the ids waiting
+ * for their PUBREL are close to each other).
+ */
+class MqttReceived
+{
+  public:
+    enum Result
+    {
+      New,
+      Duplicate,
+      Full      // no page for this id, the publish must not be acknowledged
+    };
+
+    Result mark(uint16_t id);
+    // false if id was not marked
+    bool release(uint16_t id);
+    bool has(uint16_t id) const;
+    // false if mark(id) would be Full
+    bool canMark(uint16_t id) const;
+
+    size_t size() const { return count; }
+    void clear();
+
+  private:
+    struct Page
+    {
+      uint32_t bits[8] = {};
+      uint16_t used = 0;    // bits set, the page is free when 0
+      uint8_t high = 0;     // id >> 8
+    };
+
+    // index of the page of id, -1 if none
+    int find(uint16_t id) const;
+
+    Page pages[TINY_MQTT_QOS2_PAGES];
+    uint16_t count = 0;
 };
 
 class MqttBroker;
@@ -200,7 +669,7 @@ class MqttClient
     FlagWillRetain = 32,   // unsupported
     FlagWillQos = 16 | 8,  // unsupported
     FlagWill = 4,          // unsupported
-    FlagCleanSession = 2,  // unsupported
+    FlagCleanSession = 2,
     FlagReserved = 1
   };
 
@@ -212,8 +681,20 @@ class MqttClient
   };
   public:
 
+    /** payload is followed by a 0 **/
     using CallBack = void (*)(const MqttClient* source, const Topic& topic, const char* payload, size_t payload_length);
 
+    /** Acknowledgements of the operations of this client (context is given back):
+        - ConnAck: code is the return code (0 = accepted)
+        - SubAck, UnSuback: id is the packet id, code the first granted qos
+        - Publish: a QoS>0 publish is done (PUBACK or PUBCOMP), id is its
+          publishSequence()
+        - Disconnect: close() was called, no more acks for the pending operations **/
+    using AckCallBack = void (*)(void* context, MqttClient* client, MqttMessage::Type type, uint32_t id, uint8_t code);
+
+    // Receives the payload of a streamed publish, chunk by chunk
+    using StreamCallBack = void (*)(const MqttClient* source, const Topic& topic, const char* chunk, size_t chunk_length, size_t offset, size_t payload_length);
+
     /** Constructor. Broker is the adress of a local broker if not null
         If you want to connect elsewhere, leave broker null and use connect() **/
     MqttClient(MqttBroker* broker = nullptr, const string& id = TINY_MQTT_DEFAULT_CLIENT_ID);
@@ -234,14 +715,52 @@ class MqttClient
            or (tcp_client and tcp_client->connected());
     }
 
-    void write(const char* buf, size_t length)
+    MqttError write(const char* buf, size_t length)
+    {
+      if (streaming_from)
+      {
+        if (streamPendingFull(length)) return MqttWouldBlock;
+        stream_pending.append(buf, length);   // Do not break the publish being streamed
+        return MqttOk;
+      }
+      return send(buf, length, false);
+    }
+
+    /** Sends the queued bytes, returns MqttWouldBlock if some remain **/
+    MqttError flush();
+
+    /** Bytes waiting for tcp_client to accept them **/
+    size_t outputPending() const { return output.size() - output_head; }
+
+    /** Max bytes queued when the link is slow, next messages are dropped **/
+    void outputQueue(uint16_t max) { output_max = max; }
+    uint32_t outputDropped() const { return output_dropped; }
+
+    /** QoS>0 publishes sent without waiting for their ack (window), publishes
+        waiting for a free place in the window (max_waiting, then publish()
+        returns MqttWouldBlock),
+        and delay before an unacknowledged publish is sent again. **/
+    void inflight(uint16_t window, uint16_t max_waiting=64, uint32_t retry_ms=TINY_MQTT_RETRY_MS)
     {
-      if (tcp_client) tcp_client->write(buf, length);
+      inflight_.window(window);
+      inflight_.maxWaiting(max_waiting);
+      retry_delay = retry_ms;
     }
+    size_t inflightCount() const { return inflight_.size(); }
+    /** QoS 2 publishes received and not released yet by the sender (PUBREL) **/
+    size_t receivedCount() const { return received.size(); }
+    uint32_t retransmissions() const { return retransmitted; }
 
     const string& id() const { return clientId; }
     void id(const string& new_id) { clientId = new_id; }
 
+    /** When false (default), asks the broker to keep the session (subscriptions,
+        missed QoS>0 publishes) while disconnected. Used by the next connect(). **/
+    void cleanSession(bool clean) { clean_session = clean; }
+
+    /** True if the broker had a session for this client at the last connection **/
+    bool sessionPresent() const { return session_present; }
+
     /** Should be called in main loop() */
     void loop();
     void close(bool bSendDisconnect=true);
@@ -254,11 +773,31 @@ class MqttClient
       #endif
     };
 
+    void setAckCallback(AckCallBack fun, void* context)
+    {
+      ack_callback = fun;
+      ack_context = context;
+    }
+
+    /** Packet id of the last SUBSCRIBE / UNSUBSCRIBE sent **/
+    uint16_t packetId() const { return packet_id; }
+    /** Incremented by each QoS>0 publish given to the inflight window **/
+    uint32_t publishSequence() const { return publish_sequence; }
+
+    /** Publishes whose length is greater than chunk_size are not held in ram
+        but received chunk by chunk by fun (CallBack is not called for them) **/
+    void setStreamCallback(StreamCallBack fun, uint16_t chunk_size = 256)
+    {
+      stream_callback = fun;
+      message.stream(fun ? chunk_size : 0);
+    }
+
     // Publish from client to the world
-    MqttError publish(const Topic&, const char* payload, size_t pay_length, bool retain=false);
-    MqttError publish(const Topic& t, const char* payload, bool retain=false) { return publish(t, payload, strlen(payload), retain); }
-    MqttError publish(const Topic& t, const String& s, bool retain=false) { return publish(t, s.c_str(), s.length(), retain); }
-    MqttError publish(const Topic& t, const string& s, bool retain=false) { return publish(t,s.c_str(),s.length(), retain);}
+    MqttError publish(const Topic& t, const char* payload, size_t pay_length, bool retain=false, uint8_t qos=0)
+    { return publish(t, payload, pay_length, retain, qos, false); }
+    MqttError publish(const Topic& t, const char* payload, bool retain=false) { return publish(t, payload, strlen(payload), retain, 0, true); }
+    MqttError publish(const Topic& t, const String& s, bool retain=false) { return publish(t, s.c_str(), s.length(), retain, 0, true); }
+    MqttError publish(const Topic& t, const string& s, bool retain=false) { return publish(t,s.c_str(),s.length(), retain, 0, true);}
     MqttError publish(const Topic& t, bool retain=false) { return publish(t, nullptr, 0, retain);};
 
     MqttError subscribe(Topic topic, uint8_t qos=0);
@@ -275,7 +814,7 @@ class MqttClient
       #if TINY_MQTT_DEBUG
         uint32_t ms=millis();
         Console << indent << "+-- " << '\'' << clientId.c_str() << "' " << (connected() ? " ON " : " OFF");
-        Console << ", alive=" << alive << '/' << ms << ", ka=" << keep_alive << ' ';
+        Console << ", timers=" << timers.size() << '/' << ms << ", ka=" << keep_alive << ' ';
         if (tcp_client)
         {
           if (tcp_client->connected())
@@ -301,8 +840,8 @@ class MqttClient
     }
 
 #ifdef EPOXY_DUINO
-    static std::map<MqttMessage::Type, int> counters;  // Number of processed messages
-    static int instances;
+    static TINY_MQTT_THREAD_LOCAL std::map<MqttMessage::Type, int> counters;  // Number of processed messages
+    static TINY_MQTT_THREAD_LOCAL int instances;
 #endif
     uint32_t keepAlive() const { return keep_alive; }
 
@@ -318,19 +857,65 @@ class MqttClient
 #endif
     MqttError sendTopic(const Topic& topic, MqttMessage::Type type, uint8_t qos);
     void resubscribe();
+    uint16_t nextPacketId();
+
+    // QoS>0: sends frame with a packet identifier of the inflight window, or waits
+    MqttError publishQos(const MqttFrame& frame, uint8_t qos);
+    // sends the publish of frame with this qos, id and dup flag (frame is not modified)
+    MqttError sendPublish(const MqttFrame& frame, uint8_t qos, uint16_t id, bool dup);
+    // PUBACK, PUBREC or PUBCOMP of an inflight publish
+    void acknowledged(uint16_t id, MqttMessage::Type type);
+    void retryLater() { if (not retry_timer.scheduled()) timers.schedule(retry_timer, retry_delay, millis()); }
+    // sends a PUBACK / PUBREC / PUBREL / PUBCOMP
+    MqttError sendAck(MqttMessage::Type type, uint16_t id);
+    // QoS 2 publish received: false if it was already delivered (or cannot be recorded)
+    bool receivedQos2(uint16_t id);
+    void retransmit();
+    void acked(MqttMessage::Type type, uint32_t id, uint8_t code)
+    { if (ack_callback) ack_callback(ack_context, this, type, id, code); }
+    // max QoS of the subscriptions matching topic
+    uint8_t subscribedQos(const Topic& topic) const;
 
     friend class MqttBroker;
+    friend class MqttUplink;
     MqttClient(MqttBroker* local_broker, TcpClient* client);
+    // terminated: payload[pay_length] is 0, so local subscribers get it as is
+    MqttError publish(const Topic&, const char* payload, size_t pay_length, bool retain, uint8_t qos, bool terminated);
     // republish a received publish if topic matches any in subscriptions
     MqttError publishIfSubscribed(const Topic& topic, MqttMessage& msg);
+    // send (or process if local) a publish known to match a subscription
+    MqttError deliver(const Topic& topic, MqttMessage& msg);
+    // forward a chunk of a streamed publish received by source, MqttWouldBlock when the publish is skipped
+    MqttError publishChunk(const MqttClient* source, const Topic& topic, const MqttMessage& msg);
+    void endStream();
 
+    // (re)starts the keep alive timer
     void clientAlive(uint32_t more_seconds);
+    static void onAlive(void* client);    // keep alive expired: ping or timeout
+    static void onRetry(void* client);
     void processMessage(MqttMessage* message);
+    void processChunk(MqttMessage* message);
+    // parse and process raw bytes received from tcp_client
+    void incoming(const char* data, size_t len);
+    // write to tcp_client or queue, force ignores output_max
+    MqttError send(const char* buf, size_t length, bool force);
 
     uint8_t cltFlags = CltFlagNone;
-    char mqtt_flags;
+    SlotHandle handle;            // in MqttBroker::clients
+    char mqtt_flags = FlagCleanSession;   // of the CONNECT received by the broker
+    bool clean_session = false;   // CONNECT sent by this client
+    bool session_present = false;
+    uint16_t packet_id = 0;       // last SUBSCRIBE / UNSUBSCRIBE identifier
+    uint32_t publish_sequence = 0;
+    MqttInflight inflight_;
+    MqttReceived received;        // inbound QoS 2 publishes not released yet
+    bool stream_skip = false;     // streamed publish already received (QoS 2 DUP)
+    bool stream_dropped = false;  // streamed publish skipped by some subscribers
+    uint32_t retry_delay = TINY_MQTT_RETRY_MS;
+    uint32_t retransmitted = 0;
     uint32_t keep_alive = 30;
-    uint32_t alive;
+    TimingWheel::Timer alive_timer{onAlive, this};
+    TimingWheel::Timer retry_timer{onRetry, this};
     MqttMessage message;
 
     // connection to local broker, or link to the parent
@@ -338,20 +923,130 @@ class MqttClient
     MqttBroker* local_broker=nullptr;
 
     TcpClient* tcp_client=nullptr;    // connection to remote broker
-    std::set<Topic>  subscriptions;
+    std::set<TopicFilter>  subscriptions;
+    // subscriptions matched at once, rebuilt when they change
+    mutable TopicFilterSet<TopicFilter> filters;
+    mutable bool filters_dirty = true;
     string clientId;
     CallBack callback = nullptr;
+    StreamCallBack stream_callback = nullptr;
+    AckCallBack ack_callback = nullptr;
+    void* ack_context = nullptr;
+
+    // source of the streamed publish being forwarded to this client
+    const MqttClient* streaming_from = nullptr;
+    string stream_pending;   // messages written during the stream (at most output_max bytes)
+    bool streamPendingFull(size_t length);
+    // Header of a streamed publish, always sent with qos 0
+    void sendStreamHeader(const MqttMessage&);
+    // Closes the connection, the publish being forwarded cannot be ended
+    void abortStream();
+
+    uint32_t publish_mark = 0;  // last MqttBroker::publish that delivered to this client
+
+    // Bytes not yet accepted by tcp_client, output[output_head..] remains to send
+    MqttBuffer output;
+    uint32_t output_head = 0;
+    uint16_t output_max = TINY_MQTT_OUTPUT_QUEUE;
+    uint32_t output_dropped = 0;
+    bool flush_queued = false;    // in MqttBroker::flushing
+
+    // While not zero, writes are queued then flushed at once (MqttBroker::loop)
+    static TINY_MQTT_THREAD_LOCAL uint8_t coalesce;
+
+    // Timers of all the clients, advanced by MqttBroker::loop (or loop() without broker)
+    static TINY_MQTT_THREAD_LOCAL TimingWheel timers;
+};
+
+/***
+ * State kept by a broker for a disconnected client that connected with
+ * CleanSession=0: its subscriptions, and a ring of the QoS>0 publishes
+ * it missed (shared frames, not copies).
+ * The session is resumed when a client connects again with the same id.
+ */
+class MqttSession
+{
+  public:
+    MqttSession(MqttBroker* broker, const string& id) : broker(broker), id(id) {}
+
+    // The oldest messages are dropped when max_messages or max_bytes is reached
+    void queue(const MqttFrame& frame, uint16_t max_messages, size_t max_bytes);
+
+    const std::set<TopicFilter>& getSubscriptions() const { return subscriptions; }
+    size_t queued() const { return count; }
+    size_t bytes() const { return queued_bytes; }
+    uint32_t dropped() const { return dropped_count; }
+
+  private:
+    friend class MqttBroker;
+    static void onExpired(void* session);
+
+    MqttBroker* broker;
+    string id;
+    std::set<TopicFilter> subscriptions;
+    std::vector<MqttFrame> ring;    // count frames from head
+    uint16_t head = 0;
+    uint16_t count = 0;
+    size_t queued_bytes = 0;
+    uint32_t dropped_count = 0;
+    uint32_t expires = 0;           // millis()
+    TimingWheel::Timer expiry{onExpired, this};
+    uint32_t publish_mark = 0;      // last MqttBroker::publish queued
+
+    // QoS 2 handshakes in progress
+    std::vector<uint16_t> released; // publishes received by the client, PUBREL sent again on resume
+    MqttReceived received;          // publishes received from the client, waiting for PUBREL
+};
+
+/***
+ * Subscriptions of a broker mirrored to its parent broker (bridge, see
+ * MqttBroker::connect).
+ *
+ * Counts the local subscribers (clients and offline sessions) of each
+ * filter, and subscribes the parent to the minimal set of filters covering
+ * them: a filter covered by another one (a/b or a/+/c by a/#) is not sent.
+ * Changes are only noted, then update() sends the difference at the end of
+ * MqttBroker::loop(): a client whose session is kept, or a filter removed
+ * and added back during a loop, sends nothing to the parent.
+ */
+class MqttUplink
+{
+  public:
+    // subscriber: a new subscriber of filter, else its qos may have changed
+    void add(const Topic& filter, uint8_t qos, bool subscriber=true);
+    void remove(const Topic& filter);
+
+    bool changed() const { return changed_; }
+    size_t size() const { return filters.size(); }
+
+    // Sets the subscriptions of parent (link to the parent broker) to the
+    // covering set, and sends the (UN)SUBSCRIBE of the difference
+    void update(MqttClient& parent);
+
+  private:
+    struct Interest
+    {
+      uint16_t subscribers;
+      uint8_t qos;
+    };
+    std::map<Topic, Interest> filters;
+    bool changed_ = false;
 };
 
+class MqttShardedBroker;
+
 class MqttBroker
 {
   public:
     // TODO limit max number of clients
-    MqttBroker(uint16_t port, uint8_t retain_size=0);
+    MqttBroker(uint16_t port, uint32_t retain_size=0);
     ~MqttBroker();
 
-    void begin() { server->begin(); }
-    void loop();
+    /** Restores the persisted state (see persist()) then starts the server **/
+    void begin();
+    /** With TINY_MQTT_EPOLL, waits at most wait_ms for network events or
+        timers (the other backends do not wait) **/
+    void loop(uint32_t wait_ms=0);
 
     /** Connect the broker to a parent broker */
     void connect(const string& host, uint16_t port=1883);
@@ -359,9 +1054,44 @@ class MqttBroker
     bool connected() const { return remote_broker ? remote_broker->connected() : false; }
 
     size_t clientsCount() const { return clients.size(); }
-    uint8_t retain() { return retain_size; }
-    void retain(uint8_t size) { retain_size = size; if (size==0) retained.clear(); }
-    uint8_t retainCount() const { return retained.size(); }
+
+    /** Client connected from the network with this id, nullptr if none **/
+    const MqttClient* client(const string& id) const;
+
+    /** Publishes bigger than chunk_size are forwarded chunk by chunk
+        to subscribers as they arrive (0 = disabled). Streamed publishes
+        are never retained. Applies to the parent broker (see connect())
+        and to the clients connecting after. A subscriber too slow to take
+        the chunks (outputQueue()) is disconnected. **/
+    void streaming(uint16_t chunk_size);
+
+    /** Max number of retained messages (0 = disabled), and max bytes
+        they can use (0 = no limit). The oldest messages are dropped first. **/
+    uint32_t retain() const { return retained.maxCount(); }
+    void retain(uint32_t size) { retained.maxCount(size); }
+    size_t retainBytes() const { return retained.maxBytes(); }
+    void retainBytes(size_t bytes) { retained.maxBytes(bytes); }
+    uint32_t retainCount() const { return retained.size(); }
+    const MqttRetained& getRetained() const { return retained; }
+
+    /** Clients connecting with CleanSession=0 keep their session for expiry
+        seconds after a disconnection (0 = no sessions, the default, and at
+        most about 24 days, see TimingWheel::MaxDelay).
+        While offline, a session queues up to max_messages QoS>0 publishes
+        (max_bytes), and at most max_sessions sessions are kept. **/
+    void sessions(uint32_t expiry, uint16_t max_messages=32, size_t max_bytes=4096, uint16_t max_sessions=64);
+    size_t sessionsCount() const { return offline_sessions.size(); }
+    const MqttSession* session(const string& id) const;
+
+    /** Retained messages and the subscriptions of the sessions are saved into
+        store (not owned) and restored by begin(), which must be called after
+        retain(), retainBytes() and sessions(). A restored session expires after
+        the session expiry, its queued publishes and QoS 2 states are not saved. **/
+    void persist(MqttStore* store) { persistence = store; }
+
+    /** Writes the snapshot of the persisted state now
+        (also done by loop() when the store needs it) **/
+    bool compact();
 
     void dump(string indent="")
     {
@@ -369,13 +1099,15 @@ class MqttBroker
         client->dump(indent);
     }
 
-    const std::vector<MqttClient*>  getClients() const { return clients; }
+    const std::vector<MqttClient*>  getClients() const { return clients.dense(); }
 #ifdef EPOXY_DUINO
-    static int instances;
+    static TINY_MQTT_THREAD_LOCAL int instances;
 #endif
 
   private:
     friend class MqttClient;
+    friend class MqttSession;
+    friend class MqttShardedBroker;
 
     static void onClient(void*, TcpClient*);
     bool checkUser(const char* user, uint8_t len) const
@@ -385,15 +1117,41 @@ class MqttBroker
     { return compareString(auth_password, password, len); }
 
     MqttError publish(const MqttClient* source, const Topic& topic, MqttMessage& msg);
+    MqttError publishChunk(const MqttClient* source, const Topic& topic, const MqttMessage& msg);
+    void abortStreams(const MqttClient* source);
 
     MqttError subscribe(MqttClient*, const Topic& topic, uint8_t qos);
+    void unsubscribe(MqttClient*, const Topic& topic);
 
     // For clients that are added not by the broker itself (local clients)
     void addClient(MqttClient* client);
+    // Clients added by the broker are deleted by the next loop()
     void removeClient(MqttClient* client);
+    // Indexes a client connected from the network by its id, a previous
+    // connection with the same id is closed (except the default id).
+    void takeOver(MqttClient* client);
 
     bool compareString(const char* good, const char* str, uint8_t str_len) const;
-    std::vector<MqttClient*>  clients;
+    SlotMap<MqttClient*> clients;
+    std::unordered_map<string, SlotHandle> by_id;   // clients connected from the network
+    std::vector<MqttClient*> reaped;    // removed, deleted at the end of loop()
+    std::vector<MqttClient*> flushing;  // output coalesced during loop()
+
+    // Sessions of disconnected clients (CleanSession=0)
+    MqttSession* takeSession(MqttClient*);
+    void resumeSession(MqttClient*, MqttSession*);
+    void keepSession(MqttClient*);
+    void addSession(MqttSession*);
+    // ended: the session is also removed from the store
+    void eraseSession(std::map<string, MqttSession*>::iterator, bool ended=true);
+    // Subscriptions of a session (CleanSession=0) saved into the store
+    void saveSession(const string& id, const std::set<TopicFilter>& subscriptions);
+    void endSession(const string& id);
+
+    // Subscriptions of all clients
+    TopicTree<MqttClient> subscriptions;
+    std::vector<MqttClient*> matching;  // clients matching the publish(es) in progress
+    uint32_t publish_mark = 0;
 
   private:
     TcpServer* server = nullptr;
@@ -401,28 +1159,28 @@ class MqttBroker
     const char* auth_user = "guest";
     const char* auth_password = "guest";
     MqttClient* remote_broker = nullptr;
+    MqttUplink uplink;    // subscriptions mirrored to remote_broker
 
     void closeRemoteBroker();
 
-    void retain(const Topic& topic, const MqttMessage& msg);
-    void retainDrop();
-
-    struct Retain
-    {
-      Retain(unsigned long ts, const MqttMessage& m) : timestamp(ts), msg(m) {}
-      Retain(Retain&& r) : timestamp(r.timestamp), msg(std::move(r.msg)) {}
-
-      Retain& operator=(Retain&& r)
-      {
-        timestamp = r.timestamp;
-        msg = std::move(r.msg);
-        return *this;
-      }
-
-      unsigned long timestamp;
-      MqttMessage msg;
-    };
-
-    std::map<Topic, Retain> retained;
-    uint8_t retain_size;
+    void retain(const Topic& topic, MqttMessage& msg);
+    static void onRecord(void* broker, const MqttStore::Record&);
+
+    MqttRetained retained;
+    MqttStore* persistence = nullptr;
+
+    std::map<string, MqttSession*> offline_sessions;
+    TopicTree<MqttSession> offline;   // subscriptions of offline_sessions
+    std::vector<MqttSession*> offline_matching;
+    uint32_t session_expiry = 0;      // seconds
+    uint16_t session_messages = 32;
+    size_t session_bytes = 4096;
+    uint16_t max_sessions = 64;
+    uint16_t stream_chunk = 0;
+
+#ifdef TINY_MQTT_SHARDS
+    MqttShardedBroker* shards = nullptr;  // this broker is one of its shards
+    uint8_t shard = 0;
+    bool from_shard = false;    // publishing what another shard received
+#endif
 };
@@ -0,0 +1,68 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include "TinyMqtt.h"
+
+// Position of topic in names, known at compile time (N if not found):
+//   constexpr const char* names[] = { "sensor/temp", "light/state" };
+//   constexpr size_t Temp = topicId(names, "sensor/temp");
+//   static_assert(Temp < 2, "unknown topic");
+constexpr bool topicEqual(const char* a, const char* b)
+{
+  return *a == *b and (*a == 0 or topicEqual(a+1, b+1));
+}
+
+template<size_t N>
+constexpr size_t topicId(const char* const (&names)[N], const char* topic, size_t i=0)
+{
+  return i == N or topicEqual(names[i], topic) ? i : topicId(names, topic, i+1);
+}
+
+/***
+ * Fixed set of topics known at compile time.
+ *
+ * The names (constexpr array) are indexed once by the constructor, the
+ * StringIndexer keeps a copy of each of them as for any topic, and they stay
+ * indexed as long as the dictionary. Then topic(id) gives a Topic without
+ * hashing nor allocation, and the same Topic as the one built from the
+ * string, so dynamic topics still use the StringIndexer:
+ *
+ *   TopicDictionary<2> topics(names);
+ *   client.publish(topics[Temp], "21.5");
+ *
+ * With TINY_MQTT_SHARDS, the indexes belong to the thread that built the
+ * dictionary.
+ */
+template<size_t N>
+class TopicDictionary
+{
+  public:
+    explicit TopicDictionary(const char* const (&names)[N]) : names(names)
+    {
+      for(size_t id=0; id<N; id++)
+      {
+        IndexedString name(names[id], strlen(names[id]));
+        StringIndexer::use(name.getIndex());
+        indexes[id] = name.getIndex();
+      }
+    }
+
+    ~TopicDictionary()
+    {
+      for(auto index: indexes) StringIndexer::release(index);
+    }
+
+    TopicDictionary(const TopicDictionary&) = delete;
+    TopicDictionary& operator=(const TopicDictionary&) = delete;
+
+    static constexpr size_t size() { return N; }
+
+    // invalid Topic if id >= N or if the indexer was full
+    Topic topic(size_t id) const { return Topic(Topic::Indexed{id < N ? indexes[id] : StringIndexer::index_t(0)}); }
+    Topic operator[](size_t id) const { return topic(id); }
+
+    const char* name(size_t id) const { return id < N ? names[id] : ""; }
+
+  private:
+    const char* const (&names)[N];
+    StringIndexer::index_t indexes[N];
+};
@@ -0,0 +1,194 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include <vector>
+#include <stdint.h>
+#include "StringIndexer.h"
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+/***
+ * Matches one topic against many filters at once.
+ *
+ * Filters are stored by columns of StringIndexer indexes:
+ * - Exact filters: one column of topic indexes, compared to the topic index
+ * - Prefix filters (a/b/#): grouped by prefix length, one column per level
+ * - Other filters are matched one by one.
+ * Columns are compared 32 filters at a time (SSE2 / AVX2 when available,
+ * the portable loop is written to be vectorized by the compiler, NEON...).
+ *
+ * Filter must be a TopicFilter (kind(), prefixLength(), levels(), matches()).
+ */
+template<class Filter>
+class TopicFilterSet
+{
+  public:
+    using index_t = StringIndexer::index_t;
+    using Levels = StringIndexer::Levels;
+    using Id = uint16_t;
+
+    // returns the id of the filter (ids are given in order, from 0)
+    Id add(const Filter& filter)
+    {
+      Id id = count++;
+      switch(filter.kind())
+      {
+        case Filter::Exact:
+          exact.add(id, &filter.levels(), filter.getIndex(), 0);
+          break;
+        case Filter::Prefix:
+        {
+          uint8_t len = filter.prefixLength();
+          if (prefixes.size() <= len) prefixes.resize(len+1);
+          prefixes[len].add(id, &filter.levels(), 0, len);
+          break;
+        }
+        default:
+          generic.push_back(Generic{id, filter});
+      }
+      return id;
+    }
+
+    void clear()
+    {
+      count = 0;
+      exact = Columns();
+      prefixes.clear();
+      generic.clear();
+    }
+
+    size_t size() const { return count; }
+
+    // appends the ids of the filters matching topic (not sorted)
+    template<class Topic>
+    void match(const Topic& topic, std::vector<Id>& ids) const
+    {
+      run(topic, [&ids](Id id) { ids.push_back(id); return true; });
+    }
+
+    // true if at least one filter matches topic
+    template<class Topic>
+    bool any(const Topic& topic) const
+    {
+      return not run(topic, [](Id) { return false; });
+    }
+
+    // bit i of the result is set if column[i]==value, for 32 rows
+    static uint32_t equal32(const index_t* column, index_t value);
+
+  private:
+    struct Columns
+    {
+      std::vector<Id> ids;
+      std::vector<std::vector<index_t>> levels;   // levels[level][row], rows padded with 0
+
+      void add(Id id, const Levels* filter, index_t topic, uint8_t len)
+      {
+        size_t row = ids.size();
+        ids.push_back(id);
+        size_t cols = topic ? 1 : len;
+        if (levels.size() < cols) levels.resize(cols);
+        for(size_t c=0; c<cols; c++)
+        {
+          auto& column = levels[c];
+          if (column.size() <= row) column.resize(row+32, 0);   // 0 is never a level
+          column[row] = topic ? topic : (*filter)[c];
+        }
+      }
+    };
+
+    struct Generic
+    {
+      Id id;
+      Filter filter;
+    };
+
+    // calls found(id) for each match, stops and returns false when found returns false
+    template<class Topic, class Found>
+    bool run(const Topic& topic, Found found) const
+    {
+      if (not topic.valid()) return true;
+      const Levels& levels = topic.levels();
+      if (levels.empty()) return true;
+
+      if (not exact.ids.empty() and not scan(exact, &topic.getIndex(), 1, found)) return false;
+
+      bool dollar = StringIndexer::str(levels[0]).c_str()[0] == '$';
+      for(size_t len=0; len<prefixes.size() and len<=levels.size(); len++)
+      {
+        const Columns& bucket = prefixes[len];
+        if (bucket.ids.empty()) continue;
+        if (len == 0)
+        {
+          if (dollar) continue;   // # does not match $ topics
+          for(Id id: bucket.ids) if (not found(id)) return false;
+        }
+        else if (not scan(bucket, levels.data(), len, found)) return false;
+      }
+
+      for(const auto& g: generic)
+        if (g.filter.matches(topic) and not found(g.id)) return false;
+      return true;
+    }
+
+    template<class Found>
+    static bool scan(const Columns& columns, const index_t* values, size_t cols, Found found)
+    {
+      size_t rows = columns.ids.size();
+      for(size_t row=0; row<rows; row+=32)
+      {
+        uint32_t mask = ~uint32_t(0);
+        for(size_t c=0; c<cols and mask; c++)
+          mask &= equal32(columns.levels[c].data()+row, values[c]);
+        while(mask)
+        {
+          int bit = __builtin_ctz(mask);
+          mask &= mask-1;
+          if (not found(columns.ids[row+bit])) return false;
+        }
+      }
+      return true;
+    }
+
+    Id count = 0;
+    Columns exact;
+    std::vector<Columns> prefixes;   // by prefix length
+    std::vector<Generic> generic;
+};
+
+template<class Filter>
+inline uint32_t TopicFilterSet<Filter>::equal32(const index_t* column, index_t value)
+{
+#if defined(__AVX2__) && TINY_MQTT_INDEX_BITS == 8
+  __m256i v = _mm256_set1_epi8(static_cast<char>(value));
+  __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(column));
+  return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, v)));
+#elif defined(__SSE2__)
+  auto load = [column](int i) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(column)+i); };
+  uint32_t mask = 0;
+  for(int half=0; half<2; half++)
+  {
+  #if TINY_MQTT_INDEX_BITS == 32
+    __m128i v = _mm_set1_epi32(static_cast<int>(value));
+    __m128i a = _mm_packs_epi32(_mm_cmpeq_epi32(load(4*half), v), _mm_cmpeq_epi32(load(4*half+1), v));
+    __m128i b = _mm_packs_epi32(_mm_cmpeq_epi32(load(4*half+2), v), _mm_cmpeq_epi32(load(4*half+3), v));
+    __m128i bytes = _mm_packs_epi16(a, b);
+  #elif TINY_MQTT_INDEX_BITS == 16
+    __m128i v = _mm_set1_epi16(static_cast<short>(value));
+    __m128i bytes = _mm_packs_epi16(_mm_cmpeq_epi16(load(2*half), v), _mm_cmpeq_epi16(load(2*half+1), v));
+  #else
+    __m128i bytes = _mm_cmpeq_epi8(load(half), _mm_set1_epi8(static_cast<char>(value)));
+  #endif
+    mask |= static_cast<uint32_t>(_mm_movemask_epi8(bytes)) << (16*half);
+  }
+  return mask;
+#else
+  uint32_t mask = 0;
+  for(int i=0; i<32; i++)
+    mask |= static_cast<uint32_t>(column[i] == value) << i;
+  return mask;
+#endif
+}
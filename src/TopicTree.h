@@ -0,0 +1,301 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include <vector>
+#include <algorithm>
+#include "StringIndexer.h"
+
+/***
+ * Special levels of topic filters, as StringIndexer indexes.
+ *   +  matches exactly one level
+ *   #  matches the parent level and all the levels below (must be last)
+ *   *  matches zero or more levels (TinyMqtt extension)
+ * Wildcards at the first level do not match topics starting with '$'.
+ */
+struct TopicWildcards
+{
+  using index_t = StringIndexer::index_t;
+  using Levels = StringIndexer::Levels;
+
+  static index_t plus() { static TINY_MQTT_THREAD_LOCAL const IndexedString s("+", 1); return s.getIndex(); }
+  static index_t hash() { static TINY_MQTT_THREAD_LOCAL const IndexedString s("#", 1); return s.getIndex(); }
+  static index_t star() { static TINY_MQTT_THREAD_LOCAL const IndexedString s("*", 1); return s.getIndex(); }
+
+  static bool isWildcard(index_t level)
+  { return level == plus() or level == hash() or level == star(); }
+
+  static bool isDollar(index_t level) { return StringIndexer::str(level).c_str()[0] == '$'; }
+
+  // filter[i..] matches topic[j..]
+  static bool matches(const Levels& filter, size_t i, const Levels& topic, size_t j)
+  {
+    while(i < filter.size())
+    {
+      index_t level = filter[i];
+      if (level == hash()) return i+1 == filter.size();
+      if (level == star())
+      {
+        for(size_t k=j; k<=topic.size(); k++)
+          if (matches(filter, i+1, topic, k)) return true;
+        return false;
+      }
+      if (j == topic.size()) return false;
+      if (level != plus() and level != topic[j]) return false;
+      i++;
+      j++;
+    }
+    return j == topic.size();
+  }
+
+  // Every topic matched by other[j..] is matched by filter[i..] (false when unsure)
+  static bool covers(const Levels& filter, size_t i, const Levels& other, size_t j)
+  {
+    while(i < filter.size())
+    {
+      index_t level = filter[i];
+      if (level == hash()) return i+1 == filter.size();
+      if (level == star())
+      {
+        for(size_t k=j; k<=other.size(); k++)
+          if (covers(filter, i+1, other, k)) return true;
+        return false;
+      }
+      if (j == other.size()) return false;
+      if (other[j] == hash() or other[j] == star()) return false;
+      if (level != plus() and level != other[j]) return false;
+      i++;
+      j++;
+    }
+    return j == other.size();
+  }
+};
+
+/***
+ * Subscriptions of a broker, stored as a tree of topic levels.
+ *
+ * Each node is one level of a topic filter, known by its StringIndexer
+ * index so that a level name is stored once and compared as an integer.
+ * Wildcards are special children of a node, so a topic is matched by
+ * walking its levels once.
+ *
+ * A subscriber may be returned more than once by match() if several
+ * of its filters match the topic.
+ */
+template<class Subscriber>
+class TopicTree
+{
+  public:
+    using index_t = StringIndexer::index_t;
+    using Levels = StringIndexer::Levels;
+
+    TopicTree() {}
+    TopicTree(const TopicTree&) = delete;
+    TopicTree& operator=(const TopicTree&) = delete;
+
+    // returns false if the subscriber was already subscribed to filter
+    bool add(const Levels& filter, Subscriber* subscriber)
+    {
+      if (filter.empty()) return false;
+      Node* node = &root;
+      for(index_t level: filter)
+        node = node->child(level, true);
+      auto& subs = node->subscribers;
+      if (std::find(subs.begin(), subs.end(), subscriber) != subs.end()) return false;
+      subs.push_back(subscriber);
+      count++;
+      return true;
+    }
+
+    // returns false if the subscriber was not subscribed to filter
+    bool remove(const Levels& filter, Subscriber* subscriber)
+    {
+      if (filter.empty()) return false;
+      return remove(&root, filter, 0, subscriber);
+    }
+
+    // appends to out all subscribers of filters matching topic
+    void match(const Levels& topic, std::vector<Subscriber*>& out) const
+    {
+      if (topic.empty()) return;
+      match(&root, topic, 0, out);
+    }
+
+    /** Reverse lookup, when the tree holds topics (without wildcards):
+        appends to out the subscribers of the topics matching filter.
+        Only the branches matching the filter are visited. **/
+    void collect(const Levels& filter, std::vector<Subscriber*>& out) const
+    {
+      if (filter.empty()) return;
+      collect(&root, filter, 0, out);
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+  private:
+    struct Node
+    {
+      Node() {}
+      Node(const Node&) = delete;
+      ~Node()
+      {
+        for(auto& c: children)
+        {
+          StringIndexer::release(c.level);
+          delete c.node;
+        }
+        delete plus;
+        delete hash;
+        delete star;
+      }
+
+      struct Child
+      {
+        index_t level;
+        Node* node;
+      };
+
+      static bool less(const Child& c, index_t level) { return c.level < level; }
+
+      Node* find(index_t level) const
+      {
+        auto it = std::lower_bound(children.begin(), children.end(), level, less);
+        if (it != children.end() and it->level == level) return it->node;
+        return nullptr;
+      }
+
+      Node* child(index_t level, bool create)
+      {
+        if (TopicWildcards::isWildcard(level))
+        {
+          Node*& special = level==TopicWildcards::plus() ? plus :
+            (level==TopicWildcards::hash() ? hash : star);
+          if (special == nullptr and create) special = new Node;
+          return special;
+        }
+        auto it = std::lower_bound(children.begin(), children.end(), level, less);
+        if (it != children.end() and it->level == level) return it->node;
+        if (not create) return nullptr;
+        Node* node = new Node;
+        StringIndexer::use(level);  // The level name lives as long as the node
+        children.insert(it, Child{level, node});
+        return node;
+      }
+
+      void erase(Node* node)
+      {
+        if (plus == node) plus = nullptr;
+        else if (hash == node) hash = nullptr;
+        else if (star == node) star = nullptr;
+        else
+        {
+          for(auto it=children.begin(); it!=children.end(); it++)
+          {
+            if (it->node == node)
+            {
+              StringIndexer::release(it->level);
+              children.erase(it);
+              break;
+            }
+          }
+        }
+        delete node;
+      }
+
+      bool empty() const
+      { return subscribers.empty() and children.empty() and not plus and not hash and not star; }
+
+      std::vector<Child> children;   // sorted by level
+      Node* plus = nullptr;
+      Node* hash = nullptr;
+      Node* star = nullptr;
+      std::vector<Subscriber*> subscribers;
+    };
+
+    static void append(const Node* node, std::vector<Subscriber*>& out)
+    {
+      out.insert(out.end(), node->subscribers.begin(), node->subscribers.end());
+    }
+
+    static void match(const Node* node, const Levels& topic, size_t i, std::vector<Subscriber*>& out)
+    {
+      bool wild = i or not TopicWildcards::isDollar(topic[0]);
+      if (wild and node->hash) append(node->hash, out);
+      if (wild and node->star)
+      {
+        for(size_t j=i; j<=topic.size(); j++)
+          match(node->star, topic, j, out);
+      }
+      if (i == topic.size())
+      {
+        append(node, out);
+        return;
+      }
+      if (wild and node->plus) match(node->plus, topic, i+1, out);
+      const Node* child = node->find(topic[i]);
+      if (child) match(child, topic, i+1, out);
+    }
+
+    // $ topics are not matched by wildcards at the first level
+    bool hidden(const Node* node, index_t level) const
+    { return node == &root and TopicWildcards::isDollar(level); }
+
+    // node and all the nodes below
+    void appendAll(const Node* node, std::vector<Subscriber*>& out) const
+    {
+      append(node, out);
+      for(const auto& c: node->children)
+        if (not hidden(node, c.level)) appendAll(c.node, out);
+    }
+
+    void collect(const Node* node, const Levels& filter, size_t i, std::vector<Subscriber*>& out) const
+    {
+      if (i == filter.size())
+      {
+        append(node, out);
+        return;
+      }
+      index_t level = filter[i];
+      if (level == TopicWildcards::hash())
+        appendAll(node, out);
+      else if (level == TopicWildcards::star())
+      {
+        collect(node, filter, i+1, out);
+        for(const auto& c: node->children)
+          if (not hidden(node, c.level)) collect(c.node, filter, i, out);
+      }
+      else if (level == TopicWildcards::plus())
+      {
+        for(const auto& c: node->children)
+          if (not hidden(node, c.level)) collect(c.node, filter, i+1, out);
+      }
+      else if (const Node* child = node->find(level))
+        collect(child, filter, i+1, out);
+    }
+
+    bool remove(Node* node, const Levels& filter, size_t i, Subscriber* subscriber)
+    {
+      Node* child = node->child(filter[i], false);
+      if (child == nullptr) return false;
+
+      bool removed;
+      if (i+1 == filter.size())
+      {
+        auto& subs = child->subscribers;
+        auto it = std::find(subs.begin(), subs.end(), subscriber);
+        removed = it != subs.end();
+        if (removed)
+        {
+          subs.erase(it);
+          count--;
+        }
+      }
+      else
+        removed = remove(child, filter, i+1, subscriber);
+
+      if (child->empty()) node->erase(child);
+      return removed;
+    }
+
+    Node root;
+    size_t count = 0;
+};
@@ -0,0 +1,289 @@
+// vim: ts=2 sw=2 expandtab
+#include <Arduino.h>
+#include <TinyMqtt.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+/**
+  * TinyMqtt broker benchmark suite.
+  *
+  * - parser: publishes parsed per second (chunked parser)
+  * - Topic::matches: ns per match
+  * - StringIndexer: ns to intern a new string, and an already known one
+  * - fan-out: local publish delivered to 1, 10, 100 and 1000 local subscribers
+  * - retained replay: subscribe to 1000 retained messages
+  * - latency: percentiles from a local publish to the local subscriber
+  *
+  * Each measure is the best of some rounds. The results are printed and
+  * written to bench.json in the current directory (tests/ with make bench),
+  * to be compared between two versions.
+  **/
+
+using string = TinyConsole::string;
+
+const int rounds = 5;
+static int errors = 0;   // mismatches, the benchmark exits with 1
+
+using Clock = std::chrono::steady_clock;
+
+uint64_t nanos()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// Best time of rounds, in ns
+template<class Run>
+uint64_t best(Run run)
+{
+  uint64_t best = UINT64_MAX;
+  for(int r=0; r<rounds; r++)
+  {
+    uint64_t start = nanos();
+    run();
+    best = std::min(best, nanos()-start);
+  }
+  return best;
+}
+
+string name(const char* prefix, int i)
+{
+  return string(prefix) + std::to_string(i).c_str();
+}
+
+std::stringstream json;
+
+void result(const char* key, double value, const char* unit)
+{
+  if (json.tellp() > 0) json << ",\n";
+  json << "  \"" << key << "\": " << std::fixed << std::setprecision(1) << value;
+  std::cout << std::setw(32) << std::left << key << std::setw(14) << std::right
+    << std::fixed << std::setprecision(1) << value << ' ' << unit << std::endl;
+}
+
+void writeJson(const char* path)
+{
+  std::ofstream out(path);
+  out << "{\n" << json.str() << "\n}\n";
+  std::cout << "results written to " << path << std::endl;
+}
+
+//----------------------------------------------------------------------------
+void benchParser()
+{
+  const int messages = 50000;
+  string stream;
+  const char* topic = "sensor/kitchen/temperature";
+  for(int i=0; i<messages; i++)
+  {
+    stream += (char)MqttMessage::Publish;
+    stream += (char)(2+strlen(topic)+16);
+    stream += (char)0;
+    stream += (char)strlen(topic);
+    stream += topic;
+    stream.append(16, 'x');
+  }
+
+  int count = 0;
+  uint64_t ns = best([&]()
+  {
+    MqttMessage msg;
+    count = 0;
+    const char* data = stream.data();
+    size_t left = stream.size();
+    while(left)
+    {
+      size_t used = msg.incoming(data, left);
+      data += used;
+      left -= used;
+      if (msg.type())
+      {
+        count++;
+        msg.reset();
+      }
+    }
+  });
+  if (count != messages)
+  {
+    std::cout << "  ERROR: parsed " << count << " messages" << std::endl;
+    errors++;
+  }
+  result("parser_publishes_per_s", messages * 1e9 / ns, "msg/s");
+  result("parser_mb_per_s", stream.size() * 1e3 / ns, "MB/s");
+}
+
+//----------------------------------------------------------------------------
+void benchMatches()
+{
+  std::vector<Topic> filters = { "home/+/temp", "home/#", "home/room1/temp", "+/+/+", "office/+/light" };
+  std::vector<Topic> topics;
+  for(int i=0; i<32; i++)
+    topics.push_back(name("home/room", i) + (i%2 ? "/temp" : "/light"));
+
+  const int loops = 20000;
+  size_t found = 0;
+  uint64_t ns = best([&]()
+  {
+    found = 0;
+    for(int i=0; i<loops; i++)
+      for(const auto& filter: filters)
+        found += filter.matches(topics[i % topics.size()]);
+  });
+  if (found == 0)
+  {
+    std::cout << "  ERROR: no match" << std::endl;
+    errors++;
+  }
+  result("topic_matches_ns", ns / double(loops * filters.size()), "ns");
+}
+
+//----------------------------------------------------------------------------
+void benchIndexer()
+{
+  const int count = 10000;
+  std::vector<string> names;
+  for(int i=0; i<count; i++)
+    names.push_back(name("device/sensor", i));
+
+  // intern then release: the string is new each time
+  uint64_t intern_ns = best([&]()
+  {
+    for(const auto& s: names) Topic topic(s);
+  });
+
+  std::vector<Topic> kept(names.begin(), names.end());
+  uint64_t lookup_ns = best([&]()
+  {
+    for(const auto& s: names) Topic topic(s);
+  });
+  result("indexer_intern_new_ns", intern_ns / double(count), "ns");
+  result("indexer_intern_known_ns", lookup_ns / double(count), "ns");
+}
+
+//----------------------------------------------------------------------------
+static uint32_t delivered = 0;
+static uint64_t received_at = 0;
+
+void onPublish(const MqttClient*, const Topic&, const char*, size_t)
+{
+  delivered++;
+  received_at = nanos();
+}
+
+void benchFanOut(int subscribers)
+{
+  MqttBroker broker(1883);
+  std::vector<MqttClient*> clients;
+  for(int i=0; i<subscribers; i++)
+  {
+    MqttClient* client = new MqttClient(&broker, name("sub", i));
+    client->setCallback(onPublish);
+    client->subscribe(i%2 ? "fanout/#" : "fanout/+/value");
+    clients.push_back(client);
+  }
+  MqttClient sender(&broker, "sender");
+  Topic topic("fanout/kitchen/value");
+
+  const int publishes = std::max(100, 100000 / subscribers);
+  delivered = 0;
+  uint64_t ns = best([&]()
+  {
+    for(int i=0; i<publishes; i++) sender.publish(topic, "21.5");
+  });
+  if (delivered != uint32_t(rounds * publishes * subscribers))
+  {
+    std::cout << "  ERROR: delivered " << delivered << std::endl;
+    errors++;
+  }
+
+  string key = name("fanout_", subscribers);
+  result((key + "_publish_ns").c_str(), ns / double(publishes), "ns");
+  result((key + "_deliveries_per_s").c_str(), publishes * subscribers * 1e9 / ns, "msg/s");
+  for(auto client: clients) delete client;
+}
+
+//----------------------------------------------------------------------------
+void benchRetained()
+{
+  const int retained = 1000;
+  MqttBroker broker(1883, retained);
+  MqttClient publisher(&broker, "publisher");
+  for(int i=0; i<retained; i++)
+    publisher.publish(name("retained/device", i), "on", true);
+
+  delivered = 0;
+  uint64_t ns = best([&]()
+  {
+    MqttClient client(&broker, "replay");
+    client.setCallback(onPublish);
+    client.subscribe("retained/#");
+  });
+  if (delivered != uint32_t(rounds * retained))
+  {
+    std::cout << "  ERROR: replayed " << delivered << std::endl;
+    errors++;
+  }
+  result("retained_replay_1000_us", ns / 1e3, "us");
+}
+
+//----------------------------------------------------------------------------
+void benchLatency()
+{
+  MqttBroker broker(1883);
+  std::vector<MqttClient*> others;
+  for(int i=0; i<10; i++)
+  {
+    others.push_back(new MqttClient(&broker, name("other", i)));
+    others.back()->subscribe("latency/#");
+  }
+  MqttClient subscriber(&broker, "subscriber");
+  subscriber.setCallback(onPublish);
+  subscriber.subscribe("latency/+");
+  MqttClient sender(&broker, "sender");
+  Topic topic("latency/ping");
+
+  const int samples = 20000;
+  std::vector<uint64_t> latencies;
+  latencies.reserve(samples);
+  delivered = 0;
+  for(int i=0; i<samples; i++)
+  {
+    uint64_t start = nanos();
+    sender.publish(topic, "ping");
+    latencies.push_back(received_at-start);
+  }
+  if (delivered != uint32_t(samples))
+  {
+    std::cout << "  ERROR: latency delivered " << delivered << std::endl;
+    errors++;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) { return double(latencies[size_t(p * (samples-1))]); };
+  result("latency_p50_ns", percentile(0.50), "ns");
+  result("latency_p90_ns", percentile(0.90), "ns");
+  result("latency_p99_ns", percentile(0.99), "ns");
+  result("latency_max_ns", double(latencies.back()), "ns");
+  for(auto client: others) delete client;
+}
+
+//----------------------------------------------------------------------------
+// setup() and loop()
+void setup() {
+  Serial.println("=============[ TinyMqtt BROKER BENCHMARK ]========================");
+}
+
+void loop() {
+  benchParser();
+  benchMatches();
+  benchIndexer();
+  for(int subscribers: { 1, 10, 100, 1000 })
+    benchFanOut(subscribers);
+  benchRetained();
+  benchLatency();
+  writeJson("bench.json");
+  exit(errors ? 1 : 0);
+}
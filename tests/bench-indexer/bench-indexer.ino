@@ -0,0 +1,60 @@
+// vim: ts=2 sw=2 expandtab
+#include <Arduino.h>
+#include <StringIndexer.h>
+#include <iostream>
+#include <vector>
+
+/**
+  * TinyMqtt StringIndexer benchmark.
+  *
+  * Intern and release rate with 10k different topics.
+  **/
+
+using string = TinyConsole::string;
+
+const int topics = 10000;
+static int errors = 0;   // mismatches, the benchmark exits with 1
+
+void bench()
+{
+  std::vector<string> names;
+  for(int i=0; i<topics; i++)
+    names.push_back(string("home/floor")+std::to_string(i%10).c_str()+"/sensor"+std::to_string(i).c_str()+"/temperature");
+
+  std::vector<IndexedString> strings;
+  strings.reserve(topics);
+  unsigned long start = micros();
+  for(const auto& name: names) strings.push_back(IndexedString(name));
+  unsigned long created = micros()-start;
+  size_t interned = StringIndexer::count();
+
+  start = micros();
+  for(int loop=0; loop<10; loop++)
+    for(const auto& name: names) IndexedString again(name);   // existing ones
+  unsigned long found = micros()-start;
+
+  start = micros();
+  strings.clear();
+  unsigned long released = micros()-start;
+
+  std::cout << "  intern new:      " << (created ? topics*1000/created : 0) << " k/s" << std::endl;
+  std::cout << "  intern existing: " << (found ? topics*10*1000/found : 0) << " k/s" << std::endl;
+  std::cout << "  release:         " << (released ? topics*1000/released : 0) << " k/s" << std::endl;
+
+  if (interned != (size_t)topics or StringIndexer::count() != 0)
+  {
+    std::cout << "  ERROR: interned " << interned << ", left " << StringIndexer::count() << std::endl;
+    errors++;
+  }
+}
+
+//----------------------------------------------------------------------------
+// setup() and loop()
+void setup() {
+  Serial.println("=============[ TinyMqtt INDEXER BENCHMARK ]=======================");
+}
+
+void loop() {
+  bench();
+  exit(errors ? 1 : 0);
+}
@@ -0,0 +1,126 @@
+// vim: ts=2 sw=2 expandtab
+#include <Arduino.h>
+#include <TinyMqtt.h>
+#include <iostream>
+#include <iomanip>
+
+/**
+  * TinyMqtt topic matching benchmark.
+  *
+  * Matches publish topics against a client subscribed to many filters:
+  * - Topic::matches(topic) for each filter (generic matching of the levels)
+  * - TopicFilter::matches(topic) for each filter (compiled filters)
+  * - TopicFilterSet::match(topic) (all filters at once)
+  *
+  * Filters are 1/2 exact, 1/4 prefix (a/b/#) and 1/4 generic (a/+/c).
+  **/
+
+const int publishes = 20000;
+const int rounds = 5;
+static int errors = 0;   // mismatches, the benchmark exits with 1
+
+string name(const char* prefix, int i)
+{
+  return string(prefix) + std::to_string(i).c_str();
+}
+
+std::vector<Topic> makeFilters(int count)
+{
+  std::vector<Topic> filters;
+  for(int i=0; i<count; i++)
+  {
+    switch(i%4)
+    {
+      case 0:
+      case 1: filters.push_back(name("home/room", i/4) + (i%4 ? "/temp" : "/light")); break;
+      case 2: filters.push_back(name("home/room", i/4) + "/#"); break;
+      default: filters.push_back(name("home/+/sensor", i/4)); break;
+    }
+  }
+  return filters;
+}
+
+std::vector<Topic> makeTopics(int filters)
+{
+  std::vector<Topic> topics;
+  for(int i=0; i<64; i++)
+  {
+    int room = (i*7) % (filters/4+8);   // some topics match nothing
+    topics.push_back(name("home/room", room) + (i%3 ? "/temp" : name("/sensor", room)));
+  }
+  return topics;
+}
+
+template<class Match>
+uint32_t run(const std::vector<Topic>& topics, size_t& found, Match match)
+{
+  found = 0;
+  uint32_t best = UINT32_MAX;
+  for(int r=0; r<rounds; r++)
+  {
+    size_t count = 0;
+    uint32_t start = micros();
+    for(int i=0; i<publishes; i++)
+      count += match(topics[i % topics.size()]);
+    best = std::min(best, (uint32_t)(micros()-start));
+    found = count;
+  }
+  return best;
+}
+
+void bench(int count)
+{
+  std::vector<Topic> filters = makeFilters(count);
+  std::vector<Topic> topics = makeTopics(count);
+  std::vector<TopicFilter> compiled(filters.begin(), filters.end());
+  TopicFilterSet<TopicFilter> set;
+  for(const auto& filter: compiled) set.add(filter);
+
+  size_t by_topic, by_filter, by_set;
+  uint32_t topic_us = run(topics, by_topic, [&](const Topic& topic)
+  {
+    size_t n = 0;
+    for(const auto& filter: filters) n += filter.matches(topic);
+    return n;
+  });
+  uint32_t filter_us = run(topics, by_filter, [&](const Topic& topic)
+  {
+    size_t n = 0;
+    for(const auto& filter: compiled) n += filter.matches(topic);
+    return n;
+  });
+  std::vector<TopicFilterSet<TopicFilter>::Id> ids;
+  uint32_t set_us = run(topics, by_set, [&](const Topic& topic)
+  {
+    ids.clear();
+    set.match(topic, ids);
+    return ids.size();
+  });
+
+  if (by_topic != by_filter or by_topic != by_set)
+  {
+    std::cout << "  ERROR: matches " << by_topic << '/' << by_filter << '/' << by_set << std::endl;
+    errors++;
+  }
+
+  auto ns = [](uint32_t us) { return us * 1000.0 / publishes; };
+  std::cout << "filters=" << std::setw(4) << std::left << count
+    << " Topic::matches: " << std::setw(8) << std::fixed << std::setprecision(1) << ns(topic_us) << " ns"
+    << "  TopicFilter: " << std::setw(8) << ns(filter_us) << " ns"
+    << "  TopicFilterSet: " << std::setw(7) << ns(set_us) << " ns"
+    << "  speedup x" << std::setprecision(2) << (set_us ? filter_us / (double)set_us : 0)
+    << std::endl;
+}
+
+//----------------------------------------------------------------------------
+// setup() and loop()
+void setup() {
+  Serial.println("=============[ TinyMqtt MATCHING BENCHMARK ]======================");
+}
+
+void loop() {
+  bench(10);
+  bench(100);
+  bench(500);
+  exit(errors ? 1 : 0);
+}
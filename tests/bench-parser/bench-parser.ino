@@ -0,0 +1,124 @@
+// vim: ts=2 sw=2 expandtab
+#include <Arduino.h>
+#include <TinyMqtt.h>
+#include <iostream>
+#include <iomanip>
+
+/**
+  * TinyMqtt parser benchmark.
+  *
+  * Compares the byte at a time parser MqttMessage::incoming(char)
+  * with the chunked one MqttMessage::incoming(const char*, size_t)
+  * on a stream of publish messages read by blocks of TINY_MQTT_READ_BUFFER.
+  **/
+
+using string = TinyConsole::string;
+
+const int messages = 50000;
+const int rounds = 5;
+static int errors = 0;   // mismatches, the benchmark exits with 1
+
+string publishMessage(const char* topic, size_t payload_length)
+{
+  string msg;
+  size_t len = 2 + strlen(topic) + payload_length;
+  msg += (char)MqttMessage::Publish;
+  do
+  {
+    char byte = len & 0x7F;
+    len >>= 7;
+    if (len) byte |= 0x80;
+    msg += byte;
+  } while(len);
+  msg += (char)(strlen(topic) >> 8);
+  msg += (char)(strlen(topic) & 0xFF);
+  msg += topic;
+  msg.append(payload_length, 'x');
+  return msg;
+}
+
+uint32_t parseByBytes(const string& stream, int& count)
+{
+  MqttMessage msg;
+  count = 0;
+  uint32_t start = micros();
+  for(const char byte: stream)
+  {
+    msg.incoming(byte);
+    if (msg.type())
+    {
+      count++;
+      msg.reset();
+    }
+  }
+  return micros()-start;
+}
+
+uint32_t parseByChunks(const string& stream, int& count)
+{
+  MqttMessage msg;
+  count = 0;
+  const char* data = stream.data();
+  size_t left = stream.size();
+  uint32_t start = micros();
+  while(left)
+  {
+    size_t chunk = left < TINY_MQTT_READ_BUFFER ? left : TINY_MQTT_READ_BUFFER;
+    left -= chunk;
+    while(chunk)
+    {
+      size_t used = msg.incoming(data, chunk);
+      data += used;
+      chunk -= used;
+      if (msg.type())
+      {
+        count++;
+        msg.reset();
+      }
+    }
+  }
+  return micros()-start;
+}
+
+void bench(const char* name, size_t payload_length)
+{
+  string stream;
+  for(int i=0; i<messages; i++)
+    stream += publishMessage("sensor/kitchen/temperature", payload_length);
+
+  uint32_t bytes_us = UINT32_MAX;
+  uint32_t chunks_us = UINT32_MAX;
+  int bytes_count, chunks_count;
+  for(int r=0; r<rounds; r++)
+  {
+    bytes_us = std::min(bytes_us, parseByBytes(stream, bytes_count));
+    chunks_us = std::min(chunks_us, parseByChunks(stream, chunks_count));
+  }
+  if (bytes_count != messages or chunks_count != messages)
+  {
+    std::cout << "  ERROR: parsed " << bytes_count << '/' << chunks_count << " messages" << std::endl;
+    errors++;
+  }
+
+  auto rate = [](size_t bytes, uint32_t us) { return us ? bytes / (double)us : 0; };
+  std::cout << std::setw(16) << std::left << name
+    << " payload=" << std::setw(5) << payload_length
+    << " bytes: " << std::setw(7) << std::fixed << std::setprecision(1) << rate(stream.size(), bytes_us) << " MB/s"
+    << "  chunks: " << std::setw(7) << rate(stream.size(), chunks_us) << " MB/s"
+    << "  speedup x" << std::setprecision(2) << (chunks_us ? bytes_us / (double)chunks_us : 0)
+    << std::endl;
+}
+
+//----------------------------------------------------------------------------
+// setup() and loop()
+void setup() {
+  Serial.println("=============[ TinyMqtt PARSER BENCHMARK ]========================");
+}
+
+void loop() {
+  bench("tiny publish", 4);
+  bench("small publish", 64);
+  bench("medium publish", 512);
+  bench("large publish", 2048);
+  exit(errors ? 1 : 0);
+}
@@ -0,0 +1,82 @@
+// vim: ts=2 sw=2 expandtab
+#include <Arduino.h>
+#include <TinyMqtt.h>
+#include <iostream>
+#include <iomanip>
+
+/**
+  * TinyMqtt persistence benchmark.
+  *
+  * Time needed by MqttBroker::begin() to restore 100k retained messages
+  * from a MqttFileStore, when they are all in the snapshot (compacted)
+  * or all in the log.
+  **/
+
+const uint32_t retained = 100000;
+const char* path = "/tmp/tinymqtt-bench-persistence";
+static int errors = 0;   // mismatches, the benchmark exits with 1
+
+string topicName(uint32_t i)
+{
+  return string("site/") + std::to_string(i % 100).c_str() + "/device" + std::to_string(i).c_str();
+}
+
+void bench(const char* name, bool compact)
+{
+  remove((string(path)+".snap").c_str());
+  remove((string(path)+".log").c_str());
+
+  size_t bytes;
+  uint32_t write_us;
+  {
+    MqttFileStore store(path);
+    MqttBroker broker(1883, retained);
+    broker.persist(&store);
+    broker.begin();
+    MqttClient publisher(&broker);
+    string payload(32, 'x');
+    uint32_t start = micros();
+    for(uint32_t i=0; i<retained; i++)
+      publisher.publish(topicName(i), payload, true);
+    if (compact) broker.compact();
+    store.sync(true);
+    write_us = micros()-start;
+    bytes = store.stats().log_bytes + store.stats().snapshot_bytes;
+  }
+
+  MqttFileStore store(path);
+  MqttBroker broker(1883, retained);
+  broker.persist(&store);
+  uint32_t start = micros();
+  broker.begin();
+  uint32_t load_us = micros()-start;
+
+  if (broker.retainCount() != retained)
+  {
+    std::cout << "  ERROR: restored " << broker.retainCount() << " messages" << std::endl;
+    errors++;
+  }
+
+  std::cout << std::setw(10) << std::left << name
+    << " files: " << std::setw(6) << std::fixed << std::setprecision(1) << bytes / 1048576.0 << " MB"
+    << "  write: " << std::setw(7) << write_us / 1000.0 << " ms"
+    << "  recovery: " << std::setw(7) << load_us / 1000.0 << " ms"
+    << "  (" << std::setprecision(0) << (load_us ? retained * 1000.0 / load_us : 0) << " msg/ms)"
+    << std::endl;
+}
+
+//----------------------------------------------------------------------------
+// setup() and loop()
+void setup() {
+  Serial.println("=============[ TinyMqtt PERSISTENCE BENCHMARK ]===================");
+}
+
+void loop() {
+#if TINY_MQTT_FILE_STORE
+  bench("snapshot", true);
+  bench("log", false);
+#else
+  Serial.println("MqttFileStore is not available on this platform");
+#endif
+  exit(errors ? 1 : 0);
+}
@@ -33,6 +33,23 @@ class TestReceiver : public MqttClassBinder<TestReceiver>
 
 std::map<std::string, int> TestReceiver::messages;
 
+class Light : public MqttClassBinder<Light>
+{
+  public:
+    void onPublish(const MqttClient*, const Topic&, const char*, size_t) { any++; }
+    void onState(const MqttClient*, const Topic&, const char*, size_t) { states++; }
+    void onLevel(const MqttClient*, const Topic&, const char* payload, size_t length)
+    {
+      levels++;
+      level.assign(payload, length);
+    }
+
+    int any = 0;
+    int states = 0;
+    int levels = 0;
+    std::string level;
+};
+
 static int unrouted = 0;
 void onUnrouted(const MqttClient*, const Topic& topic, const char*, size_t)
 {
@@ -332,6 +349,91 @@ test(classbind_should_cleanup_when_MqttClient_dies)
 
 }
 
+test(classbind_filters_dispatch_to_their_methods)
+{
+  MqttBroker broker(1883);
+  MqttClient client(&broker);
+  MqttClient sender(&broker);
+  Light light;
+
+  MqttClassBinder<Light>::reset();
+  MqttClassBinder<Light>::bind(&client, "light/+/state", &light, &Light::onState);
+  MqttClassBinder<Light>::bind(&client, "light/kitchen/#", &light, &Light::onLevel);
+  assertEqual(MqttClassBinder<Light>::bindingsCount(), (size_t)2);
+
+  client.subscribe("light/#");
+  sender.publish("light/desk/state", "on");
+  sender.publish("light/kitchen/level", "42");
+  sender.publish("light/kitchen/state", "off");   // both filters
+  sender.publish("light/desk/level", "3");        // no filter
+
+  assertEqual(light.states, 2);
+  assertEqual(light.levels, 2);
+  assertEqual(light.level, std::string("off"));
+  assertEqual(light.any, 0);
+  MqttClassBinder<Light>::reset();
+}
+
+test(classbind_unbind_handle)
+{
+  MqttBroker broker(1883);
+  MqttClient client(&broker);
+  MqttClient sender(&broker);
+  Light light_1;
+  Light light_2;
+
+  MqttClassBinder<Light>::reset();
+  auto handle_1 = MqttClassBinder<Light>::bind(&client, "a/b", &light_1, &Light::onState);
+  auto handle_2 = MqttClassBinder<Light>::bind(&client, "a/#", &light_2, &Light::onState);
+
+  client.subscribe("a/#");
+  sender.publish("a/b", "1");
+  assertEqual(light_1.states, 1);
+  assertEqual(light_2.states, 1);
+
+  assertTrue(MqttClassBinder<Light>::unbind(handle_1));
+  assertFalse(MqttClassBinder<Light>::unbind(handle_1));    // stale
+  sender.publish("a/b", "2");
+  assertEqual(light_1.states, 1);
+  assertEqual(light_2.states, 2);
+
+  // the handle of the moved binding is still valid
+  assertTrue(MqttClassBinder<Light>::unbind(handle_2));
+  assertEqual(MqttClassBinder<Light>::bindingsCount(), (size_t)0);
+
+  unrouted = 0;
+  MqttClassBinder<Light>::onUnpublished(onUnrouted);
+  sender.publish("a/b", "3");
+  assertEqual(light_2.states, 2);
+  assertEqual(unrouted, 1);
+  MqttClassBinder<Light>::onUnpublished(nullptr);
+}
+
+test(classbind_bindings_die_with_the_receiver)
+{
+  MqttBroker broker(1883);
+  MqttClient client(&broker);
+  MqttClient sender(&broker);
+  Light light;
+
+  MqttClassBinder<Light>::reset();
+  MqttClassBinder<Light>::onPublish(&client, &light);
+  {
+    Light dying;
+    MqttClassBinder<Light>::bind(&client, "a/+", &dying, &Light::onState);
+    MqttClassBinder<Light>::bind(&client, "a/b", &dying, &Light::onLevel);
+    MqttClassBinder<Light>::bind(&client, "a/b", &light, &Light::onLevel);
+    assertEqual(MqttClassBinder<Light>::bindingsCount(), (size_t)3);
+  }
+  assertEqual(MqttClassBinder<Light>::bindingsCount(), (size_t)1);
+
+  client.subscribe("a/b");
+  sender.publish("a/b", "x");
+  assertEqual(light.any, 1);      // client binding
+  assertEqual(light.levels, 1);   // filter binding
+  MqttClassBinder<Light>::reset();
+}
+
 //----------------------------------------------------------------------------
 // setup() and loop()
 void setup() {
@@ -0,0 +1,186 @@
+// vim: ts=2 sw=2 expandtab
+#include <Arduino.h>
+#include <TinyMqtt.h>
+#include <MqttAwait.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <AUnit.h>  // last: its test() macro breaks std::atomic_flag::test (C++20)
+
+/**
+  * TinyMqtt coroutine unit tests (MqttAwait.h, C++20).
+  *
+  * The clients are connected to the broker through real sockets on
+  * 127.0.0.1 (TINY_MQTT_EPOLL backend).
+  **/
+
+using string = TinyConsole::string;
+
+const uint16_t port = 18832;
+
+// Runs the broker and the clients until done() or 500ms
+template<class Done>
+bool run(MqttBroker& broker, std::vector<MqttAwaitClient*> clients, Done done)
+{
+  uint32_t start = millis();
+  while(not done())
+  {
+    if (millis() - start > 500) return false;
+    broker.loop(1);
+    for(auto client: clients) client->loop();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
+std::vector<int> steps;   // results of the operations, in order
+
+MqttTask subscriber(MqttAwaitClient& mqtt, std::string& received)
+{
+  steps.push_back(co_await mqtt.connect("127.0.0.1", port));
+  steps.push_back(co_await mqtt.subscribe("a/#", 1));
+  auto msg = co_await mqtt.message();
+  received = msg.topic + '=' + msg.payload;
+}
+
+MqttTask publisher(MqttAwaitClient& mqtt)
+{
+  steps.push_back(co_await mqtt.connect("127.0.0.1", port));
+  steps.push_back(co_await mqtt.publish("a/b", "hello", 5, false, 1));
+}
+
+test(coroutine_connect_subscribe_publish_message)
+{
+  MqttBroker broker(port);
+  broker.begin();
+  MqttClient sub_client("sub");
+  MqttClient pub_client("pub");
+  MqttAwaitClient sub(sub_client);
+  MqttAwaitClient pub(pub_client);
+
+  steps.clear();
+  std::string received;
+  MqttTask s = subscriber(sub, received);
+  assertFalse(s.done());  // waits for CONNACK
+  assertTrue(run(broker, {&sub}, [&]() { return steps.size() == 2; }));
+  assertEqual(steps[0], 0);   // connection accepted
+  assertEqual(steps[1], 1);   // granted qos
+
+  MqttTask p = publisher(pub);
+  assertTrue(run(broker, {&sub, &pub}, [&]() { return s.done() and p.done(); }));
+  assertEqual(steps.size(), (size_t)4);
+  assertEqual(steps[3], 0);   // PUBACK received
+  assertEqual(received.c_str(), "a/b=hello");
+  assertEqual(pub_client.inflightCount(), (size_t)0);
+}
+
+MqttTask pipeline(MqttAwaitClient& mqtt, int count)
+{
+  co_await mqtt.connect("127.0.0.1", port);
+  std::vector<MqttAwaitClient::Operation> ops;
+  for(int i=0; i<count; i++)
+    ops.push_back(mqtt.publish("a/b", "x", 1, false, 1 + i%2));
+  for(auto& op: ops)
+    steps.push_back(co_await op);
+}
+
+test(coroutine_pipelined_publishes)
+{
+  MqttBroker broker(port);
+  broker.begin();
+  MqttClient client("pipe");
+  client.inflight(3);   // the next ones wait for a free place
+  MqttAwaitClient mqtt(client);
+
+  steps.clear();
+  MqttTask t = pipeline(mqtt, 10);
+  assertTrue(run(broker, {&mqtt}, [&]() { return t.done(); }));
+  assertEqual(steps.size(), (size_t)10);
+  for(int step: steps) assertEqual(step, 0);
+  assertEqual(client.publishSequence(), (uint32_t)10);
+}
+
+MqttTask dropped(MqttAwaitClient& mqtt)
+{
+  co_await mqtt.connect("127.0.0.1", port);
+  auto first = mqtt.publish("a/b", "1", 1, false, 1);
+  auto second = mqtt.publish("a/b", "2", 1, false, 1);   // window full, no waiting publish
+  steps.push_back(co_await second);
+  steps.push_back(co_await first);
+}
+
+test(coroutine_dropped_publish_fails)
+{
+  MqttBroker broker(port);
+  broker.begin();
+  MqttClient client("drop");
+  client.inflight(1, 0);
+  MqttAwaitClient mqtt(client);
+
+  steps.clear();
+  MqttTask t = dropped(mqtt);
+  assertTrue(run(broker, {&mqtt}, [&]() { return t.done(); }));
+  assertEqual(steps.size(), (size_t)2);
+  assertEqual(steps[0], 0x80);
+  assertEqual(steps[1], 0);
+}
+
+MqttTask refused(MqttAwaitClient& mqtt)
+{
+  steps.push_back(co_await mqtt.connect("127.0.0.1", port+1));   // nobody listens
+  steps.push_back(co_await mqtt.subscribe("a/b"));
+}
+
+test(coroutine_connect_failure)
+{
+  MqttClient client("nobody");
+  MqttAwaitClient mqtt(client);
+
+  steps.clear();
+  MqttTask t = refused(mqtt);
+  assertTrue(t.done());   // nothing to wait for
+  assertEqual(steps.size(), (size_t)2);
+  assertEqual(steps[0], 0x80);
+  assertEqual(steps[1], 0x80);
+}
+
+MqttTask local(MqttAwaitClient& mqtt, MqttBroker& broker)
+{
+  steps.push_back(co_await mqtt.connect(&broker));
+  steps.push_back(co_await mqtt.subscribe("l/#", 2));
+  steps.push_back(co_await mqtt.publish("l/x", "y", 1, false, 1));
+  auto msg = co_await mqtt.message();
+  steps.push_back(msg.payload == "y");
+}
+
+test(coroutine_local_broker_completes_at_once)
+{
+  MqttBroker broker(port);
+  MqttClient client;
+  MqttAwaitClient mqtt(client);
+
+  steps.clear();
+  MqttTask t = local(mqtt, broker);
+  assertTrue(t.done());
+  assertEqual(steps.size(), (size_t)4);
+  assertEqual(steps[0], 0);
+  assertEqual(steps[1], 2);
+  assertEqual(steps[2], 0);
+  assertEqual(steps[3], 1);
+}
+
+//----------------------------------------------------------------------------
+// setup() and loop()
+void setup() {
+  Serial.begin(115200);
+  while(!Serial);
+
+  Serial.println("=============[ TinyMqtt coroutine TESTS ]========================");
+}
+
+void loop() {
+  aunit::TestRunner::run();
+
+  if (Serial.available()) ESP.reset();
+}
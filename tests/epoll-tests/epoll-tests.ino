@@ -0,0 +1,128 @@
+// vim: ts=2 sw=2 expandtab
+#include <Arduino.h>
+#include <AUnit.h>
+#include <TinyMqtt.h>
+#include <vector>
+#include <string>
+
+/**
+  * TinyMqtt epoll unit tests.
+  *
+  * Broker and clients are connected through real sockets on 127.0.0.1
+  * (TINY_MQTT_EPOLL backend).
+  **/
+
+using string = TinyConsole::string;
+
+const uint16_t port = 18830;
+
+int received = 0;
+std::string lastPayload;
+
+void onPublish(const MqttClient*, const Topic&, const char* payload, size_t length)
+{
+  received++;
+  lastPayload = std::string(payload, length);
+}
+
+// Runs the broker (waiting for events) and the clients for ms
+void run(MqttBroker& broker, std::vector<MqttClient*> clients, uint32_t ms)
+{
+  uint32_t start = millis();
+  do
+  {
+    broker.loop(1);
+    for(auto client: clients) client->loop();
+  } while(millis() - start < ms);
+}
+
+test(epoll_publish_between_network_clients)
+{
+  MqttBroker broker(port);
+  broker.begin();
+  MqttClient subscriber("sub");
+  MqttClient publisher("pub");
+  subscriber.connect("127.0.0.1", port);
+  publisher.connect("127.0.0.1", port);
+  run(broker, {&subscriber, &publisher}, 50);
+  assertEqual(broker.clientsCount(), (size_t)2);
+
+  received = 0;
+  subscriber.setCallback(onPublish);
+  subscriber.subscribe("a/b");
+  run(broker, {&subscriber, &publisher}, 50);
+  publisher.publish("a/b", "payload", 7, false, 0);
+  run(broker, {&subscriber, &publisher}, 50);
+
+  assertEqual(received, 1);
+  assertEqual(lastPayload.c_str(), "payload");
+}
+
+test(epoll_idle_broker_waits)
+{
+  MqttBroker broker(port);
+  broker.begin();
+  MqttClient client("idle");
+  client.connect("127.0.0.1", port);
+  run(broker, {&client}, 50);
+
+  // Nothing to do: loop sleeps until the timeout
+  uint32_t start = millis();
+  broker.loop(100);
+  assertMoreOrEqual(millis() - start, (uint32_t)90);
+
+  // Data wakes it up
+  client.publish("x", "y", 1, false, 0);
+  start = millis();
+  broker.loop(1000);
+  assertLess(millis() - start, (uint32_t)500);
+}
+
+test(epoll_closed_client_is_removed)
+{
+  MqttBroker broker(port);
+  broker.begin();
+  {
+    MqttClient client("closing");
+    client.connect("127.0.0.1", port);
+    run(broker, {&client}, 50);
+    assertEqual(broker.clientsCount(), (size_t)1);
+  }
+  run(broker, {}, 50);
+  assertEqual(broker.clientsCount(), (size_t)0);
+}
+
+test(epoll_many_connections_are_accepted)
+{
+  MqttBroker broker(port);
+  broker.begin();
+  std::vector<MqttClient*> clients;
+  for(int i=0; i<3*TINY_MQTT_ACCEPT_BATCH; i++)
+  {
+    MqttClient* client = new MqttClient(string("c")+std::to_string(i));
+    client->connect("127.0.0.1", port);
+    clients.push_back(client);
+  }
+  run(broker, clients, 200);
+  assertEqual(broker.clientsCount(), clients.size());
+
+  for(auto client: clients) delete client;
+  run(broker, {}, 100);
+  assertEqual(broker.clientsCount(), (size_t)0);
+}
+
+//----------------------------------------------------------------------------
+// setup() and loop()
+void setup() {
+  delay(1000);
+  Serial.begin(115200);
+  while(!Serial);
+
+  Serial.println("=============[ EPOLL TinyMqtt TESTS              ]========================");
+}
+
+void loop() {
+  aunit::TestRunner::run();
+
+  if (Serial.available()) ESP.reset();
+}
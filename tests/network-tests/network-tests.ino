@@ -3,6 +3,7 @@
 #include <AUnit.h>
 #include <TinyMqtt.h>
 #include <map>
+#include <set>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
@@ -231,6 +232,94 @@ test(broker_connect_and_client_deletion)
   assertEqual(MqttClient::instances, 0);
 }
 
+test(bridge_subscribes_covering_filters_upstream)
+{
+  start_many_wifi_esp(2, true);
+  MqttBroker parent(1883);
+  parent.begin();
+  IPAddress parent_ip = WiFi.localIP();
+
+  ESP8266WiFiClass::selectInstance(2);
+  MqttBroker bridge(1883);
+  bridge.begin();
+  bridge.connect(parent_ip.toString().c_str());
+  MqttClient ab(&bridge, "ab");
+  MqttClient all(&bridge, "all");
+  MqttClient other(&bridge, "other");
+  auto run = [&]() { for(int i=0; i<4; i++) { bridge.loop(); parent.loop(); } };
+  run();
+  assertEqual(parent.clientsCount(), (size_t)1);
+  const MqttClient* link = parent.getClients()[0];
+
+  MqttClient::counters[MqttMessage::Type::Subscribe] = 0;
+  MqttClient::counters[MqttMessage::Type::UnSubscribe] = 0;
+  ab.subscribe("a/b");
+  all.subscribe("a/#");
+  other.subscribe("x/+/y");
+  other.subscribe("a/+/c");   // covered by a/#
+  run();
+  assertEqual(MqttClient::counters[MqttMessage::Type::Subscribe], 2);
+  assertTrue(link->isSubscribedTo("a/#"));
+  assertTrue(link->isSubscribedTo("x/+/y"));
+
+  // a/b and a/+/c are not covered anymore
+  all.unsubscribe("a/#");
+  run();
+  assertEqual(MqttClient::counters[MqttMessage::Type::UnSubscribe], 1);
+  assertEqual(MqttClient::counters[MqttMessage::Type::Subscribe], 4);
+  assertFalse(link->isSubscribedTo("a/#"));
+  assertTrue(link->isSubscribedTo("a/b"));
+  assertTrue(link->isSubscribedTo("a/+/c"));
+
+  // Last subscribers leave
+  ab.close();
+  other.unsubscribe("x/+/y");
+  other.unsubscribe("a/+/c");
+  run();
+  assertEqual(MqttClient::counters[MqttMessage::Type::UnSubscribe], 4);
+  assertFalse(link->isSubscribedTo("a/b"));
+  assertFalse(link->isSubscribedTo("x/+/y"));
+}
+
+test(bridge_forwards_each_publish_once)
+{
+  published.clear();
+  start_many_wifi_esp(2, true);
+  MqttBroker parent(1883);
+  parent.begin();
+  IPAddress parent_ip = WiFi.localIP();
+  MqttClient watcher(&parent, "watcher");
+  watcher.setCallback(onPublish);
+  watcher.subscribe("#");
+
+  ESP8266WiFiClass::selectInstance(2);
+  MqttBroker bridge(1883);
+  bridge.begin();
+  bridge.connect(parent_ip.toString().c_str());
+  MqttClient sub1(&bridge, "sub1");
+  MqttClient sub2(&bridge, "sub2");
+  MqttClient sub3(&bridge, "sub3");
+  MqttClient pub(&bridge, "pub");
+  sub1.setCallback(onPublish);
+  sub2.setCallback(onPublish);
+  sub1.subscribe("a/#");
+  sub2.subscribe("a/b");
+  sub3.subscribe("z");
+  auto run = [&]() { for(int i=0; i<4; i++) { bridge.loop(); parent.loop(); } };
+  run();
+
+  pub.publish("a/b", "x", 1, false, 0);
+  run();
+  assertEqual(published["watcher"]["a/b"], 1);  // forwarded once
+  assertEqual(published["sub1"]["a/b"], 1);     // back from the parent
+  assertEqual(published["sub2"]["a/b"], 1);
+
+  // Nobody wants it below
+  pub.publish("q", "x", 1, false, 0);
+  run();
+  assertEqual(published["watcher"]["q"], 0);
+}
+
 test(client_keep_alive_high)
 {
   const uint32_t keep_alive=1000;
@@ -495,6 +584,100 @@ test(one_client_one_broker_hudge_payload)
   assertEqual((unsigned int)lastLength, (unsigned int)sent.size());
 }
 
+std::string streamed;
+size_t streamed_length;
+
+void onStream(const MqttClient*, const Topic&, const char* chunk, size_t length, size_t offset, size_t payload_length)
+{
+  if (offset==0) streamed.clear();
+  if (offset != streamed.length()) return;
+  streamed.append(chunk, length);
+  streamed_length = payload_length;
+}
+
+test(one_client_one_broker_streamed_payload)
+{
+  start_many_wifi_esp(3, true);
+  published.clear();
+  assertEqual(WiFi.status(), WL_CONNECTED);
+
+  MqttBroker broker(1883);
+  broker.streaming(128);
+  broker.begin();
+  IPAddress ip_broker = WiFi.localIP();
+
+  ESP8266WiFiClass::selectInstance(2);
+  MqttClient subscriber("sub");
+  subscriber.connect(ip_broker.toString().c_str(), 1883);
+  subscriber.setCallback(onPublish);
+  subscriber.setStreamCallback(onStream, 100);
+
+  ESP8266WiFiClass::selectInstance(3);
+  MqttClient publisher("pub");
+  publisher.connect(ip_broker.toString().c_str(), 1883);
+
+  for (int i =0; i<3; i++) { broker.loop(); subscriber.loop(); publisher.loop(); }
+  subscriber.subscribe("a/b");
+  for (int i =0; i<3; i++) { broker.loop(); subscriber.loop(); publisher.loop(); }
+
+  std::string sent;
+  for(int i=0; i<50000; i++)
+    sent += char('a'+i%26);
+
+  streamed.clear();
+  assertEqual(publisher.publish("a/b", sent.c_str(), sent.length()), MqttOk);
+  publisher.publish("a/b", "small");
+
+  for (int i =0; i<3; i++) { broker.loop(); subscriber.loop(); publisher.loop(); }
+
+  assertEqual(streamed_length, sent.length());
+  assertTrue(streamed == sent);
+  assertEqual(published["sub"]["a/b"], 1);  // The small one
+  assertEqual(lastLength, (size_t)5);
+}
+
+static int coalesced_received = 0;
+void onCoalesced(const MqttClient*, const Topic&, const char*, size_t) { coalesced_received++; }
+
+test(broker_coalesces_writes_of_a_loop)
+{
+  const size_t frame_length = 8;  // Publish a/b x
+  int batches = 0;
+  NetworkObserver check(
+    [&batches, frame_length](const WiFiClient*, const uint8_t* buffer, size_t length)
+    {
+      if (buffer[0] == MqttMessage::Publish and length == 10*frame_length) batches++;
+    }
+  );
+
+  start_many_wifi_esp(3, true);
+  MqttBroker broker(1883);
+  broker.begin();
+  IPAddress ip_broker = WiFi.localIP();
+
+  ESP8266WiFiClass::selectInstance(2);
+  MqttClient subscriber("sub");
+  subscriber.connect(ip_broker.toString().c_str(), 1883);
+  subscriber.setCallback(onCoalesced);
+
+  ESP8266WiFiClass::selectInstance(3);
+  MqttClient publisher("pub");
+  publisher.connect(ip_broker.toString().c_str(), 1883);
+
+  for (int i =0; i<3; i++) { broker.loop(); subscriber.loop(); publisher.loop(); }
+  subscriber.subscribe("a/b");
+  for (int i =0; i<3; i++) { broker.loop(); subscriber.loop(); publisher.loop(); }
+
+  coalesced_received = 0;
+  for(int i=0; i<10; i++) publisher.publish("a/b", "x");
+  broker.loop();  // one loop processes the 10 publishes
+  subscriber.loop();
+
+  assertEqual(batches, 1);
+  assertEqual(coalesced_received, 10);
+  assertEqual(broker.getClients()[0]->outputPending(), (size_t)0);
+}
+
 test(client_should_unregister_when_destroyed)
 {
   assertEqual(broker.clientsCount(), (size_t)0);
@@ -692,6 +875,656 @@ test(connack)
   assertEqual(MqttClient::counters[MqttMessage::Type::SubAck], 1);
 }
 
+test(persistent_session_resumes_subscriptions_and_missed_publishes)
+{
+  published.clear();
+  start_many_wifi_esp(2, true);
+  assertEqual(WiFi.status(), WL_CONNECTED);
+
+  MqttBroker broker(1883);
+  broker.sessions(60);
+  broker.begin();
+  IPAddress broker_ip = WiFi.localIP();
+  MqttClient publisher(&broker, "pub");
+
+  ESP8266WiFiClass::selectInstance(2);
+  MqttClient device("device");
+  device.setCallback(onPublish);
+  device.connect(broker_ip, 1883);
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  assertFalse(device.sessionPresent());
+  device.subscribe("s/#");
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+
+  device.close();
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  assertEqual(broker.clientsCount(), (size_t)1);   // publisher
+  assertEqual(broker.sessionsCount(), (size_t)1);
+
+  publisher.publish("s/a", "missed", 6, false, 1);
+  publisher.publish("s/b", "qos 0");                // not kept
+  publisher.publish("s/c", "missed too", 10, false, 1);
+  assertEqual(broker.session("device")->queued(), (size_t)2);
+
+  device.connect(broker_ip, 1883);
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  assertTrue(device.sessionPresent());
+  assertEqual(broker.sessionsCount(), (size_t)0);
+  assertEqual(published["device"].size(), (size_t)2);
+  assertEqual(published["device"]["s/a"], 1);
+  assertEqual(published["device"]["s/c"], 1);
+
+  // The broker kept the subscriptions, the client did not subscribe again
+  publisher.publish("s/d", "live");
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  assertEqual(published["device"]["s/d"], 1);
+}
+
+test(persistent_session_expires_or_is_cleaned)
+{
+  published.clear();
+  start_many_wifi_esp(2, true);
+  assertEqual(WiFi.status(), WL_CONNECTED);
+
+  MqttBroker broker(1883);
+  broker.sessions(10, 2);
+  broker.begin();
+  IPAddress broker_ip = WiFi.localIP();
+  MqttClient publisher(&broker, "pub");
+
+  ESP8266WiFiClass::selectInstance(2);
+  MqttClient device("device");
+  device.connect(broker_ip, 1883);
+  device.subscribe("s/#");
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  device.close();
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  assertEqual(broker.sessionsCount(), (size_t)1);
+
+  // Bounded queue, the oldest are dropped
+  for(int i=0; i<5; i++) publisher.publish("s/a", "missed", 6, false, 1);
+  assertEqual(broker.session("device")->queued(), (size_t)2);
+  assertEqual(broker.session("device")->dropped(), (uint32_t)3);
+
+  // Clean session discards it
+  device.cleanSession(true);
+  device.connect(broker_ip, 1883);
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  assertFalse(device.sessionPresent());
+  device.close();
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  assertEqual(broker.sessionsCount(), (size_t)0);
+
+  // Expiry
+  device.cleanSession(false);
+  device.connect(broker_ip, 1883);
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  device.close();
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  assertEqual(broker.sessionsCount(), (size_t)1);
+  EpoxyTest::add_seconds(11);
+  broker.loop();
+  assertEqual(broker.sessionsCount(), (size_t)0);
+}
+
+test(persistent_session_long_expiry)
+{
+  start_many_wifi_esp(2, true);
+  MqttBroker broker(1883);
+  broker.sessions(30*24*3600);   // more than the timers can wait: about 24 days
+  broker.begin();
+  IPAddress broker_ip = WiFi.localIP();
+
+  ESP8266WiFiClass::selectInstance(2);
+  MqttClient device("device");
+  device.connect(broker_ip, 1883);
+  device.subscribe("s/#");
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  device.close();
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  assertEqual(broker.sessionsCount(), (size_t)1);
+
+  EpoxyTest::add_seconds(20*24*3600);
+  broker.loop();
+  assertEqual(broker.sessionsCount(), (size_t)1);
+  EpoxyTest::add_seconds(5*24*3600);
+  broker.loop();
+  assertEqual(broker.sessionsCount(), (size_t)0);
+}
+
+#if TINY_MQTT_FILE_STORE
+test(persistent_session_survives_a_restart)
+{
+  const char* store_path = "/tmp/tinymqtt-network-store";
+  remove((string(store_path)+".snap").c_str());
+  remove((string(store_path)+".log").c_str());
+  published.clear();
+  start_many_wifi_esp(2, true);
+  assertEqual(WiFi.status(), WL_CONNECTED);
+  IPAddress broker_ip = WiFi.localIP();
+
+  MqttClient device("device");
+  device.setCallback(onPublish);
+  {
+    MqttFileStore store(store_path);
+    MqttBroker broker(1883);
+    broker.sessions(60);
+    broker.persist(&store);
+    broker.begin();
+    ESP8266WiFiClass::selectInstance(2);
+    device.connect(broker_ip, 1883);
+    device.subscribe("s/#");
+    device.subscribe("t/+", 1);
+    for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+    device.unsubscribe("t/+");
+    for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+    assertTrue(broker.compact());
+    device.close();
+    for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  }
+
+  ESP8266WiFiClass::selectInstance(1);
+  MqttFileStore store(store_path);
+  MqttBroker broker(1883);
+  broker.sessions(60);
+  broker.persist(&store);
+  broker.begin();
+  assertEqual(broker.sessionsCount(), (size_t)1);
+  assertEqual(broker.session("device")->getSubscriptions().size(), (size_t)1);
+
+  ESP8266WiFiClass::selectInstance(2);
+  device.connect(broker_ip, 1883);
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  assertTrue(device.sessionPresent());
+  MqttClient publisher(&broker, "pub");
+  publisher.publish("s/a", "after restart");
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  assertEqual(published["device"]["s/a"], 1);
+
+  // A clean session ends it in the store too
+  device.close();
+  device.cleanSession(true);
+  device.connect(broker_ip, 1883);
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  store.sync(true);
+  ESP8266WiFiClass::selectInstance(1);
+  MqttFileStore again(store_path);
+  MqttBroker restarted(1883);
+  restarted.sessions(60);
+  restarted.persist(&again);
+  restarted.begin();
+  assertEqual(restarted.sessionsCount(), (size_t)0);
+}
+#endif
+
+MqttClient* brokerSideOf(MqttBroker& broker, const char* id)
+{
+  for(auto client: broker.getClients())
+    if (client->id() == id and not client->isLocal()) return client;
+  return nullptr;
+}
+
+static MqttClient* stream_local = nullptr;
+static int stream_local_publishes = 0;
+void onStreamPublishes(const MqttClient*, const Topic&, const char*, size_t, size_t offset, size_t)
+{
+  if (offset == 0) return;  // the network subscriber may not stream yet
+  for(; stream_local_publishes < 20; stream_local_publishes++)
+    stream_local->publish("a/b", "published while streaming");
+}
+
+test(messages_written_during_a_stream_are_bounded)
+{
+  start_many_wifi_esp(3, true);
+  published.clear();
+  MqttBroker broker(1883);
+  broker.streaming(128);
+  broker.begin();
+  IPAddress ip_broker = WiFi.localIP();
+
+  // Publishes while the stream is forwarded to sub
+  MqttClient local(&broker, "local");
+  local.subscribe("a/b");
+  local.setStreamCallback(onStreamPublishes, 128);
+  stream_local = &local;
+  stream_local_publishes = 0;
+
+  ESP8266WiFiClass::selectInstance(2);
+  MqttClient subscriber("sub");
+  subscriber.connect(ip_broker.toString().c_str(), 1883);
+  subscriber.setCallback(onPublish);
+  subscriber.setStreamCallback(onStream, 100);
+
+  ESP8266WiFiClass::selectInstance(3);
+  MqttClient publisher("pub");
+  publisher.connect(ip_broker.toString().c_str(), 1883);
+
+  for (int i =0; i<3; i++) { broker.loop(); subscriber.loop(); publisher.loop(); }
+  subscriber.subscribe("a/b");
+  for (int i =0; i<3; i++) { broker.loop(); subscriber.loop(); publisher.loop(); }
+  MqttClient* sub = brokerSideOf(broker, "sub");
+  assertTrue(sub != nullptr);
+  sub->outputQueue(200);
+
+  std::string sent(5000, 's');
+  streamed.clear();
+  published.clear();
+  publisher.publish("a/b", sent.c_str(), sent.length());
+  for (int i =0; i<3; i++) { broker.loop(); subscriber.loop(); publisher.loop(); }
+
+  // The stream is intact, the messages that did not fit were dropped
+  assertEqual(stream_local_publishes, 20);
+  assertTrue(streamed == sent);
+  assertTrue(published["sub"]["a/b"] > 0);
+  assertTrue(published["sub"]["a/b"] < 20);
+  assertTrue(sub->outputDropped() > 0);
+  assertTrue(subscriber.connected());
+}
+
+// Connects a raw client with a one letter id
+static void rawConnect(WiFiClient& raw, const IPAddress& ip, char id)
+{
+  raw.connect(ip, 1883);
+  const char connect[] = { 0x10, 13, 0, 4, 'M', 'Q', 'T', 'T', 4, 2, 0, 60, 0, 1, id };
+  raw.write(connect, sizeof(connect));
+}
+
+// Header of a publish on a/b, 128 <= payload_length < 16384
+static std::string rawPublishHeader(uint8_t flags, uint16_t id, size_t payload_length)
+{
+  std::string header;
+  header += char(MqttMessage::Publish | flags);
+  header += char(0x80 | ((7+payload_length) & 0x7F));
+  header += char((7+payload_length) >> 7);
+  header += std::string("\0\3a/b", 5);
+  header += char(id >> 8);
+  header += char(id & 0xFF);
+  return header;
+}
+
+test(streamed_publish_is_forwarded_with_qos0)
+{
+  int publisher_headers = 0;
+  int qos0_headers = 0;
+  NetworkObserver check(
+    [&publisher_headers, &qos0_headers](const WiFiClient*, const uint8_t* buffer, size_t)
+    {
+      if (buffer[0] == (MqttMessage::Publish | 0x3)) publisher_headers++;  // qos 1, retain
+      if (buffer[0] == MqttMessage::Publish) qos0_headers++;
+    }
+  );
+
+  start_many_wifi_esp(3, true);
+  MqttBroker broker(1883);
+  broker.streaming(128);
+  broker.begin();
+  IPAddress ip_broker = WiFi.localIP();
+
+  ESP8266WiFiClass::selectInstance(2);
+  MqttClient subscriber("sub");
+  subscriber.connect(ip_broker.toString().c_str(), 1883);
+  subscriber.setStreamCallback(onStream, 100);
+
+  // Raw client, MqttClient does not publish that big with qos 1
+  ESP8266WiFiClass::selectInstance(3);
+  WiFiClient raw;
+  rawConnect(raw, ip_broker, 'r');
+
+  for (int i =0; i<3; i++) { broker.loop(); subscriber.loop(); }
+  subscriber.subscribe("a/b", 1);
+  for (int i =0; i<3; i++) { broker.loop(); subscriber.loop(); }
+
+  std::string sent(1000, 'q');
+  std::string publish = rawPublishHeader(0x3, 0x4242, sent.length()) + sent;
+  streamed.clear();
+  raw.write(publish.c_str(), publish.length());
+  for (int i =0; i<3; i++) { broker.loop(); subscriber.loop(); }
+
+  assertTrue(streamed == sent);
+  assertEqual(publisher_headers, 1);
+  assertEqual(qos0_headers, 1);
+}
+
+test(streamed_publish_skipped_by_a_busy_subscriber_is_not_acknowledged)
+{
+  std::set<uint16_t> acked;
+  NetworkObserver check(
+    [&acked](const WiFiClient*, const uint8_t* buffer, size_t length)
+    {
+      if (buffer[0] == MqttMessage::PubAck and length >= 4) acked.insert((buffer[2] << 8) | buffer[3]);
+    }
+  );
+
+  start_many_wifi_esp(3, true);
+  MqttBroker broker(1883);
+  broker.streaming(128);
+  broker.begin();
+  IPAddress ip_broker = WiFi.localIP();
+
+  ESP8266WiFiClass::selectInstance(2);
+  MqttClient subscriber("sub");
+  subscriber.connect(ip_broker.toString().c_str(), 1883);
+  subscriber.setStreamCallback(onStream, 100);
+
+  ESP8266WiFiClass::selectInstance(3);
+  WiFiClient first;
+  WiFiClient second;
+  rawConnect(first, ip_broker, '1');
+  rawConnect(second, ip_broker, '2');
+
+  for (int i =0; i<3; i++) { broker.loop(); subscriber.loop(); }
+  subscriber.subscribe("a/b");
+  for (int i =0; i<3; i++) { broker.loop(); subscriber.loop(); }
+
+  // sub streams the first publish when the second one arrives
+  std::string sent(1000, '1');
+  std::string publish = rawPublishHeader(0x2, 0x0101, sent.length()) + sent;
+  streamed.clear();
+  first.write(publish.c_str(), publish.length()/2);
+  for (int i =0; i<3; i++) { broker.loop(); subscriber.loop(); }
+  std::string other = rawPublishHeader(0x2, 0x0202, 500) + std::string(500, '2');
+  second.write(other.c_str(), other.length());
+  for (int i =0; i<3; i++) { broker.loop(); subscriber.loop(); }
+  first.write(publish.c_str()+publish.length()/2, publish.length()-publish.length()/2);
+  for (int i =0; i<3; i++) { broker.loop(); subscriber.loop(); }
+
+  assertTrue(streamed == sent);
+  MqttClient* sub = brokerSideOf(broker, "sub");
+  assertTrue(sub != nullptr);
+  assertEqual(sub->outputDropped(), (uint32_t)1);
+  assertEqual(acked.count(0x0101), (size_t)1);
+  assertEqual(acked.count(0x0202), (size_t)0);   // will be sent again
+}
+
+test(qos1_publishes_are_pipelined_and_acknowledged)
+{
+  int granted = -1;
+  int qos1_publishes = 0;
+  NetworkObserver check(
+    [&granted, &qos1_publishes](const WiFiClient*, const uint8_t* buffer, size_t length)
+    {
+      if (buffer[0] == MqttMessage::SubAck) granted = buffer[length-1];
+      for(size_t i=0; i+1<length; i++)   // Messages may be coalesced, 0x32 is not in the payloads
+        if (buffer[i] == (MqttMessage::Publish | 2)) qos1_publishes++;
+    }
+  );
+
+  published.clear();
+  start_many_wifi_esp(2, true);
+  MqttBroker broker(1883);
+  broker.begin();
+  IPAddress broker_ip = WiFi.localIP();
+  MqttClient publisher(&broker, "pub");
+
+  ESP8266WiFiClass::selectInstance(2);
+  MqttClient device("device");
+  device.setCallback(onPublish);
+  device.connect(broker_ip, 1883);
+  device.subscribe("q/#", 1);
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  assertEqual(granted, 1);
+
+  MqttClient* link = brokerSideOf(broker, "device");
+  assertTrue(link != nullptr);
+  link->inflight(2);
+
+  for(int i=0; i<5; i++) publisher.publish("q/a", "qos1", 4, false, 1);
+  publisher.publish("q/b", "qos0");
+  assertEqual(link->inflightCount(), (size_t)2);   // the others wait for acks
+  assertEqual(qos1_publishes, 2);
+
+  for(int i=0; i<8; i++) { broker.loop(); device.loop(); };
+  assertEqual(published["device"]["q/a"], 5);
+  assertEqual(published["device"]["q/b"], 1);
+  assertEqual(qos1_publishes, 5);
+  assertEqual(link->inflightCount(), (size_t)0);
+  assertEqual(link->retransmissions(), (uint32_t)0);
+}
+
+test(qos1_publish_is_refused_when_too_many_wait)
+{
+  published.clear();
+  start_many_wifi_esp(2, true);
+  MqttBroker broker(1883);
+  broker.begin();
+  IPAddress broker_ip = WiFi.localIP();
+  MqttClient subscriber(&broker, "sub");
+  subscriber.setCallback(onPublish);
+  subscriber.subscribe("w/#");
+
+  ESP8266WiFiClass::selectInstance(2);
+  MqttClient device("device");
+  device.connect(broker_ip, 1883);
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  device.inflight(1, 2);
+
+  // One sent, two wait, the next one is refused (none dropped)
+  for(int i=0; i<3; i++) assertTrue(device.publish("w/a", "qos1", 4, false, 1) == MqttOk);
+  assertTrue(device.publish("w/a", "qos1", 4, false, 1) == MqttWouldBlock);
+  assertEqual(device.publishSequence(), (uint32_t)3);
+
+  // Too big to be kept for a retransmission
+  std::string big(MqttMessage::MaxBufferLength+1, 'b');
+  assertTrue(device.publish("w/b", big.c_str(), big.length(), false, 1) == MqttInvalidMessage);
+
+  for(int i=0; i<8; i++) { broker.loop(); device.loop(); };
+  assertEqual(published["sub"]["w/a"], 3);
+  assertEqual(published["sub"]["w/b"], 0);
+  assertEqual(device.inflightCount(), (size_t)0);
+}
+
+test(qos1_unacknowledged_publish_is_sent_again)
+{
+  int dup_publishes = 0;
+  NetworkObserver check(
+    [&dup_publishes](const WiFiClient*, const uint8_t* buffer, size_t)
+    {
+      if (buffer[0] == (MqttMessage::Publish | 8 | 2)) dup_publishes++;
+    }
+  );
+
+  published.clear();
+  start_many_wifi_esp(2, true);
+  MqttBroker broker(1883);
+  broker.begin();
+  IPAddress broker_ip = WiFi.localIP();
+  MqttClient publisher(&broker, "pub");
+
+  ESP8266WiFiClass::selectInstance(2);
+  MqttClient device("device");
+  device.setCallback(onPublish);
+  device.connect(broker_ip, 1883);
+  device.subscribe("q/#", 1);
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  MqttClient* link = brokerSideOf(broker, "device");
+  assertTrue(link != nullptr);
+
+  publisher.publish("q/a", "lost ack", 8, false, 1);
+  assertEqual(link->inflightCount(), (size_t)1);
+
+  // The device does not read, so does not ack
+  EpoxyTest::add_seconds(TINY_MQTT_RETRY_MS/2000);
+  broker.loop();
+  assertEqual(dup_publishes, 0);
+  EpoxyTest::add_seconds(TINY_MQTT_RETRY_MS/2000);
+  broker.loop();
+  assertEqual(dup_publishes, 1);
+  assertEqual(link->retransmissions(), (uint32_t)1);
+
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  assertEqual(published["device"]["q/a"], 2);   // at least once
+  assertEqual(link->inflightCount(), (size_t)0);
+}
+
+test(qos2_publish_sent_again_is_delivered_once)
+{
+  int granted = -1;
+  int dup_publishes = 0;
+  std::map<int, int> acks;  // by message type
+  NetworkObserver check(
+    [&granted, &dup_publishes, &acks](const WiFiClient*, const uint8_t* buffer, size_t length)
+    {
+      if (buffer[0] == MqttMessage::SubAck) granted = buffer[length-1];
+      if (buffer[0] == (MqttMessage::Publish | 8 | 4)) dup_publishes++;
+      for(size_t i=0; i+3<length; i+=4)   // Acks may be coalesced
+        if (buffer[i+1] == 2 and buffer[i] >= MqttMessage::PubRec and buffer[i] <= (MqttMessage::PubComp | 2))
+          acks[buffer[i] & 0xF0]++;
+    }
+  );
+
+  published.clear();
+  start_many_wifi_esp(2, true);
+  MqttBroker broker(1883);
+  broker.begin();
+  IPAddress broker_ip = WiFi.localIP();
+  MqttClient publisher(&broker, "pub");
+
+  ESP8266WiFiClass::selectInstance(2);
+  MqttClient device("device");
+  device.setCallback(onPublish);
+  device.connect(broker_ip, 1883);
+  device.subscribe("meter/#", 2);
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  assertEqual(granted, 2);
+  MqttClient* link = brokerSideOf(broker, "device");
+  assertTrue(link != nullptr);
+
+  publisher.publish("meter/kwh", "1234", 4, false, 2);
+  assertEqual(link->inflightCount(), (size_t)1);
+
+  // The device does not read, the publish is sent again
+  EpoxyTest::add_seconds(TINY_MQTT_RETRY_MS/1000);
+  broker.loop();
+  assertEqual(dup_publishes, 1);
+
+  for(int i=0; i<6; i++) { broker.loop(); device.loop(); };
+  assertEqual(published["device"]["meter/kwh"], 1);   // exactly once
+  assertEqual(acks[MqttMessage::PubRec], 2);
+  assertEqual(acks[MqttMessage::PubRel], 2);
+  assertEqual(acks[MqttMessage::PubComp], 2);
+  assertEqual(link->inflightCount(), (size_t)0);
+  assertEqual(device.receivedCount(), (size_t)0);
+}
+
+test(qos2_client_publish_is_received_once_by_the_broker)
+{
+  published.clear();
+  start_many_wifi_esp(2, true);
+  MqttBroker broker(1883);
+  broker.begin();
+  IPAddress broker_ip = WiFi.localIP();
+  MqttClient counter(&broker, "counter");
+  counter.setCallback(onPublish);
+  counter.subscribe("meter/#");
+
+  ESP8266WiFiClass::selectInstance(2);
+  MqttClient device("device");
+  device.connect(broker_ip, 1883);
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+
+  assertEqual(device.publish("meter/kwh", "1234", 4, false, 2), MqttOk);
+  assertEqual(device.inflightCount(), (size_t)1);
+
+  // Not read by the broker yet, the device sends it again
+  EpoxyTest::add_seconds(TINY_MQTT_RETRY_MS/1000);
+  device.loop();
+  assertEqual(device.retransmissions(), (uint32_t)1);
+
+  for(int i=0; i<6; i++) { broker.loop(); device.loop(); };
+  assertEqual(published["counter"]["meter/kwh"], 1);
+  assertEqual(device.inflightCount(), (size_t)0);
+  MqttClient* link = brokerSideOf(broker, "device");
+  assertTrue(link != nullptr);
+  assertEqual(link->receivedCount(), (size_t)0);
+}
+
+test(keep_alive_timeout_closes_silent_client)
+{
+  start_many_wifi_esp(2, true);
+  MqttBroker broker(1883);
+  broker.begin();
+  IPAddress broker_ip = WiFi.localIP();
+
+  ESP8266WiFiClass::selectInstance(2);
+  MqttClient device("device");
+  device.connect(broker_ip, 1883);
+  for(int i=0; i<4; i++) { broker.loop(); device.loop(); };
+  assertEqual(broker.clientsCount(), (size_t)1);
+
+  // The device does not loop anymore, its keep alive expires (500s with EpoxyDuino)
+  EpoxyTest::add_seconds(500);
+  broker.loop();
+  broker.loop();
+  assertEqual(broker.clientsCount(), (size_t)0);
+}
+
+test(dead_clients_are_all_removed_by_one_loop)
+{
+  assertEqual(MqttClient::instances, 0);
+  {
+    start_many_wifi_esp(2, true);
+    MqttBroker broker(1883);
+    broker.begin();
+    IPAddress broker_ip = WiFi.localIP();
+    MqttClient local(&broker, "local");
+
+    ESP8266WiFiClass::selectInstance(2);
+    std::vector<MqttClient*> devices;
+    for(int i=0; i<10; i++)
+    {
+      devices.push_back(new MqttClient(string("device")+std::to_string(i).c_str()));
+      devices.back()->connect(broker_ip, 1883);
+      broker.loop();
+    }
+    for(auto device: devices) device->loop();
+    broker.loop();
+    assertEqual(broker.clientsCount(), (size_t)11);
+    assertTrue(broker.client("device3") != nullptr);
+    assertTrue(broker.client("local") == nullptr);   // only network clients
+
+    // Every other device is lost
+    for(size_t i=0; i<devices.size(); i+=2) devices[i]->close(false);
+    broker.loop();
+    assertEqual(broker.clientsCount(), (size_t)6);
+    assertTrue(broker.client("device2") == nullptr);
+    assertTrue(broker.client("device3") != nullptr);
+    for(auto device: devices) delete device;
+    broker.loop();
+    assertEqual(broker.clientsCount(), (size_t)1);
+    assertEqual(MqttClient::instances, 1);
+  }
+  assertEqual(MqttClient::instances, 0);
+}
+
+test(duplicate_client_id_takes_over)
+{
+  start_many_wifi_esp(3, true);
+  MqttBroker broker(1883);
+  broker.sessions(60);
+  broker.begin();
+  IPAddress broker_ip = WiFi.localIP();
+
+  ESP8266WiFiClass::selectInstance(2);
+  MqttClient first("meter");
+  first.connect(broker_ip, 1883);
+  first.subscribe("cmd/#", 1);
+  for(int i=0; i<4; i++) { broker.loop(); first.loop(); };
+  const MqttClient* link = broker.client("meter");
+  assertTrue(link != nullptr);
+
+  ESP8266WiFiClass::selectInstance(3);
+  MqttClient second("meter");
+  second.connect(broker_ip, 1883);
+  for(int i=0; i<4; i++) { broker.loop(); first.loop(); second.loop(); };
+
+  assertEqual(broker.clientsCount(), (size_t)1);
+  assertTrue(broker.client("meter") != nullptr);
+  assertTrue(broker.client("meter") != link);
+  assertTrue(second.sessionPresent());   // the session of the first connection
+  assertTrue(broker.client("meter")->isSubscribedTo("cmd/reboot"));
+  assertFalse(first.connected());
+}
+
 //----------------------------------------------------------------------------
 // setup() and loop()
 void setup() {
@@ -2,7 +2,10 @@
 #include <Arduino.h>
 #include <AUnit.h>
 #include <TinyMqtt.h>
+#include <signal.h>
+#include <sys/resource.h>
 #include <map>
+#include <vector>
 
 /**
   * TinyMqtt nowifi unit tests.
@@ -30,6 +33,10 @@ void onPublish(const MqttClient* srce, const Topic& topic, const char* payload,
   lastLength = length;
 }
 
+// Counts publishes whatever their topic
+static int publish_count = 0;
+void onCount(const MqttClient*, const Topic&, const char*, size_t) { publish_count++; }
+
 test(nowifi_client_should_unregister_when_destroyed)
 {
   assertEqual(broker.clientsCount(), (size_t)0);
@@ -192,6 +199,51 @@ test(nowifi_unsubscribe_with_wildcards)
   assertEqual(published["A"]["one/two/five"], 0);
 }
 
+test(nowifi_overlapping_subscriptions_receive_once)
+{
+  MqttClient subscriber(&broker, "overlap");
+  subscriber.setCallback(onCount);
+  subscriber.subscribe("home/+/temp");
+  subscriber.subscribe("home/#");
+  subscriber.subscribe("home/kitchen/temp");
+
+  MqttClient publisher(&broker);
+  publish_count = 0;
+  publisher.publish("home/kitchen/temp");
+  assertEqual(publish_count, 1);
+
+  subscriber.unsubscribe("home/#");
+  subscriber.unsubscribe("home/+/temp");
+  publisher.publish("home/kitchen/temp");
+  publisher.publish("home/kitchen/light");
+  assertEqual(publish_count, 2);
+}
+
+test(nowifi_subscribe_fails_when_levels_are_not_indexed)
+{
+  MqttClient subscriber(&broker, "levels");
+  subscriber.setCallback(onCount);
+  MqttClient publisher(&broker);
+
+  // One index left: the topic is indexed, not its levels
+  std::vector<IndexedString> fill;
+  for(int i=0; StringIndexer::count() < StringIndexer::MaxIndex-1; i++)
+    fill.push_back(IndexedString(string("fill")+std::to_string(i).c_str()));
+  Topic topic("lv/x");
+  assertTrue(topic.valid());
+  assertTrue(topic.levels().empty());
+  assertTrue(subscriber.subscribe(topic) == MqttInvalidMessage);
+
+  fill.clear();
+  assertEqual(topic.levels().size(), (size_t)2);  // the failed split was not kept
+  publish_count = 0;
+  publisher.publish(topic);
+  assertEqual(publish_count, 0);  // was not subscribed
+  assertTrue(subscriber.subscribe(topic) != MqttInvalidMessage);
+  publisher.publish(topic);
+  assertEqual(publish_count, 1);
+}
+
 test(nowifi_unsubscribe)
 {
   published.clear();
@@ -265,6 +317,590 @@ test(nowifi_hudge_payload)
   assertEqual(lastLength, strlen(payload));
 }
 
+test(nowifi_parse_many_messages_from_one_chunk)
+{
+  // PingReq, Publish(a/b, "xy"), PingReq in one buffer
+  const char stream[] = { '\xC0', 0, '\x30', 7, 0, 3, 'a', '/', 'b', 'x', 'y', '\xC0', 0 };
+  std::vector<MqttMessage::Type> types;
+  MqttMessage msg;
+
+  size_t pos=0;
+  while(pos < sizeof(stream))
+  {
+    pos += msg.incoming(stream+pos, sizeof(stream)-pos);
+    if (msg.type())
+    {
+      types.push_back(msg.type());
+      if (msg.type() == MqttMessage::Publish)
+      {
+        assertEqual(msg.end()-msg.getVHeader(), 7);
+        assertEqual(strncmp(msg.end()-2, "xy", 2), 0);
+      }
+      msg.reset();
+    }
+  }
+  assertEqual(types.size(), (size_t)3);
+  assertEqual(types[0], MqttMessage::PingReq);
+  assertEqual(types[1], MqttMessage::Publish);
+  assertEqual(types[2], MqttMessage::PingReq);
+}
+
+test(nowifi_parse_message_split_across_chunks)
+{
+  const char stream[] = { '\x30', 7, 0, 3, 'a', '/', 'b', 'x', 'y' };
+  MqttMessage msg;
+
+  for(size_t i=0; i<sizeof(stream); i++)
+  {
+    assertEqual(msg.type(), MqttMessage::Unknown);
+    assertEqual(msg.incoming(stream+i, 1), (size_t)1);
+  }
+  assertEqual(msg.type(), MqttMessage::Publish);
+  assertEqual(msg.end()-msg.getVHeader(), 7);
+}
+
+test(nowifi_encode_remaining_length)
+{
+  char length[4];
+  assertEqual(MqttMessage::encodeLength(0, length), 1);
+  assertEqual(MqttMessage::encodeLength(127, length), 1);
+  assertEqual(MqttMessage::encodeLength(128, length), 2);
+  assertEqual(MqttMessage::encodeLength(16383, length), 2);
+  assertEqual(MqttMessage::encodeLength(16384, length), 3);
+  assertEqual(MqttMessage::encodeLength(2097152, length), 4);
+  assertEqual(MqttMessage::encodeLength(MqttMessage::MaxRemainingLength, length), 4);
+  assertEqual(memcmp(length, "\xFF\xFF\xFF\x7F", 4), 0);
+
+  // Decoding
+  MqttMessage msg;
+  const char header[] = { '\x30', '\xFF', '\xFF', '\xFF', '\x7F' };
+  msg.stream(64);
+  msg.incoming(header, sizeof(header));
+  assertEqual(msg.remainingLength(), MqttMessage::MaxRemainingLength);
+}
+
+test(nowifi_too_long_message_is_skipped)
+{
+  std::string stream;
+  stream += '\x30';
+  stream += "\x80\x80\x01";  // 16384 bytes
+  stream.append(16384, 'x');
+  stream += "\xC0";  // PingReq
+  stream += '\0';
+
+  MqttMessage msg;
+  std::vector<MqttMessage::Type> types;
+  size_t pos = 0;
+  while(pos < stream.size())
+  {
+    pos += msg.incoming(stream.data()+pos, stream.size()-pos);
+    if (msg.type())
+    {
+      types.push_back(msg.type());
+      msg.reset();
+    }
+  }
+  assertEqual(types.size(), (size_t)1);
+  assertEqual(types[0], MqttMessage::PingReq);
+}
+
+test(nowifi_streamed_publish_is_received_by_chunks)
+{
+  std::string stream;
+  stream += '\x32';      // Publish qos 1
+  stream += "\xED\x07";  // 1005 bytes
+  stream += '\0';
+  stream += '\x01';
+  stream += 'a';        // topic a
+  stream += "\x12\x34";  // packet id
+  for(int i=0; i<1000; i++) stream += char('a'+i%26);
+
+  MqttMessage msg;
+  msg.stream(64);
+  std::string payload;
+  int chunks = 0;
+  size_t pos = 0;
+  while(pos < stream.size())
+  {
+    pos += msg.incoming(stream.data()+pos, std::min(stream.size()-pos, (size_t)100));
+    assertEqual(msg.type(), MqttMessage::Unknown);
+    if (msg.isChunk())
+    {
+      assertEqual(msg.chunkOffset(), (uint32_t)payload.length());
+      assertEqual(msg.payloadLength(), (uint32_t)1000);
+      assertEqual(msg.headerLength(), (size_t)8);
+      payload.append(msg.chunk(), msg.chunkLength());
+      chunks++;
+      if (msg.lastChunk()) assertEqual(pos, stream.size());
+      msg.nextChunk();
+    }
+  }
+  assertEqual(chunks, 16);
+  assertTrue(payload == stream.substr(8));
+}
+
+test(nowifi_publish_with_three_bytes_length)
+{
+  std::string payload;
+  for(int i=0; i<20000; i++) payload += char('a'+i%26);
+
+  MqttClient subscriber(&broker);
+  subscriber.setCallback(onPublish);
+  subscriber.subscribe("a/b");
+
+  MqttClient publisher(&broker);
+  publisher.publish("a/b", payload.c_str(), payload.length());
+
+  assertEqual(lastLength, payload.length());
+  assertEqual(strncmp(lastPayload, payload.c_str(), payload.length()), 0);
+}
+
+test(nowifi_frame_is_shared_not_copied)
+{
+  MqttMessage msg(MqttMessage::Publish);
+  msg.add(Topic("a/b"));
+  msg.add("xy", 2, false);
+
+  const MqttFrame& frame = msg.frame();
+  assertEqual(frame.refs(), (uint32_t)1);
+  assertEqual(frame.size(), (size_t)9);
+  {
+    MqttFrame copy(frame);
+    MqttMessage view(copy);
+    assertEqual(frame.refs(), (uint32_t)3);
+    assertEqual(view.type(), MqttMessage::Publish);
+    assertTrue(view.getVHeader() == msg.getVHeader());  // Same bytes
+    assertTrue(view.end() == msg.end());
+  }
+  assertEqual(frame.refs(), (uint32_t)1);
+}
+
+test(nowifi_steady_state_publish_does_not_malloc)
+{
+  MqttClient subscriber(&broker, "sub");
+  subscriber.setCallback(onCount);
+  subscriber.subscribe("pool/#");
+
+  MqttClient publisher(&broker, "pub");
+  string payload(200, 'x');
+  for(int i=0; i<5; i++) publisher.publish("pool/warm", payload);  // fill the pool
+
+  MqttBufferPool& pool = MqttBufferPool::get();
+  pool.resetStats();
+  publish_count = 0;
+  for(int i=0; i<100; i++) publisher.publish("pool/steady", payload);
+
+  assertEqual(publish_count, 100);
+  assertEqual(pool.stats().misses, (uint32_t)0);
+  assertEqual(pool.stats().hits, (uint32_t)0);   // local subscribers only: nothing encoded
+}
+
+static const char* received_payload = nullptr;
+static string received_text;    // up to the first 0
+void onPointer(const MqttClient*, const Topic&, const char* payload, size_t)
+{
+  received_payload = payload;
+  received_text = payload;
+}
+
+test(nowifi_local_publish_is_not_encoded)
+{
+  MqttBroker broker(1883);
+  MqttClient subscriber(&broker, "sub");
+  subscriber.setCallback(onPointer);
+  subscriber.subscribe("direct/#");
+  MqttClient publisher(&broker, "pub");
+
+  const char payload[] = "zero copy";
+  received_payload = nullptr;
+  publisher.publish("direct/a", payload);
+  assertTrue(received_payload == payload);    // the bytes of the publisher
+
+  // Not followed by a 0: copied to be
+  const char bytes[] = { 'a', 'b', 'c' };
+  publisher.publish("direct/b", bytes, 2, false, 1);
+  assertTrue(received_payload != bytes);
+  assertEqual(received_text.c_str(), "ab");
+
+  // Encoded when needed: retained message
+  broker.retain(4);
+  publisher.publish("direct/r", payload, true);
+  assertTrue(received_payload == payload);
+  assertEqual(broker.retainCount(), (uint32_t)1);
+  MqttClient late(&broker, "late");
+  late.setCallback(onPublish);
+  late.subscribe("direct/r");
+  assertEqual(lastLength, sizeof(payload)-1);
+  assertEqual(lastPayload, "zero copy");
+}
+
+test(nowifi_buffer_pool_size_classes)
+{
+  MqttBufferPool& pool = MqttBufferPool::get();
+  size_t capacity = 20;
+  char* block = pool.allocate(capacity);
+  assertEqual(capacity, (size_t)32);
+  pool.release(block, capacity);
+
+  capacity = 32;
+  assertTrue(pool.allocate(capacity) == block); // Recycled
+  pool.release(block, capacity);
+}
+
+// Gives the blocks of the default pool, or nothing when failing
+class FailingPool : public MqttBufferPool
+{
+  public:
+    FailingPool() : pool(MqttBufferPool::get()) { MqttBufferPool::set(this); }
+    ~FailingPool() { MqttBufferPool::set(&pool); }
+
+    char* allocate(size_t& capacity) override { return failing ? nullptr : pool.allocate(capacity); }
+    void release(char* block, size_t capacity) override { pool.release(block, capacity); }
+
+    bool failing = false;
+
+  private:
+    MqttBufferPool& pool;
+};
+
+test(nowifi_out_of_memory_keeps_the_buffers)
+{
+  FailingPool pool;
+  MqttBuffer buffer;
+  assertTrue(buffer.append("abc", 3));
+
+  pool.failing = true;
+  string big(100, 'x');
+  assertFalse(buffer.append(big.c_str(), big.length()));
+  assertEqual(buffer.c_str(), "abc");
+
+  MqttFrame frame(std::move(buffer));
+  assertFalse((bool)frame);
+  assertEqual(frame.size(), (size_t)0);
+  assertEqual(buffer.c_str(), "abc");   // not moved
+
+  MqttMessage msg(MqttMessage::Publish);
+  msg.add(Topic("oom/a"));
+  assertFalse((bool)msg.frame());
+}
+
+test(nowifi_out_of_memory_fails_the_message)
+{
+  MqttBroker broker(1883);
+  broker.retain(4);
+  MqttClient subscriber(&broker, "sub");
+  subscriber.setCallback(onPublish);
+  subscriber.subscribe("oom/#");
+  MqttClient publisher(&broker, "pub");
+
+  FailingPool pool;
+  pool.failing = true;
+  published.clear();
+  publisher.publish("oom/r", "not retained", true);
+  assertEqual(published["sub"]["oom/r"], 1);    // local subscribers do not need a frame
+  assertEqual(broker.retainCount(), (uint16_t)0);
+
+  pool.failing = false;
+  publisher.publish("oom/r", "retained", true);
+  assertEqual(broker.retainCount(), (uint16_t)1);
+}
+
+test(nowifi_retained_oldest_are_dropped_first)
+{
+  broker.retain(3);
+  MqttClient publisher(&broker, "pub");
+  publisher.publish("r/1", "one", true);
+  publisher.publish("r/2", "two", true);
+  publisher.publish("r/3", "three", true);
+  publisher.publish("r/1", "one again", true);  // r/1 is now the most recent
+  publisher.publish("r/4", "four", true);       // drops r/2
+  assertEqual(broker.retainCount(), (uint16_t)3);
+
+  published.clear();
+  MqttClient subscriber(&broker, "sub");
+  subscriber.setCallback(onPublish);
+  subscriber.subscribe("r/+");
+  assertEqual(published["sub"].size(), (size_t)3);
+  assertEqual(published["sub"].count("r/2"), (size_t)0);
+
+  // One byte less than the retained frames, drops r/3
+  broker.retainBytes(broker.getRetained().bytes()-1);
+  assertEqual(broker.retainCount(), (uint16_t)2);
+  assertEqual(broker.getRetained().evictions(), (uint32_t)2);
+
+  broker.retainBytes(0);
+  broker.retain(0);
+  assertEqual(broker.retainCount(), (uint16_t)0);
+}
+
+test(nowifi_retained_empty_payload_removes_message)
+{
+  broker.retain(10);
+  MqttClient publisher(&broker, "pub");
+  publisher.publish("r/gone", "here", true);
+  publisher.publish("r/kept", "here", true);
+  assertEqual(broker.retainCount(), (uint16_t)2);
+
+  publisher.publish("r/gone", "", true);
+  assertEqual(broker.retainCount(), (uint16_t)1);
+
+  published.clear();
+  MqttClient subscriber(&broker, "sub");
+  subscriber.setCallback(onPublish);
+  subscriber.subscribe("r/#");
+  assertEqual(published["sub"].size(), (size_t)1);
+  assertEqual(published["sub"]["r/kept"], 1);
+
+  broker.retain(0);
+}
+
+int retainedFor(const char* filter)
+{
+  MqttClient subscriber(&broker, "sub");
+  subscriber.setCallback(onCount);
+  publish_count = 0;
+  subscriber.subscribe(filter);
+  return publish_count;
+}
+
+test(nowifi_retained_wildcard_subscribe)
+{
+  broker.retain(10);
+  MqttClient publisher(&broker, "pub");
+  for(auto topic: { "w/a/x", "w/b/x", "w/b/y", "w/a/x/deep", "$SYS/w", "other" })
+    publisher.publish(topic, "retained", true);
+
+  assertEqual(retainedFor("w/a/x"), 1);
+  assertEqual(retainedFor("w/+/x"), 2);
+  assertEqual(retainedFor("w/#"), 4);
+  assertEqual(retainedFor("#"), 5);       // not $SYS/w
+  assertEqual(retainedFor("$SYS/#"), 1);
+  assertEqual(retainedFor("w/*/x"), 2);
+  assertEqual(retainedFor("*/x"), 2);     // Each topic once
+  assertEqual(retainedFor("*"), 5);
+  assertEqual(retainedFor("w/c/#"), 0);
+
+  broker.retain(0);
+}
+
+#if TINY_MQTT_FILE_STORE
+const char* store_path = "/tmp/tinymqtt-nowifi-store";
+
+void removeStore()
+{
+  remove((string(store_path)+".snap").c_str());
+  remove((string(store_path)+".log").c_str());
+}
+
+test(nowifi_retained_messages_are_restored)
+{
+  removeStore();
+  {
+    MqttFileStore store(store_path);
+    MqttBroker persistent(1884, 10);
+    persistent.persist(&store);
+    persistent.begin();
+
+    MqttClient publisher(&persistent, "pub");
+    publisher.publish("p/a", "first", true);
+    publisher.publish("p/b", "second", true);
+    publisher.publish("p/a", "", true);       // removed
+    publisher.publish("p/c", "third", true);
+    assertTrue(persistent.compact());
+    publisher.publish("p/d", "fourth", true);  // in the log only
+    store.sync(true);
+    assertEqual(store.stats().compactions, (uint32_t)1);
+  }
+
+  MqttFileStore store(store_path);
+  MqttBroker restored(1884, 10);
+  restored.persist(&store);
+  restored.begin();
+  assertEqual(restored.retainCount(), (uint32_t)3);
+
+  published.clear();
+  MqttClient subscriber(&restored, "sub");
+  subscriber.setCallback(onPublish);
+  subscriber.subscribe("p/#");
+  assertEqual(published["sub"].size(), (size_t)3);
+  assertEqual(published["sub"].count("p/a"), (size_t)0);
+  assertEqual(published["sub"]["p/d"], 1);
+
+  string order;   // oldest first, as before the restart
+  restored.getRetained().each([&order](const Topic& topic, const MqttFrame&) { order += topic.str(); });
+  assertEqual(order.c_str(), "p/bp/cp/d");
+}
+
+test(nowifi_torn_log_record_is_dropped)
+{
+  removeStore();
+  {
+    MqttFileStore store(store_path);
+    MqttBroker persistent(1884, 10);
+    persistent.persist(&store);
+    persistent.begin();
+    MqttClient publisher(&persistent, "pub");
+    publisher.publish("t/a", "saved", true);
+  }
+
+  // Crash while the next record was written
+  FILE* log = fopen((string(store_path)+".log").c_str(), "ab");
+  assertTrue(log != nullptr);
+  fwrite("\x01\x03\x00\x10\x00", 1, 5, log);
+  fclose(log);
+
+  MqttFileStore store(store_path);
+  MqttBroker restored(1884, 10);
+  restored.persist(&store);
+  restored.begin();
+  assertEqual(restored.retainCount(), (uint32_t)1);
+  assertEqual(store.stats().dropped, (uint32_t)1);
+
+  // The log is usable again
+  MqttClient publisher(&restored, "pub");
+  publisher.publish("t/b", "after", true);
+  store.sync(true);
+  MqttFileStore again(store_path);
+  assertTrue(again.load(nullptr, nullptr));
+  assertEqual(again.stats().dropped, (uint32_t)0);
+}
+
+test(nowifi_failed_log_write_is_not_torn)
+{
+  removeStore();
+  MqttFileStore store(store_path);
+  store.syncInterval(0);
+  MqttBroker persistent(1884, 10);
+  persistent.persist(&store);
+  persistent.begin();
+  MqttClient publisher(&persistent, "pub");
+  publisher.publish("f/a", "saved", true);
+  persistent.loop();
+  store.sync(true);
+  size_t durable = store.stats().log_bytes;
+
+  // The next write fails after some bytes (file size limit, like a full disk)
+  signal(SIGXFSZ, SIG_IGN);
+  struct rlimit old_limit, limit;
+  getrlimit(RLIMIT_FSIZE, &old_limit);
+  limit = old_limit;
+  limit.rlim_cur = durable+10;
+  setrlimit(RLIMIT_FSIZE, &limit);
+  publisher.publish("f/b", string(100, 'b').c_str(), true);
+  persistent.loop();
+  store.sync(true);
+  setrlimit(RLIMIT_FSIZE, &old_limit);
+  assertEqual(store.stats().log_bytes, durable);
+
+  publisher.publish("f/c", "after", true);
+  persistent.loop();
+  store.sync(true);
+
+  MqttFileStore again(store_path);
+  MqttBroker restored(1884, 10);
+  restored.persist(&again);
+  restored.begin();
+  assertEqual(again.stats().dropped, (uint32_t)0);
+  assertEqual(restored.retainCount(), (uint32_t)3);
+}
+#endif
+
+test(nowifi_qos2_received_ids)
+{
+  MqttReceived received;
+  assertEqual(received.mark(1), MqttReceived::New);
+  assertEqual(received.mark(1), MqttReceived::Duplicate);
+  assertEqual(received.mark(300), MqttReceived::New);
+  assertEqual(received.mark(255), MqttReceived::New);
+  assertEqual(received.size(), (size_t)3);
+#if TINY_MQTT_QOS2_PAGES == 2
+  assertFalse(received.canMark(0x8000));
+  assertEqual(received.mark(0x8000), MqttReceived::Full);   // no free page
+#endif
+  assertTrue(received.canMark(2));    // page of 1 and 255
+
+  assertTrue(received.release(1));
+  assertFalse(received.release(1));
+  assertTrue(received.has(255));
+  assertTrue(received.release(255));
+  assertFalse(received.has(255));
+  assertEqual(received.mark(0x8000), MqttReceived::New);    // page of 1 and 255 is free
+  assertFalse(received.has(0x8001));
+  assertEqual(received.size(), (size_t)2);
+}
+
+struct Fired
+{
+  std::vector<int>* order;
+  int id;
+  TimingWheel::Timer* cancel = nullptr;
+  static void callback(void* ptr)
+  {
+    Fired* fired = static_cast<Fired*>(ptr);
+    fired->order->push_back(fired->id);
+    if (fired->cancel) fired->cancel->cancel();
+  }
+};
+
+test(nowifi_timing_wheel_fires_in_order)
+{
+  for(uint32_t start: { 1000u, 0xFFFFFF00u })   // millis() wraps
+  {
+    TimingWheel wheel;
+    std::vector<int> order;
+    Fired f1{&order, 1}, f2{&order, 2}, f3{&order, 3}, f4{&order, 4};
+    TimingWheel::Timer t1(Fired::callback, &f1), t2(Fired::callback, &f2);
+    TimingWheel::Timer t3(Fired::callback, &f3), t4(Fired::callback, &f4);
+    f1.cancel = &t4;
+
+    wheel.schedule(t3, 300000, start);  // level 3
+    wheel.schedule(t2, 5000, start);
+    wheel.schedule(t4, 10, start);      // same tick, cancelled by t1
+    wheel.schedule(t1, 10, start);
+    assertEqual(wheel.size(), (size_t)4);
+    assertLessOrEqual(wheel.idle(start, 1000), (uint32_t)10);   // never after a due timer
+
+    wheel.advance(start+9);
+    assertEqual(order.size(), (size_t)0);
+    wheel.advance(start+10);
+    assertEqual(order.size(), (size_t)1);
+    assertFalse(t4.scheduled());
+    assertLessOrEqual(wheel.idle(start+10, 100000), (uint32_t)4990);
+    wheel.advance(start+4999);
+    assertEqual(order.size(), (size_t)1);
+    wheel.advance(start+6000);
+    wheel.advance(start+299999);
+    assertEqual(order.size(), (size_t)2);
+    wheel.advance(start+300000);
+    assertEqual(order.size(), (size_t)3);
+    assertEqual(order[0], 1);
+    assertEqual(order[1], 2);
+    assertEqual(order[2], 3);
+    assertEqual(wheel.size(), (size_t)0);
+    assertEqual(wheel.idle(start, 1000), (uint32_t)1000);
+  }
+}
+
+test(nowifi_slot_map_handles)
+{
+  SlotMap<int> map;
+  SlotHandle a = map.insert(1);
+  SlotHandle b = map.insert(2);
+  SlotHandle c = map.insert(3);
+  assertTrue(map.erase(a));
+  assertFalse(map.erase(a));
+  assertTrue(map.get(a) == nullptr);
+  assertEqual(*map.get(c), 3);   // moved to the place of a
+  assertEqual(map[0], 3);
+
+  SlotHandle d = map.insert(4);   // reuses the slot of a
+  assertEqual(d.slot, a.slot);
+  assertTrue(map.get(a) == nullptr);
+  assertEqual(*map.get(d), 4);
+  assertEqual(*map.get(b), 2);
+  assertEqual(map.size(), (size_t)3);
+}
+
 //----------------------------------------------------------------------------
 // setup() and loop()
 void setup() {
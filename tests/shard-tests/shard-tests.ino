@@ -0,0 +1,181 @@
+// vim: ts=2 sw=2 expandtab
+#include <Arduino.h>
+#include <AUnit.h>
+#include <TinyMqtt.h>
+#include <MqttShards.h>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <vector>
+
+/**
+  * TinyMqtt sharded broker unit tests.
+  *
+  * Shards run in their own threads, clients are connected through
+  * real sockets on 127.0.0.1 and run by the test thread.
+  **/
+
+using string = TinyConsole::string;
+
+const uint16_t port = 18831;
+
+std::map<const MqttClient*, int> received;
+
+void onPublish(const MqttClient* client, const Topic&, const char*, size_t)
+{
+  received[client]++;
+}
+
+// Runs the clients until done() or timeout_ms
+template<class Done>
+bool runUntil(std::vector<MqttClient*>& clients, Done done, uint32_t timeout_ms=2000)
+{
+  uint32_t start = millis();
+  while(not done())
+  {
+    if (millis() - start > timeout_ms) return false;
+    for(auto client: clients) client->loop();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));  // the shards run meanwhile
+  }
+  return true;
+}
+
+std::vector<MqttClient*> subscribers(int count, const char* topic)
+{
+  std::vector<MqttClient*> clients;
+  for(int i=0; i<count; i++)
+  {
+    MqttClient* client = new MqttClient(string(topic) + std::to_string(i));
+    client->setCallback(onPublish);
+    client->connect("127.0.0.1", port);
+    client->subscribe(topic);
+    clients.push_back(client);
+  }
+  return clients;
+}
+
+test(shard_frame_queue_many_producers)
+{
+  MqttFrameQueue queue(1000);
+  assertEqual(queue.capacity(), (size_t)1024);
+
+  const int producers = 4;
+  const int frames = 20000;
+  std::vector<std::thread> threads;
+  for(int p=0; p<producers; p++)
+  {
+    threads.push_back(std::thread([&queue, p]()
+    {
+      MqttBuffer bytes;
+      bytes.append("x", 1);
+      MqttFrame frame(std::move(bytes));
+      for(int i=0; i<frames; i++)
+        while(not queue.push(frame)) std::this_thread::yield();
+    }));
+  }
+  int popped = 0;
+  MqttFrame frame;
+  while(popped < producers*frames)
+  {
+    if (queue.pop(frame))
+      popped++;
+    else
+      std::this_thread::yield();
+  }
+  for(auto& thread: threads) thread.join();
+  assertFalse(queue.pop(frame));
+  assertEqual(frame.refs(), (uint32_t)1);   // all the other copies were released
+}
+
+test(shard_frame_released_to_its_owner_pool)
+{
+  MqttBufferPool& pool = MqttBufferPool::get();
+  size_t in_use = pool.stats().in_use;
+  std::vector<MqttFrame> frames;
+  for(int i=0; i<100; i++)
+  {
+    MqttBuffer bytes;
+    bytes.append("frame bytes", 11);
+    frames.push_back(MqttFrame(std::move(bytes)));
+  }
+  size_t used = pool.stats().in_use;
+  assertTrue(used > in_use);
+
+  // The other thread drops the last references
+  std::thread other([&frames]() { frames.clear(); });
+  other.join();
+  assertEqual(pool.stats().in_use, used);   // not given back yet
+
+  uint32_t misses = MqttBufferPool::get().stats().misses;   // collects the returned blocks
+  assertEqual(pool.stats().in_use, in_use);
+
+  // and reuses them
+  for(int i=0; i<100; i++)
+  {
+    MqttBuffer bytes;
+    bytes.append("frame bytes", 11);
+    frames.push_back(MqttFrame(std::move(bytes)));
+  }
+  assertEqual(pool.stats().misses, misses);
+}
+
+test(shard_publish_reaches_every_shard)
+{
+  MqttShardedBroker broker(port, 4);
+  broker.begin();
+  received.clear();
+
+  std::vector<MqttClient*> clients = subscribers(16, "s/t");
+  MqttClient publisher("publisher");
+  publisher.connect("127.0.0.1", port);
+  clients.push_back(&publisher);
+  assertTrue(runUntil(clients, [&broker]() { return broker.clientsCount() == 17; }));
+  runUntil(clients, []() { return false; }, 100);   // subscriptions done
+
+  publisher.publish("s/t", "payload", 7, false, 0);
+  assertTrue(runUntil(clients, []() { return received.size() == 16; }));
+  runUntil(clients, []() { return false; }, 50);
+  for(auto it: received) assertEqual(it.second, 1);
+  assertEqual(broker.forwarded(), (uint64_t)3);
+  assertEqual(broker.dropped(), (uint64_t)0);
+
+  clients.pop_back();
+  for(auto client: clients) delete client;
+  broker.end();
+  assertEqual(broker.clientsCount(), (size_t)0);
+}
+
+test(shard_retained_by_every_shard)
+{
+  MqttShardedBroker broker(port, 4, 10);
+  broker.begin();
+  received.clear();
+
+  MqttClient publisher("publisher");
+  publisher.connect("127.0.0.1", port);
+  std::vector<MqttClient*> clients{&publisher};
+  assertTrue(runUntil(clients, [&broker]() { return broker.clientsCount() == 1; }));
+  publisher.publish("r", "retained", 8, true, 0);
+  assertTrue(runUntil(clients, [&broker]() { return broker.forwarded() == 3; }));
+
+  clients = subscribers(12, "r");
+  assertTrue(runUntil(clients, []() { return received.size() == 12; }));
+  for(auto client: clients) delete client;
+  broker.end();
+}
+
+//----------------------------------------------------------------------------
+// setup() and loop()
+void setup() {
+  delay(1000);
+  Serial.begin(115200);
+  while(!Serial);
+
+  Serial.println("=============[ SHARD TinyMqtt TESTS              ]========================");
+}
+
+void loop() {
+  aunit::TestRunner::run();
+
+  if (Serial.available()) ESP.reset();
+}
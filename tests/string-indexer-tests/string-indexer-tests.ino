@@ -3,6 +3,7 @@
 #include <AUnit.h>
 #include <StringIndexer.h>
 #include <map>
+#include <vector>
 
 /**
   * TinyMqtt / StringIndexer unit tests.
@@ -13,23 +14,23 @@ using string = TinyConsole::string;
 
 test(indexer_empty)
 {
-  assertEqual(StringIndexer::count(), 0);
+  assertEqual(StringIndexer::count(), (size_t)0);
 }
 
 test(indexer_strings_deleted_should_empty_indexer)
 {
-  assertTrue(StringIndexer::count()==0);
+  assertEqual(StringIndexer::count(), (size_t)0);
   {
     IndexedString one("one");
-    assertEqual(StringIndexer::count(), 1);
+    assertEqual(StringIndexer::count(), (size_t)1);
     IndexedString two("two");
-    assertEqual(StringIndexer::count(), 2);
+    assertEqual(StringIndexer::count(), (size_t)2);
     IndexedString three("three");
-    assertEqual(StringIndexer::count(), 3);
+    assertEqual(StringIndexer::count(), (size_t)3);
     IndexedString four("four");
-    assertEqual(StringIndexer::count(), 4);
+    assertEqual(StringIndexer::count(), (size_t)4);
   }
-  assertEqual(StringIndexer::count(), 0);
+  assertEqual(StringIndexer::count(), (size_t)0);
 }
 
 test(indexer_same_strings_count_as_one)
@@ -39,7 +40,7 @@ test(indexer_same_strings_count_as_one)
   IndexedString three("one");
   IndexedString fourt("one");
 
-  assertEqual(StringIndexer::count(), 1);
+  assertEqual(StringIndexer::count(), (size_t)1);
 }
 
 test(indexer_size_of_indexed_string)
@@ -77,9 +78,9 @@ test(indexer_indexed_operator_eq)
   {
     IndexedString same = one;
     assertTrue(one == same);
-    assertEqual(StringIndexer::count(), 1);
+    assertEqual(StringIndexer::count(), (size_t)1);
   }
-  assertEqual(StringIndexer::count(), 1);
+  assertEqual(StringIndexer::count(), (size_t)1);
 }
 
 test(indexer_get_string)
@@ -102,6 +103,80 @@ test(indexer_get_index)
   assertTrue(one1.getIndex() != two1.getIndex());
 }
 
+test(indexer_released_index_is_reused)
+{
+  StringIndexer::index_t index;
+  {
+    IndexedString one("one");
+    IndexedString two("two");
+    index = one.getIndex();
+  }
+  IndexedString three("three");
+  assertTrue(three.getIndex() == index);   // last released is reused first
+  assertEqual(StringIndexer::count(), (size_t)1);
+}
+
+test(indexer_move_and_assign_keep_count)
+{
+  IndexedString one("one");
+  {
+    IndexedString two("two");
+    IndexedString moved(std::move(two));
+    IndexedString assigned("three");
+    assigned = one;
+    assertEqual(StringIndexer::count(), (size_t)2);  // three is released
+    assertTrue(moved.str() == "two");
+  }
+  assertEqual(StringIndexer::count(), (size_t)1);
+  assertTrue(one.str() == "one");
+}
+
+test(indexer_many_strings_with_collisions)
+{
+  // As many strings as the indexes allow (TINY_MQTT_INDEX_BITS), up to 1000
+  const int many = StringIndexer::MaxIndex < 1000 ? StringIndexer::MaxIndex & ~1 : 1000;
+  std::vector<IndexedString> strings;
+  for(int i=0; i<many; i++)
+    strings.push_back(IndexedString(string("sensor/")+std::to_string(i).c_str()));
+  assertEqual(StringIndexer::count(), (size_t)many);
+
+  // Remove one over two, the others must still be found
+  for(int i=many-1; i>=0; i-=2) strings.erase(strings.begin()+i);
+  assertEqual(StringIndexer::count(), (size_t)many/2);
+  for(int i=0; i<many; i+=2)
+  {
+    IndexedString again(string("sensor/")+std::to_string(i).c_str());
+    assertTrue(again == strings[i/2]);
+  }
+  assertEqual(StringIndexer::count(), (size_t)many/2);
+}
+
+static size_t overflowed = 0;
+void onOverflow(const char*, size_t) { overflowed++; }
+
+test(indexer_overflow_is_reported)
+{
+  StringIndexer::onOverflow(onOverflow);
+  {
+    std::vector<IndexedString> strings;
+    strings.reserve(StringIndexer::MaxIndex);
+    for(size_t i=0; i<StringIndexer::MaxIndex; i++)
+      strings.push_back(IndexedString(std::to_string(i).c_str()));
+    assertEqual(StringIndexer::count(), (size_t)StringIndexer::MaxIndex);
+    assertTrue(strings.back().valid());
+
+    IndexedString too_many("too many");
+    assertFalse(too_many.valid());
+    assertEqual(StringIndexer::overflows(), (uint32_t)1);
+    assertEqual(overflowed, (size_t)1);
+  }
+  StringIndexer::onOverflow(nullptr);
+  assertEqual(StringIndexer::count(), (size_t)0);
+
+  IndexedString one("one");
+  assertTrue(one.valid());
+}
+
 //----------------------------------------------------------------------------
 // setup() and loop()
 void setup() {
@@ -2,7 +2,10 @@
 #include <Arduino.h>
 #include <AUnit.h>
 #include <TinyMqtt.h>
+#include <TopicDictionary.h>
 #include <map>
+#include <vector>
+#include <algorithm>
 #include <iostream>
 
 /**
@@ -15,6 +18,11 @@ bool testTopicMatch(const char* a, const char* b, bool expected)
   Topic ta(a);
   Topic tb(b);
   bool match(ta.matches(tb));
+  if (TopicFilter(ta).matches(tb) != match)
+  {
+    std::cout << "  compiled filter " << a << " disagrees for " << b << std::endl;
+    return false;
+  }
   std::cout << "  " << ta.c_str() << ' ';
   if (match != expected)
     std::cout << (expected ? " should match " : " should not match ");
@@ -34,6 +42,7 @@ test(topic_matches)
   assertTrue(testTopicMatch("*/c"      , "a/b/c"     , true));
   assertTrue(testTopicMatch("/*/c"     , "/a/b/c"    , true));
   assertTrue(testTopicMatch("a/*"      , "a/b/c/d"   , true));
+  assertTrue(testTopicMatch("a/*"      , "a"         , true));
   assertTrue(testTopicMatch("a/+/c"    , "a/b/c"     , true));
   assertTrue(testTopicMatch("a/+/c/+/e", "a/b/c/d/e" , true));
   assertTrue(testTopicMatch("a/*/c/+/e", "a/b/c/d/e" , true));
@@ -47,6 +56,7 @@ test(topic_matches)
   assertTrue(testTopicMatch("a/b/c"    , "a/b/d"     , false));
   assertTrue(testTopicMatch("a/b/c"    , "a/b/d"     , false));
   assertTrue(testTopicMatch("a/*/e"    , "a/b/c/d/f" , false));
+  assertTrue(testTopicMatch("a/*/c"    , "a/b/cd"    , false));
   assertTrue(testTopicMatch("a/+"      , "a"         , false));
   assertTrue(testTopicMatch("a/+"      , "a/b/d"     , false));
   assertTrue(testTopicMatch("a/+/"     , "a/"        , false));
@@ -65,6 +75,215 @@ test(topic_matches)
 
 }
 
+bool testTreeMatch(const char* filter, const char* topic, bool expected)
+{
+  TopicTree<int> tree;
+  int subscriber;
+  tree.add(Topic(filter).levels(), &subscriber);
+  std::vector<int*> matching;
+  tree.match(Topic(topic).levels(), matching);
+  bool match = matching.size() and matching[0] == &subscriber;
+  if (match != expected)
+    std::cout << "  tree: " << filter << (expected ? " should match " : " should not match ") << topic << std::endl;
+  return expected == match;
+}
+
+test(topic_tree_matches)
+{
+  assertTrue(testTreeMatch("a/b/c"    , "a/b/c"     , true));
+  assertTrue(testTreeMatch("a/*/c"    , "a/xyz/c"   , true));
+  assertTrue(testTreeMatch("a/*/e"    , "a/b/c/d/e" , true));
+  assertTrue(testTreeMatch("a/*"      , "a/b/c/d/e" , true));
+  assertTrue(testTreeMatch("a/*"      , "a"         , true));
+  assertTrue(testTreeMatch("*/c"      , "a/b/c"     , true));
+  assertTrue(testTreeMatch("/*/c"     , "/a/b/c"    , true));
+  assertTrue(testTreeMatch("a/+/c"    , "a/b/c"     , true));
+  assertTrue(testTreeMatch("a/+/c/+/e", "a/b/c/d/e" , true));
+  assertTrue(testTreeMatch("a/*/c/+/e", "a/b/c/d/e" , true));
+  assertTrue(testTreeMatch("/+/b"     , "/a/b"      , true));
+  assertTrue(testTreeMatch("+"        , "a"         , true));
+  assertTrue(testTreeMatch("a/b/#"    , "a/b/c/d"   , true));
+  assertTrue(testTreeMatch("a/b/#"    , "a/b"       , true));
+  assertTrue(testTreeMatch("#"        , "a/b"       , true));
+
+  assertTrue(testTreeMatch("a/b/c"    , "a/b/d"     , false));
+  assertTrue(testTreeMatch("a/*/e"    , "a/b/c/d/f" , false));
+  assertTrue(testTreeMatch("a/*/c"    , "a/b/cd"    , false));
+  assertTrue(testTreeMatch("a/+"      , "a"         , false));
+  assertTrue(testTreeMatch("a/+"      , "a/b/d"     , false));
+  assertTrue(testTreeMatch("a/+/"     , "a/"        , false));
+
+  assertTrue(testTreeMatch("+/any"    , "$SYS/any"  , false));
+  assertTrue(testTreeMatch("*/any"    , "$SYS/any"  , false));
+  assertTrue(testTreeMatch("#"        , "$SYS/any"  , false));
+  assertTrue(testTreeMatch("$SYS/any" , "$SYS/any"  , true));
+  assertTrue(testTreeMatch("$SYS/+/y" , "$SYS/a/y"  , true));
+  assertTrue(testTreeMatch("$SYS/#"   , "$SYS/a/y"  , true));
+
+  assertTrue(testTreeMatch("a/#/b"    , "a/x/b"     , false));
+  assertTrue(testTreeMatch("a/b/#/d"  , "a/b/c/d"   , false));
+}
+
+test(topic_tree_add_remove)
+{
+  TopicTree<int> tree;
+  int a, b;
+  std::vector<int*> matching;
+
+  assertTrue(tree.add(Topic("x/+/z").levels(), &a));
+  assertFalse(tree.add(Topic("x/+/z").levels(), &a));
+  assertTrue(tree.add(Topic("x/y/z").levels(), &a));
+  assertTrue(tree.add(Topic("x/y/z").levels(), &b));
+  assertEqual(tree.size(), (size_t)3);
+
+  tree.match(Topic("x/y/z").levels(), matching);
+  assertEqual(matching.size(), (size_t)3);  // a is returned twice
+
+  assertTrue(tree.remove(Topic("x/y/z").levels(), &a));
+  assertFalse(tree.remove(Topic("x/y/z").levels(), &a));
+  assertFalse(tree.remove(Topic("x/unknown").levels(), &a));
+  matching.clear();
+  tree.match(Topic("x/y/z").levels(), matching);
+  assertEqual(matching.size(), (size_t)2);
+
+  assertTrue(tree.remove(Topic("x/+/z").levels(), &a));
+  assertTrue(tree.remove(Topic("x/y/z").levels(), &b));
+  assertTrue(tree.empty());
+  matching.clear();
+  tree.match(Topic("x/y/z").levels(), matching);
+  assertEqual(matching.size(), (size_t)0);
+}
+
+test(topic_filter_kinds)
+{
+  assertEqual(TopicFilter("a/b/c").kind(), TopicFilter::Exact);
+  assertEqual(TopicFilter("a/b/#").kind(), TopicFilter::Prefix);
+  assertEqual(TopicFilter("#").kind(), TopicFilter::Prefix);
+  assertEqual(TopicFilter("a/+/c").kind(), TopicFilter::Generic);
+  assertEqual(TopicFilter("a/*").kind(), TopicFilter::Generic);
+  assertEqual(TopicFilter("a/+/#").kind(), TopicFilter::Generic);
+
+  assertTrue(TopicFilter("#").matches(Topic("a/b")));
+  assertFalse(TopicFilter("#").matches(Topic("$SYS/b")));
+  assertTrue(TopicFilter("a/b/#").matches(Topic("a/b")));
+  assertFalse(TopicFilter("a/b/#").matches(Topic("a/c/d")));
+  assertFalse(TopicFilter("a/b/c").matches(Topic("a/b")));
+}
+
+test(topic_filter_covers)
+{
+  assertTrue(TopicFilter("a/#").covers(TopicFilter("a/b")));
+  assertTrue(TopicFilter("a/#").covers(TopicFilter("a/+/c")));
+  assertTrue(TopicFilter("a/#").covers(TopicFilter("a/b/#")));
+  assertTrue(TopicFilter("a/#").covers(TopicFilter("a")));
+  assertTrue(TopicFilter("a/+").covers(TopicFilter("a/b")));
+  assertTrue(TopicFilter("+/+").covers(TopicFilter("a/+")));
+  assertTrue(TopicFilter("a/*").covers(TopicFilter("a/b/#")));
+  assertTrue(TopicFilter("a/b").covers(TopicFilter("a/b")));
+  assertTrue(TopicFilter("#").covers(TopicFilter("+/#")));
+
+  assertFalse(TopicFilter("a/b").covers(TopicFilter("a/+")));
+  assertFalse(TopicFilter("a/+").covers(TopicFilter("a/#")));
+  assertFalse(TopicFilter("a/+").covers(TopicFilter("a/b/c")));
+  assertFalse(TopicFilter("a/b/#").covers(TopicFilter("a/#")));
+  assertFalse(TopicFilter("#").covers(TopicFilter("$SYS/x")));
+  assertTrue(TopicFilter("$SYS/#").covers(TopicFilter("$SYS/x")));
+
+  // Every topic matched by the covered filter is matched by the other one
+  const char* filters[] = { "a/b", "a/+", "a/#", "a/+/c", "+/b/#", "#", "a/*", "a/b/#" };
+  const char* topics[] = { "a", "a/b", "a/c", "a/b/c", "a/x/c", "x/b", "x/b/c", "a/b/c/d" };
+  for(auto f: filters)
+    for(auto g: filters)
+    {
+      if (not TopicFilter(f).covers(TopicFilter(g))) continue;
+      for(auto t: topics)
+        if (TopicFilter(g).matches(Topic(t))) assertTrue(TopicFilter(f).matches(Topic(t)));
+    }
+}
+
+test(topic_filter_set_matches_like_filters)
+{
+  const char* filters[] = {
+    "a/b/c", "a/b/#", "#", "a/+/c", "a/*", "x/y", "a/#", "+/b/+", "$SYS/#", "a/b/c/d/#",
+    "x/y/z", "a/b", "*/c", "a/b/c/#", "b/#", "+", "a/b/d", "q/r/s/t", "a/+/+/d", "y/#" };
+  const char* topics[] = {
+    "a/b/c", "a/b", "a", "x/y", "x/y/z", "$SYS/load", "a/b/c/d", "a/z/c", "b", "q/r/s/t", "c/b/a" };
+
+  std::vector<TopicFilter> compiled;
+  TopicFilterSet<TopicFilter> set;
+  for(int copy=0; copy<3; copy++)   // more than 32 filters
+  {
+    for(auto f: filters)
+    {
+      compiled.push_back(TopicFilter(f));
+      assertEqual((size_t)set.add(compiled.back()), compiled.size()-1);
+    }
+  }
+
+  for(auto t: topics)
+  {
+    Topic topic(t);
+    std::vector<TopicFilterSet<TopicFilter>::Id> ids;
+    set.match(topic, ids);
+    std::sort(ids.begin(), ids.end());
+
+    std::vector<TopicFilterSet<TopicFilter>::Id> expected;
+    for(size_t i=0; i<compiled.size(); i++)
+      if (compiled[i].matches(topic)) expected.push_back(i);
+
+    assertTrue(ids == expected);
+    assertEqual(set.any(topic), expected.size() != 0);
+  }
+  assertFalse(set.any(Topic("$nothing/here")));
+}
+
+test(topic_levels_are_shared)
+{
+  Topic temp("home/sensor/temp");
+  Topic hum("home/sensor/hum");
+  const auto& t = temp.levels();
+  const auto& h = hum.levels();
+
+  assertEqual(t.size(), (size_t)3);
+  assertEqual(h.size(), (size_t)3);
+  assertTrue(t[0] == h[0]);
+  assertTrue(t[1] == h[1]);
+  assertTrue(t[2] != h[2]);
+  assertTrue(StringIndexer::str(t[1]) == "sensor");
+  assertTrue(&temp.levels() == &t);   // Split only once
+
+  Topic single("home");
+  assertEqual(single.levels().size(), (size_t)1);
+  assertTrue(single.levels()[0] == t[0]);
+}
+
+constexpr const char* dictionary_names[] = { "sensor/temp", "light/state", "light/+" };
+constexpr size_t LightState = topicId(dictionary_names, "light/state");
+static_assert(LightState == 1, "topicId is resolved at compile time");
+static_assert(topicId(dictionary_names, "unknown") == 3, "unknown topics are not found");
+
+test(topic_dictionary)
+{
+  size_t count = StringIndexer::count();
+  {
+    TopicDictionary<3> topics(dictionary_names);
+    assertEqual(topics.size(), (size_t)3);
+    assertEqual(StringIndexer::count(), count+3);
+
+    // same index as the dynamic topic, nothing indexed
+    Topic state = topics[LightState];
+    assertTrue(state == Topic("light/state"));
+    assertEqual(state.c_str(), "light/state");
+    assertEqual(StringIndexer::count(), count+3);
+    assertTrue(TopicFilter(topics[2]).matches(state));
+
+    assertFalse(topics[3].valid());
+    assertEqual(topics.name(0), "sensor/temp");
+  }
+  // released with the dictionary
+  assertEqual(StringIndexer::count(), count);
+}
+
 //----------------------------------------------------------------------------
 // setup() and loop()
 void setup() {